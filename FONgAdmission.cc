@@ -0,0 +1,206 @@
+// FONgAdmission.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/file.h>
+
+#include <sstream>
+#include <vector>
+
+#include <BESSyntaxUserError.h>
+#include <BESDebug.h>
+
+#include "FONgAdmission.h"
+#include "FONgRequestHandler.h"
+#include "FONgRequestLog.h"
+
+using namespace std;
+
+// The reservations are kept in this file in FONg.Tempdir
+#define ADMISSION_FILE "fong_admission"
+
+// Time between attempts to be admitted, in microseconds
+#define ADMISSION_POLL 100000
+
+struct reservation {
+    long pid;
+    unsigned long long bytes;
+};
+
+// Open and lock the reservations file; returns -1 if that fails
+static int lock_reservations(const string &file)
+{
+    int fd = open(file.c_str(), O_RDWR | O_CREAT, 0664);
+    if (fd == -1)
+        return -1;
+
+    if (flock(fd, LOCK_EX) == -1) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static void unlock_reservations(int fd)
+{
+    flock(fd, LOCK_UN);
+    close(fd);
+}
+
+// Read the reservations, dropping those of processes that have died
+static vector<reservation> read_reservations(int fd)
+{
+    string text;
+    char buf[4096];
+    ssize_t n;
+    while ((n = pread(fd, buf, sizeof(buf), text.length())) > 0)
+        text.append(buf, n);
+
+    vector<reservation> reservations;
+    istringstream in(text);
+    reservation r;
+    while (in >> r.pid >> r.bytes) {
+        if (kill(static_cast<pid_t>(r.pid), 0) == 0 || errno != ESRCH)
+            reservations.push_back(r);
+    }
+
+    return reservations;
+}
+
+static bool write_reservations(int fd, const vector<reservation> &reservations)
+{
+    ostringstream out;
+    for (vector<reservation>::const_iterator i = reservations.begin(); i != reservations.end(); ++i)
+        out << i->pid << " " << i->bytes << "\n";
+
+    string text = out.str();
+    return ftruncate(fd, 0) == 0 && pwrite(fd, text.data(), text.length(), 0) == static_cast<ssize_t>(text.length());
+}
+
+static string megabytes(unsigned long long bytes)
+{
+    ostringstream oss;
+    oss << (bytes + 1024 * 1024 - 1) / (1024 * 1024);
+    return oss.str();
+}
+
+/** @brief Wait until there is memory for a conversion
+ *
+ * @param dir The directory that holds the reservations (FONg.Tempdir)
+ * @param bytes The memory the conversion needs
+ * @exception BESSyntaxUserError if the conversion needs more than
+ * FONg.AdmissionBudget, or if it is not admitted within
+ * FONg.AdmissionTimeout seconds. The latter is not a fault of the
+ * server; the message tells the client to retry.
+ */
+FONgAdmission::FONgAdmission(const string &dir, unsigned long long bytes) :
+        d_file(dir + "/" + ADMISSION_FILE), d_bytes(bytes), d_admitted(false)
+{
+    unsigned long long budget = FONgRequestHandler::admission_budget;
+    if (budget == 0)
+        return;
+
+    if (bytes > budget)
+        throw BESSyntaxUserError("This request needs about " + megabytes(bytes) + " MB of memory to convert, more than the "
+            + megabytes(budget) + " MB this server allows; use a constraint to ask for less data.", __FILE__, __LINE__);
+
+    double deadline = FONgRequestLog::now() + FONgRequestHandler::admission_timeout;
+    while (!m_reserve()) {
+        if (FONgRequestLog::now() >= deadline) {
+            ostringstream oss;
+            oss << "The server is busy with other large conversions and could not start this one within "
+                << FONgRequestHandler::admission_timeout << " seconds; the request can be retried later.";
+            throw BESSyntaxUserError(oss.str(), __FILE__, __LINE__);
+        }
+
+        usleep(ADMISSION_POLL);
+    }
+}
+
+FONgAdmission::~FONgAdmission()
+{
+    if (d_admitted)
+        m_release();
+}
+
+/** Reserve d_bytes if they fit in the budget. If the reservations file
+ * cannot be used, the request is admitted without a reservation.
+ *
+ * @return True if admitted */
+bool FONgAdmission::m_reserve()
+{
+    int fd = lock_reservations(d_file);
+    if (fd == -1) {
+        BESDEBUG("fong", "FONgAdmission: could not lock " << d_file << "; admitting the request" << endl);
+        return true;
+    }
+
+    vector<reservation> reservations = read_reservations(fd);
+
+    unsigned long long total = 0;
+    for (vector<reservation>::iterator i = reservations.begin(); i != reservations.end(); ++i)
+        total += i->bytes;
+
+    bool fits = total + d_bytes <= FONgRequestHandler::admission_budget;
+    if (fits) {
+        reservation r = { static_cast<long>(getpid()), d_bytes };
+        reservations.push_back(r);
+        d_admitted = write_reservations(fd, reservations);
+    }
+
+    BESDEBUG("fong2", "FONgAdmission: " << d_bytes << " bytes requested, " << total << " reserved; "
+             << (fits ? "admitted" : "waiting") << endl);
+
+    unlock_reservations(fd);
+
+    return fits;
+}
+
+/** Remove this process' reservation */
+void FONgAdmission::m_release()
+{
+    int fd = lock_reservations(d_file);
+    if (fd == -1)
+        return;
+
+    vector<reservation> reservations = read_reservations(fd);
+    for (vector<reservation>::iterator i = reservations.begin(); i != reservations.end(); ++i) {
+        if (i->pid == static_cast<long>(getpid()) && i->bytes == d_bytes) {
+            reservations.erase(i);
+            break;
+        }
+    }
+
+    (void) write_reservations(fd, reservations);
+    unlock_reservations(fd);
+
+    d_admitted = false;
+}
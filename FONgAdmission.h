@@ -0,0 +1,69 @@
+// FONgAdmission.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgAdmission_h_
+#define FONgAdmission_h_ 1
+
+#include <string>
+
+using std::string;
+
+/** @brief Limit the memory used by the conversions running at once
+ *
+ * Before a transmitter reads the data for a response it makes one of
+ * these with an estimate of the memory the conversion will need (see
+ * FONgTransform::estimated_working_set()). The constructor waits until
+ * the estimates of all the conversions running in the BES processes on
+ * this host, plus this one, fit in FONg.AdmissionBudget; the destructor
+ * gives the memory back.
+ *
+ * The reservations are kept in a file in FONg.Tempdir, one line (process
+ * id, bytes) per conversion, locked with flock() while it is changed.
+ * Reservations of processes that have died are dropped.
+ *
+ * A request that needs more than the whole budget is rejected at once;
+ * one that cannot be admitted within FONg.AdmissionTimeout seconds is
+ * rejected as busy and can be retried. Both are reported as user errors,
+ * not internal ones. When FONg.AdmissionBudget is zero, every request is admitted.
+ */
+class FONgAdmission {
+private:
+    string d_file;
+    unsigned long long d_bytes;
+    bool d_admitted;
+
+    bool m_reserve();
+    void m_release();
+
+    FONgAdmission(const FONgAdmission &);
+    FONgAdmission &operator=(const FONgAdmission &);
+
+public:
+    FONgAdmission(const string &dir, unsigned long long bytes);
+    virtual ~FONgAdmission();
+
+    bool admitted() const { return d_admitted; }
+};
+
+#endif // FONgAdmission_h_
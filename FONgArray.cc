@@ -0,0 +1,750 @@
+// FONgArray.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <sstream>
+
+#include <gdal.h>
+#include <gdal_priv.h>
+
+#include <DDS.h>
+#include <Array.h>
+#include <util.h>
+
+#include <BESInternalError.h>
+#include <BESDebug.h>
+
+#include "GeoTiffTransmitter.h"
+#include "FONgTransform.h"
+#include "FONgBaseType.h"
+#include "FONgArray.h"
+#include "FONgProjectionCache.h"
+#include "FONgBufferPool.h"
+
+using namespace libdap;
+
+/** @brief Constructor for FONgArray that takes a DAP Array
+ *
+ * @param a A DAP Array
+ * @param dds The DDS that holds the Array; its coordinate variables are
+ * found there. May be null for the Array of a Grid.
+ */
+FONgArray::FONgArray(Array *a, DDS *dds) : FONgBaseType(), d_array(a), d_dds(dds), d_lat(0), d_lon(0),
+    d_band_dims(0), d_slice(0)
+{
+    d_name = a->name();
+    d_type = dods_array_c;
+
+    // Build sets of attribute values for easy searching.
+    // Copied from GeoConstriant in libdap. That class is
+    // abstract and didn't want to modify libdap's ABI for this hack.
+
+    d_coards_lat_units.insert("degrees_north");
+    d_coards_lat_units.insert("degree_north");
+    d_coards_lat_units.insert("degree_N");
+    d_coards_lat_units.insert("degrees_N");
+
+    d_coards_lon_units.insert("degrees_east");
+    d_coards_lon_units.insert("degree_east");
+    d_coards_lon_units.insert("degrees_E");
+    d_coards_lon_units.insert("degree_E");
+
+    d_lat_names.insert("COADSY");
+    d_lat_names.insert("lat");
+    d_lat_names.insert("Lat");
+    d_lat_names.insert("LAT");
+
+    d_lon_names.insert("COADSX");
+    d_lon_names.insert("lon");
+    d_lon_names.insert("Lon");
+    d_lon_names.insert("LON");
+}
+
+/** @brief Destructor
+ *
+ * The DAP Array instance does not belong to the FONgArray instance, so
+ * it is not deleted.
+ */
+FONgArray::~FONgArray()
+{
+}
+
+/** This is used with find_if(). The GeoConstraint class holds a set of strings
+    which are prefixes for variable names. Using the regular find() locates
+    only the exact matches, using find_if() with this functor makes is easy
+    to treat those set<string> objects as collections of prefixes. */
+class is_prefix
+{
+private:
+    string s;
+public:
+    is_prefix(const string & in): s(in)
+    {}
+
+    bool operator()(const string & prefix)
+    {
+        return s.find(prefix) == 0;
+    }
+};
+
+/** Is this a latitude variable? Use CF's long_name attribute first, then
+ * drop into heuristics based on units names or common variable names.
+ *
+ * @param var_units The value of the 'unit' attribute
+ * @param var_name The name of the variable
+ * @param long_name The value of the long_name attribute
+ *
+ * @return true if there's a match, otherwise false
+ * @see m_lon_unit_or_name_match()
+ */
+bool
+FONgArray::m_lat_unit_or_name_match(const string &var_units, const string &var_name,
+                                   const string &long_name)
+{
+    return (long_name == "latitude"
+            || d_coards_lat_units.find(var_units) != d_coards_lat_units.end()
+            || find_if(d_lat_names.begin(), d_lat_names.end(), is_prefix(var_name)) != d_lat_names.end());
+}
+
+bool
+FONgArray::m_lon_unit_or_name_match(const string &var_units, const string &var_name,
+                                   const string &long_name)
+{
+    return (long_name == "longitude"
+            || d_coards_lon_units.find(var_units) != d_coards_lon_units.end()
+            || find_if(d_lon_names.begin(), d_lon_names.end(), is_prefix(var_name)) != d_lon_names.end());
+}
+
+/** Get the value of one of the Array's attributes. FONgGrid also looks
+ * at the Grid's attributes. */
+string FONgArray::m_get_attr(const string &name)
+{
+    return d_array->get_attr_table().get_attr(name);
+}
+
+/** Find the dimension of the Array that a one-dimensional coordinate
+ * Array c describes: the one with the same name or, failing that, the
+ * only one with the same (unconstrained) size. When several dimensions
+ * have that size (e.g., a square grid) there is no way to tell which one
+ * c describes, so none is returned rather than guessing. */
+static Array::Dim_iter matching_dimension(Array *a, Array *c)
+{
+    Array::Dim_iter cd = c->dim_begin();
+    for (Array::Dim_iter d = a->dim_begin(); d != a->dim_end(); ++d) {
+        if (!a->dimension_name(d).empty() && a->dimension_name(d) == c->dimension_name(cd)
+            && a->dimension_size(d) == c->dimension_size(cd))
+            return d;
+    }
+
+    Array::Dim_iter match = a->dim_end();
+    for (Array::Dim_iter d = a->dim_begin(); d != a->dim_end(); ++d) {
+        if (a->dimension_size(d) > 1 && a->dimension_size(d) == c->dimension_size(cd)) {
+            if (match != a->dim_end())
+                return a->dim_end();
+            match = d;
+        }
+    }
+
+    return match;
+}
+
+/** If btp is a latitude or longitude coordinate of the Array, use it.
+ * The coordinate is constrained like the dimension of the Array it
+ * describes; if it was read with some other constraint, its values are
+ * dropped so they will be read again. */
+void FONgArray::m_use_coordinate(BaseType *btp)
+{
+    Array *c = dynamic_cast<Array*>(btp);
+    if (!c || c == d_array || c->dimensions() != 1)
+        return;
+
+    Array::Dim_iter d = matching_dimension(d_array, c);
+    if (d == d_array->dim_end())
+        return;
+
+    string units = remove_quotes(c->get_attr_table().get_attr("units"));
+    string long_name = remove_quotes(c->get_attr_table().get_attr("long_name"));
+
+    bool lat = !d_lat && m_lat_unit_or_name_match(units, c->name(), long_name);
+    bool lon = !lat && !d_lon && m_lon_unit_or_name_match(units, c->name(), long_name);
+    if (!lat && !lon)
+        return;
+
+    Array::Dim_iter cd = c->dim_begin();
+    int start = d_array->dimension_start(d, true);
+    int stride = d_array->dimension_stride(d, true);
+    int stop = d_array->dimension_stop(d, true);
+    if (c->dimension_start(cd, true) != start || c->dimension_stride(cd, true) != stride
+        || c->dimension_stop(cd, true) != stop) {
+        if (c->read_p()) {
+            c->clear_local_data();
+            c->set_read_p(false);
+        }
+        c->add_constraint(cd, start, stride, stop);
+    }
+
+    BESDEBUG("fong3", "Using " << c->name() << " as the " << (lat ? "latitude" : "longitude") << " of " << d_array->name() << endl);
+
+    if (lat)
+        d_lat = c;
+    else
+        d_lon = c;
+}
+
+/** Find the latitude and longitude of a plain Array using CF: first the
+ * variables listed in its 'coordinates' attribute, then its coordinate
+ * variables (one-dimensional Arrays with the name of one of its
+ * dimensions). The units, long_name and name rules are the ones used for
+ * the maps of a Grid; see FONgGrid::find_lat_lon_maps().
+ *
+ * @return True if both are found, otherwise False */
+bool FONgArray::find_lat_lon_maps()
+{
+    if (!d_dds)
+        return false;
+
+    istringstream coordinates(remove_quotes(m_get_attr("coordinates")));
+    string name;
+    while ((!d_lat || !d_lon) && coordinates >> name)
+        m_use_coordinate(d_dds->var(name));
+
+    for (Array::Dim_iter d = d_array->dim_begin(); (!d_lat || !d_lon) && d != d_array->dim_end(); ++d) {
+        if (!d_array->dimension_name(d).empty())
+            m_use_coordinate(d_dds->var(d_array->dimension_name(d)));
+    }
+
+    return d_lat && d_lon;
+}
+
+// A map may differ from evenly spaced values by this fraction of its
+// spacing and still be used to georeference a band.
+#define FONG_MAP_SPACING_TOLERANCE 0.01
+
+/** Find the endpoints of a map held as values of type T and check that
+ * the values in between are evenly spaced. The check counts the values
+ * that are off instead of branching, so the loop vectorizes. NaNs count
+ * as off.
+ *
+ * @return True if the map is evenly spaced.
+ */
+template <typename T>
+static bool map_extent_of(const T *values, int n, FONgTransform::map_extent &e)
+{
+    e.length = n;
+    e.first = values[0];
+    e.last = values[n - 1];
+
+    if (n < 3)
+        return true;
+
+    const double first = e.first;
+    const double step = (e.last - e.first) / (n - 1);
+    const double tolerance = fabs(step) * FONG_MAP_SPACING_TOLERANCE;
+
+    int off = 0;
+    for (int i = 1; i < n - 1; ++i)
+        off += !(fabs(values[i] - (first + i * step)) <= tolerance);
+
+    return off == 0;
+}
+
+/** @brief Get the length and endpoints of a lat or lon map
+ *
+ * The extent is cached in the FONgTransform, keyed by the map's fully
+ * qualified name and constraint, so the bands of a multiband response, and
+ * Arrays that use the same coordinate variables, read and check them only
+ * once. Variables with the same name in different Grids or Structures are
+ * not confused. The values are used in the map's own
+ * type, without copying them to an array of doubles.
+ *
+ * @param map The latitude or longitude map
+ * @param t The transform that holds the per-request cache
+ * @return The map's extent
+ * @exception Error if the map is empty, not numeric or not evenly spaced;
+ * such a map cannot be described by a GDAL geo transform.
+ */
+FONgTransform::map_extent FONgArray::m_map_extent(Array *map, FONgTransform &t)
+{
+    Array::Dim_iter d = map->dim_begin();
+    string key = map->FQN() + "[" + long_to_string(map->dimension_start(d, true)) + ":"
+            + long_to_string(map->dimension_stride(d, true)) + ":"
+            + long_to_string(map->dimension_stop(d, true)) + "]";
+
+    std::map<string, FONgTransform::map_extent>::iterator i = t.map_extents().find(key);
+    if (i != t.map_extents().end()) {
+        BESDEBUG("fong3", "Using the cached extent of map " << key << endl);
+        return i->second;
+    }
+
+    if (!map->read_p())
+        map->read();
+
+    int n = map->length();
+    if (n < 1)
+        throw Error("The map '" + map->name() + "' has no values.");
+
+    FONgTransform::map_extent e;
+    bool even;
+    const char *buf = map->get_buf();
+    switch (map->var()->type()) {
+    case dods_byte_c: even = map_extent_of(reinterpret_cast<const dods_byte*>(buf), n, e); break;
+    case dods_int16_c: even = map_extent_of(reinterpret_cast<const dods_int16*>(buf), n, e); break;
+    case dods_uint16_c: even = map_extent_of(reinterpret_cast<const dods_uint16*>(buf), n, e); break;
+    case dods_int32_c: even = map_extent_of(reinterpret_cast<const dods_int32*>(buf), n, e); break;
+    case dods_uint32_c: even = map_extent_of(reinterpret_cast<const dods_uint32*>(buf), n, e); break;
+    case dods_float32_c: even = map_extent_of(reinterpret_cast<const dods_float32*>(buf), n, e); break;
+    case dods_float64_c: even = map_extent_of(reinterpret_cast<const dods_float64*>(buf), n, e); break;
+    default:
+        throw Error("The map '" + map->name() + "' is not numeric.");
+    }
+
+    if (!even)
+        throw Error("The map '" + map->name()
+                + "' is not evenly spaced, so this data cannot be georeferenced correctly in the response.");
+
+    BESDEBUG("fong3", "Map " << key << ": length " << e.length << ", first " << e.first << ", last " << e.last << endl);
+
+    t.map_extents()[key] = e;
+    return e;
+}
+
+/** Extract the size (pixels), element data type and top-left and
+ * bottom-right lat/lon corner points for the Array. Also determine
+ * if this is a 2D or 3D Array and, in the latter case, ensure that
+ * the first dimension is not lat or lon. In that case, the geotiff
+ * will have N bands, where N is the number of elements from the
+ * first dimension in the current selection.
+ *
+ */
+void FONgArray::extract_coordinates(FONgTransform &t)
+{
+    BESDEBUG("fong3", "Entering FONgArray::extract_coordinates" << endl);
+
+    // Find the lat and lon maps for this Array
+    if (!find_lat_lon_maps())
+        throw Error("Could not find the latitude and longitude of '" + d_array->name() + "'.");
+
+    FONgTransform::map_extent lat = m_map_extent(d_lat, t);
+    FONgTransform::map_extent lon = m_map_extent(d_lon, t);
+
+    // The array size
+    t.set_height(lat.length);
+    t.set_width(lon.length);
+
+    t.set_top(lat.first);
+    t.set_left(lon.first);
+    t.set_bottom(lat.last);
+    t.set_right(lon.last);
+
+    // Read this from the 'missing_value' or '_FillValue' attributes
+    string missing_value = m_get_attr("missing_value");
+    if (missing_value.empty())
+        missing_value = m_get_attr("_FillValue");
+
+    BESDEBUG("fong3", "missing_value attribute: " << missing_value << endl);
+
+    // NB: no_data_type() is 'none' by default
+    if (!missing_value.empty()) {
+        t.set_no_data(missing_value);
+        if (t.no_data() < 0)
+            t.set_no_data_type(FONgTransform::negative);
+        else
+            t.set_no_data_type(FONgTransform::positive);
+    }
+
+    t.geo_transform_set(true);
+
+    t.set_num_bands(t.num_bands() + 1);
+    t.push_var(this);
+
+    if (!FONgTransform::multiband())
+        return;
+
+    // Make a band for each element of the dimensions that precede the
+    // last two whose size is not one (the rows and the columns)
+    vector<int> sizes;
+    for (Array::Dim_iter d = d_array->dim_begin(); d != d_array->dim_end(); ++d) {
+        if (d_array->dimension_size(d, true) > 1)
+            sizes.push_back(d_array->dimension_size(d, true));
+    }
+
+    if (sizes.size() <= 2)
+        return;
+
+    d_band_dims = sizes.size() - 2;
+    unsigned long long slices = 1;
+    for (int i = 0; i < d_band_dims; ++i)
+        slices *= sizes[i];
+
+    BESDEBUG("fong3", "Writing " << d_array->name() << " as " << slices << " bands" << endl);
+
+    string base = name();
+    set_name(base + m_slice_suffix());
+
+    for (unsigned long long s = 1; s < slices; ++s) {
+        FONgArray *band = m_slice_copy();
+        band->d_slice = s;
+        band->set_name(base + band->m_slice_suffix());
+        t.set_num_bands(t.num_bands() + 1);
+        t.push_var(band);
+    }
+}
+
+/** The indexes of this band's slice in the Array's band dimensions, e.g.
+ * "[3][0]" for the time and depth of a four-dimensional variable. Added
+ * to the variable's name to name the band. */
+string FONgArray::m_slice_suffix()
+{
+    string suffix;
+    unsigned long long slice = d_slice;
+    Array::Dim_iter d = m_row_dimension();
+    while (d != d_array->dim_begin()) {
+        --d;
+        int size = d_array->dimension_size(d, true);
+        if (size <= 1)
+            continue;
+
+        int index = d_array->dimension_start(d, true) + static_cast<int>(slice % size) * d_array->dimension_stride(d, true);
+        slice /= size;
+        suffix = "[" + long_to_string(index) + "]" + suffix;
+    }
+
+    return suffix;
+}
+
+
+/** Use CF to determine if this is a 'Spherical Earth' datum */
+static bool is_spherical(BaseType *btp)
+{
+    /* crs:grid_mapping_name = "latitude_longitude"
+    crs:semi_major_axis = 6371000.0 ;
+    crs:inverse_flattening = 0 ; */
+
+    bool gmn = btp->get_attr_table().get_attr("grid_mapping_name") == "latitude_longitude";
+    bool sma = btp->get_attr_table().get_attr("semi_major_axis") == "6371000.0";
+    bool iflat = btp->get_attr_table().get_attr("inverse_flattening") == "0";
+
+    return gmn && sma && iflat;
+}
+
+/** Use CF to determine if this is a 'WGS84' datum */
+static bool is_wgs84(BaseType *btp)
+{
+    /*crs:grid_mapping_name = "latitude_longitude";
+    crs:longitude_of_prime_meridian = 0.0 ;
+    crs:semi_major_axis = 6378137.0 ;
+    crs:inverse_flattening = 298.257223563 ; */
+
+    bool gmn = btp->get_attr_table().get_attr("grid_mapping_name") == "latitude_longitude";
+    bool lpm = btp->get_attr_table().get_attr("longitude_of_prime_meridian") == "0.0";
+    bool sma = btp->get_attr_table().get_attr("semi_major_axis") == "6378137.0";
+    bool iflat = btp->get_attr_table().get_attr("inverse_flattening") == "298.257223563";
+
+    return gmn && lpm && sma && iflat;
+}
+
+/** @brief Set the projection information
+ * For Arrays and Grids, look for CF information. If it's not present, use the
+ * default Geographic Coordinate system set in the bes/module conf
+ * file. if it is present, look at the attributes and dope out a Well
+ * Known Geographic coordinate string.
+ */
+string FONgArray::get_projection(DDS *dds)
+{
+    // Here's the information about the CF and projections
+    // http://cf-pcmdi.llnl.gov/documents/cf-conventions/1.4/cf-conventions.html#grid-mappings-and-projections
+    // How this code looks for mapping information: Look for an
+    // attribute named 'grid_mapping' and get it's value. This attribute
+    // with be the name of a variable in the dataset, so get that
+    // variable. Now, look at the attributes of that variable.
+    string mapping_info = m_get_attr("grid_mapping");
+
+    string WK_GCS = GeoTiffTransmitter::default_gcs;
+
+    if (!mapping_info.empty()) {
+        // "WGS84": same as "EPSG:4326" but has no dependence on EPSG data files.
+        // "WGS72": same as "EPSG:4322" but has no dependence on EPSG data files.
+        // "NAD27": same as "EPSG:4267" but has no dependence on EPSG data files.
+        // "NAD83": same as "EPSG:4269" but has no dependence on EPSG data files.
+        // "EPSG:n": same as doing an ImportFromEPSG(n).
+
+        // The mapping info is actually stored as attributes of an Int32 variable.
+        BaseType *btp = dds->var(mapping_info);
+        if (btp && btp->name() == "crs") {
+            if (is_wgs84(btp))
+                WK_GCS = "WGS84";
+            else if (is_spherical(btp))
+                WK_GCS = "EPSG:4047";
+        }
+    }
+
+    return FONgProjectionCache::get_wkt(WK_GCS);
+}
+
+template <typename T>
+static void to_doubles(const char *buf, unsigned long long start, unsigned long long n, double *dest)
+{
+    const T *src = reinterpret_cast<const T*>(buf) + start;
+    for (unsigned long long i = 0; i < n; ++i)
+        dest[i] = src[i];
+}
+
+/** Copy n of an Array's values, starting with value 'start', to dest as
+ * doubles. Like extract_double_array(), but into a buffer the caller
+ * provides. The Array must have been read. */
+static void copy_as_doubles(Array *a, unsigned long long start, unsigned long long n, double *dest)
+{
+    const char *buf = a->get_buf();
+    switch (a->var()->type()) {
+    case dods_byte_c: to_doubles<dods_byte>(buf, start, n, dest); break;
+    case dods_int16_c: to_doubles<dods_int16>(buf, start, n, dest); break;
+    case dods_uint16_c: to_doubles<dods_uint16>(buf, start, n, dest); break;
+    case dods_int32_c: to_doubles<dods_int32>(buf, start, n, dest); break;
+    case dods_uint32_c: to_doubles<dods_uint32>(buf, start, n, dest); break;
+    case dods_float32_c: to_doubles<dods_float32>(buf, start, n, dest); break;
+    case dods_float64_c: to_doubles<dods_float64>(buf, start, n, dest); break;
+    default:
+        throw Error("The variable '" + a->name() + "' is not numeric.");
+    }
+}
+
+/** The dimension of the Array that holds the rows of a band: the first
+ * one whose size is not one, after the band dimensions. */
+Array::Dim_iter FONgArray::m_row_dimension()
+{
+    int skip = d_band_dims;
+    for (Array::Dim_iter d = d_array->dim_begin(); d != d_array->dim_end(); ++d) {
+        if (d_array->dimension_size(d, true) > 1 && skip-- == 0)
+            return d;
+    }
+
+    throw InternalErr(__FILE__, __LINE__, "Expected a two-dimensional array.");
+}
+
+/** The number of values in one row of a band */
+unsigned long long FONgArray::m_row_length(Array::Dim_iter row)
+{
+    unsigned long long n = 1;
+    for (Array::Dim_iter d = row + 1; d != d_array->dim_end(); ++d)
+        n *= d_array->dimension_size(d, true);
+
+    return n;
+}
+
+/** Copy n of an Array's values, starting with value 'start', to dest,
+ * as doubles or in the Array's type. */
+static void copy_values(Array *a, unsigned long long start, unsigned long long n, char *dest, bool doubles)
+{
+    if (doubles)
+        copy_as_doubles(a, start, n, reinterpret_cast<double*>(dest));
+    else
+        memcpy(dest, a->get_buf() + start * a->var()->width(), n * a->var()->width());
+}
+
+// The constraint of one dimension of an Array
+struct dim_constraint {
+    Array::Dim_iter dim;
+    int start, stride, stop;
+};
+
+static void restore_constraints(Array *a, const vector<dim_constraint> &saved)
+{
+    a->clear_local_data();
+    a->set_read_p(false);
+    for (vector<dim_constraint>::const_iterator i = saved.begin(); i != saved.end(); ++i)
+        a->add_constraint(i->dim, i->start, i->stride, i->stop);
+}
+
+/** @brief Read a window of this band
+ *
+ * Rows [row, row + rows) and columns [col, col + cols) of the band's
+ * slice are copied to dest. If the Array has already been read, they are
+ * copied from its values. Otherwise the Array is constrained so that only
+ * that window of the slice is read, then the original constraint is
+ * restored. This bounds the memory needed to process a large Array, or
+ * one with many bands.
+ *
+ * @param row The first row, relative to the current selection
+ * @param rows The number of rows
+ * @param col The first column, relative to the current selection
+ * @param cols The number of columns
+ * @param dest Copy the values here
+ * @param doubles If true, copy them as doubles, otherwise in elem_type()
+ */
+void FONgArray::m_read_window(int row, int rows, int col, int cols, char *dest, bool doubles)
+{
+    Array *a = d_array;
+
+    Array::Dim_iter row_dim = m_row_dimension();
+    unsigned long long width = m_row_length(row_dim);
+    bool full_rows = col == 0 && static_cast<unsigned long long>(cols) == width;
+
+    // The columns are the next dimension whose size is not one
+    Array::Dim_iter col_dim = row_dim + 1;
+    while (col_dim != a->dim_end() && a->dimension_size(col_dim, true) == 1)
+        ++col_dim;
+
+    if (!full_rows && col_dim == a->dim_end())
+        throw InternalErr(__FILE__, __LINE__, "Expected a two-dimensional array.");
+
+    unsigned long long value_size = doubles ? sizeof(double) : a->var()->width();
+
+    if (a->read_p()) {
+        unsigned long long first = d_slice * width * a->dimension_size(row_dim, true) + row * width + col;
+        if (full_rows) {
+            copy_values(a, first, rows * width, dest, doubles);
+        }
+        else {
+            for (int r = 0; r < rows; ++r)
+                copy_values(a, first + r * width, cols, dest + r * cols * value_size, doubles);
+        }
+
+        return;
+    }
+
+    // Save the constraints of the band dimensions, then those of the row
+    // and column dimensions
+    vector<dim_constraint> saved;
+    for (Array::Dim_iter d = a->dim_begin(); d != row_dim; ++d) {
+        if (a->dimension_size(d, true) > 1) {
+            dim_constraint c = { d, a->dimension_start(d, true), a->dimension_stride(d, true), a->dimension_stop(d, true) };
+            saved.push_back(c);
+        }
+    }
+    int band_dims = saved.size();
+
+    dim_constraint r = { row_dim, a->dimension_start(row_dim, true), a->dimension_stride(row_dim, true), a->dimension_stop(row_dim, true) };
+    saved.push_back(r);
+
+    dim_constraint c = r;
+    if (!full_rows) {
+        c.dim = col_dim;
+        c.start = a->dimension_start(col_dim, true);
+        c.stride = a->dimension_stride(col_dim, true);
+        c.stop = a->dimension_stop(col_dim, true);
+        saved.push_back(c);
+    }
+
+    try {
+        // Find this slice's element of each band dimension
+        unsigned long long slice = d_slice;
+        for (int i = band_dims - 1; i >= 0; --i) {
+            const dim_constraint &b = saved[i];
+            int size = (b.stop - b.start) / b.stride + 1;
+            int index = b.start + static_cast<int>(slice % size) * b.stride;
+            slice /= size;
+            a->add_constraint(b.dim, index, b.stride, index);
+        }
+
+        a->add_constraint(row_dim, r.start + row * r.stride, r.stride, r.start + (row + rows - 1) * r.stride);
+        if (!full_rows)
+            a->add_constraint(col_dim, c.start + col * c.stride, c.stride, c.start + (col + cols - 1) * c.stride);
+        a->read();
+
+        copy_values(a, 0, static_cast<unsigned long long>(rows) * cols, dest, doubles);
+
+        restore_constraints(a, saved);
+    }
+    catch (...) {
+        restore_constraints(a, saved);
+        throw;
+    }
+}
+
+/** @brief Get the band's values as doubles
+ *
+ * @return The values, in a buffer from FONgBufferPool. The caller must
+ * release it.
+ */
+double *FONgArray::get_data()
+{
+    return get_rows(0, d_array->dimension_size(m_row_dimension(), true));
+}
+
+
+libdap::Type FONgArray::elem_type()
+{
+    return d_array->var()->type();
+}
+
+/** @brief Get the band's values in their DAP type
+ *
+ * @return The values, as a buffer of elem_type() values from
+ * FONgBufferPool. The caller must release it.
+ */
+char *FONgArray::get_native_data()
+{
+    Array::Dim_iter row = m_row_dimension();
+    int rows = d_array->dimension_size(row, true);
+    unsigned long long n = rows * m_row_length(row);
+
+    FONgPoolBuffer data(FONgBufferPool::get(n * d_array->var()->width()));
+    m_read_window(0, rows, 0, m_row_length(row), data.get(), false);
+
+    return data.take();
+}
+
+/** @brief Get a block of rows of the band as doubles
+ *
+ * @param start The first row, relative to the current selection
+ * @param count The number of rows
+ * @return The values as doubles, in a buffer from FONgBufferPool. The
+ * caller must release it.
+ * @see m_read_window()
+ */
+double *FONgArray::get_rows(int start, int count)
+{
+    unsigned long long width = m_row_length(m_row_dimension());
+    FONgPoolBuffer data(FONgBufferPool::get_doubles(count * width));
+    m_read_window(start, count, 0, width, data.get(), true);
+
+    return reinterpret_cast<double*>(data.take());
+}
+
+/** @brief Get a window of the band as doubles
+ *
+ * @param row The first row, relative to the current selection
+ * @param rows The number of rows
+ * @param col The first column
+ * @param cols The number of columns
+ * @return The values as doubles, rows * cols of them, in a buffer from
+ * FONgBufferPool. The caller must release it.
+ * @see m_read_window()
+ */
+double *FONgArray::get_window(int row, int rows, int col, int cols)
+{
+    FONgPoolBuffer data(FONgBufferPool::get_doubles(static_cast<unsigned long long>(rows) * cols));
+    m_read_window(row, rows, col, cols, data.get(), true);
+
+    return reinterpret_cast<double*>(data.take());
+}
+
+bool FONgArray::read_p()
+{
+    return d_array->read_p();
+}
@@ -0,0 +1,111 @@
+// FONgArray.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgArray_h_
+#define FONgArray_h_ 1
+
+#include <Array.h>
+
+class FONgTransform;
+class FONgBaseType;
+
+namespace libdap {
+    class BaseType;
+    class DDS;
+}
+
+/** @brief A DAP Array with file out gdal information included
+ *
+ * This class represents a DAP Array with the additional information
+ * needed to write it out as a band of a gdal file. Includes a reference
+ * to the actual DAP Array being converted and to the one-dimensional
+ * Arrays that hold its latitude and longitude.
+ *
+ * For a plain Array, the latitude and longitude are found using CF: the
+ * names listed in its 'coordinates' attribute and the coordinate
+ * variables (Arrays named for one of its dimensions). The coordinate
+ * Arrays are constrained to match the Array's constraint. FONgGrid uses
+ * the same code with the maps of a Grid.
+ *
+ * When the Array has more than two dimensions whose size is not one and
+ * FONgTransform::multiband() is set, each element of the extra (leading)
+ * dimensions, e.g., each time step, is a band. Each band is a FONgArray
+ * for the same DAP Array with its own slice number, and it reads only
+ * its slice.
+ */
+class FONgArray: public FONgBaseType {
+protected:
+    libdap::Array *d_array;
+    libdap::DDS *d_dds;
+    libdap::Array *d_lat, *d_lon;
+
+    // The number of leading dimensions mapped to bands and the slice of
+    // those dimensions that is this band (in row-major order)
+    int d_band_dims;
+    unsigned long long d_slice;
+
+    // Sets of string values used to find stuff in attributes
+    set<string> d_coards_lat_units;
+    set<string> d_coards_lon_units;
+
+    set<string> d_lat_names;
+    set<string> d_lon_names;
+
+    FONgTransform::map_extent m_map_extent(libdap::Array *map, FONgTransform &t);
+
+    bool m_lat_unit_or_name_match(const string &var_units, const string &var_name, const string &long_name);
+    bool m_lon_unit_or_name_match(const string &var_units, const string &var_name, const string &long_name);
+
+    void m_use_coordinate(libdap::BaseType *btp);
+
+    virtual string m_get_attr(const string &name);
+    virtual FONgArray *m_slice_copy() { return new FONgArray(*this); }
+
+    libdap::Array::Dim_iter m_row_dimension();
+    string m_slice_suffix();
+    unsigned long long m_row_length(libdap::Array::Dim_iter row);
+    void m_read_window(int row, int rows, int col, int cols, char *dest, bool doubles);
+
+public:
+    FONgArray(libdap::Array *a, libdap::DDS *dds = 0);
+    virtual ~FONgArray();
+
+    libdap::Array *array() { return d_array; }
+
+    /// The number of dimensions mapped to bands; see extract_coordinates()
+    int band_dimensions() { return d_band_dims; }
+
+    virtual bool find_lat_lon_maps();
+
+    virtual void extract_coordinates(FONgTransform &t);
+    virtual string get_projection(libdap::DDS *dds);
+    virtual double *get_data();
+    virtual libdap::Type elem_type();
+    virtual char *get_native_data();
+    virtual double *get_rows(int start, int count);
+    virtual double *get_window(int row, int rows, int col, int cols);
+    virtual bool read_p();
+};
+
+#endif // FONgArray_h_
@@ -58,9 +58,24 @@ public:
     /// Get the GDAL/OGC WKT projection string
     virtual string get_projection(libdap::DDS *dds) = 0;
 
-    ///Get the data values for the band(s). Call must delete.
+    ///Get the data values for the band(s). Caller must release the buffer with FONgBufferPool::release().
     virtual double *get_data() = 0;
 
+    /// The DAP type of the band's values
+    virtual libdap::Type elem_type() = 0;
+
+    ///Get the data values for the band(s) as elem_type() values. Caller must release with FONgBufferPool::release().
+    virtual char *get_native_data() = 0;
+
+    ///Get the data values for rows [start, start + count) of the band. Caller must release with FONgBufferPool::release().
+    virtual double *get_rows(int start, int count) = 0;
+
+    ///Get the data values for rows [row, row + rows) and columns [col, col + cols) of the band. Caller must release with FONgBufferPool::release().
+    virtual double *get_window(int row, int rows, int col, int cols) = 0;
+
+    /// Have the data been read? If not, get_rows() reads only the rows it returns.
+    virtual bool read_p() = 0;
+
     virtual void dump(ostream &) const {};
 };
 
@@ -0,0 +1,261 @@
+// FONgBufferPool.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <sys/mman.h>
+
+#include <map>
+#include <vector>
+
+#include <BESInternalError.h>
+#include <BESDebug.h>
+
+#include "FONgBufferPool.h"
+
+using namespace std;
+
+// The smallest size class; smaller buffers are rounded up to this.
+#define FONG_POOL_MIN_CLASS (64 * 1024)
+
+// Buffers at least this large are aligned for transparent huge pages
+#define FONG_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// The alignment of other buffers
+#define FONG_POOL_ALIGNMENT 64
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Released buffers by size class
+static map<unsigned long long, vector<char*> > free_buffers;
+
+// The size class of each buffer handed out by get()
+static map<char*, unsigned long long> in_use;
+
+static unsigned long long pool_max_size = 0;
+static unsigned long long pool_size = 0;     // bytes in free_buffers
+static bool pool_huge_pages = false;
+
+static unsigned long long pool_hits = 0;
+static unsigned long long pool_misses = 0;
+
+// Buffers passed to release() that did not come from get()
+static unsigned long long pool_foreign = 0;
+
+// Round size up to its size class. Between two powers of two, p and 2p,
+// the classes are p + p/4, p + p/2, p + 3p/4 and 2p.
+static unsigned long long size_class(unsigned long long size)
+{
+    unsigned long long c = FONG_POOL_MIN_CLASS;
+    while (c < size)
+        c <<= 1;
+    if (c == FONG_POOL_MIN_CLASS)
+        return c;
+
+    unsigned long long p = c >> 1, step = p >> 2;
+    return p + (size - p + step - 1) / step * step;
+}
+
+static char *allocate(unsigned long long size)
+{
+    bool huge = pool_huge_pages && size >= FONG_HUGE_PAGE_SIZE;
+
+    void *buffer = 0;
+    if (posix_memalign(&buffer, huge ? FONG_HUGE_PAGE_SIZE : FONG_POOL_ALIGNMENT, size) != 0)
+        throw BESInternalError("Could not allocate memory for a band.", __FILE__, __LINE__);
+
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        (void) madvise(buffer, size, MADV_HUGEPAGE);
+#endif
+
+    return static_cast<char*>(buffer);
+}
+
+/** @brief Set the size of the pool
+ *
+ * Called when the module is loaded.
+ *
+ * @param max_size Keep at most this many bytes of released buffers
+ * @param huge_pages Use transparent huge pages for large buffers
+ */
+void FONgBufferPool::initialize(unsigned long long max_size, bool huge_pages)
+{
+    pthread_mutex_lock(&pool_mutex);
+    pool_max_size = max_size;
+    pool_huge_pages = huge_pages;
+    pthread_mutex_unlock(&pool_mutex);
+
+    BESDEBUG("fong", "Buffer pool: " << max_size << " bytes" << (huge_pages ? ", huge pages" : "") << endl);
+}
+
+/** @brief Free the released buffers
+ *
+ * Buffers in use are not affected; they are freed when released.
+ */
+void FONgBufferPool::clear()
+{
+    pthread_mutex_lock(&pool_mutex);
+    for (map<unsigned long long, vector<char*> >::iterator i = free_buffers.begin(); i != free_buffers.end(); ++i)
+        for (vector<char*>::iterator b = i->second.begin(); b != i->second.end(); ++b)
+            free(*b);
+    free_buffers.clear();
+    pool_size = 0;
+    pthread_mutex_unlock(&pool_mutex);
+}
+
+/** @brief Get a buffer
+ *
+ * The buffer's contents are undefined.
+ *
+ * @param size The size of the buffer in bytes
+ * @return The buffer. Release it using release().
+ */
+char *FONgBufferPool::get(unsigned long long size)
+{
+    unsigned long long c = size_class(size);
+
+    pthread_mutex_lock(&pool_mutex);
+    char *buffer = 0;
+    map<unsigned long long, vector<char*> >::iterator i = free_buffers.find(c);
+    if (i != free_buffers.end() && !i->second.empty()) {
+        buffer = i->second.back();
+        i->second.pop_back();
+        pool_size -= c;
+        ++pool_hits;
+    }
+    else {
+        ++pool_misses;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!buffer)
+        buffer = allocate(c);
+
+    pthread_mutex_lock(&pool_mutex);
+    in_use[buffer] = c;
+    pthread_mutex_unlock(&pool_mutex);
+
+    return buffer;
+}
+
+/** Return b to the pool. Returns false, leaving b alone, if it did not
+ * come from get(); it was not allocated by the pool, so it can't be
+ * freed here. */
+static bool return_buffer(char *b)
+{
+    pthread_mutex_lock(&pool_mutex);
+    map<char*, unsigned long long>::iterator i = in_use.find(b);
+    if (i == in_use.end()) {
+        ++pool_foreign;
+        pthread_mutex_unlock(&pool_mutex);
+        return false;
+    }
+
+    unsigned long long c = i->second;
+    in_use.erase(i);
+
+    bool keep = pool_size + c <= pool_max_size;
+    if (keep) {
+        free_buffers[c].push_back(b);
+        pool_size += c;
+    }
+    pthread_mutex_unlock(&pool_mutex);
+
+    if (!keep)
+        free(b);
+
+    return true;
+}
+
+/** @brief Return a buffer to the pool
+ *
+ * If keeping the buffer would make the pool larger than its maximum size,
+ * the buffer is freed. This never throws, so it can be used by
+ * destructors (see FONgPoolBuffer) and while an exception is being
+ * handled. A buffer that did not come from get() is a bug: it is counted
+ * (see dump()) and left alone, and debug builds stop here.
+ *
+ * @param buffer A buffer from get(); null is ignored.
+ * @see release_checked()
+ */
+void FONgBufferPool::release(void *buffer)
+{
+    if (!buffer)
+        return;
+
+    bool ok = return_buffer(static_cast<char*>(buffer));
+    assert(ok && "Released a buffer that did not come from the buffer pool");
+    (void) ok;
+}
+
+/** @brief Return a buffer to the pool, checking that it came from get()
+ *
+ * @param buffer A buffer from get(); null is ignored.
+ * @exception BESInternalError if the buffer did not come from get()
+ * @see release()
+ */
+void FONgBufferPool::release_checked(void *buffer)
+{
+    if (buffer && !return_buffer(static_cast<char*>(buffer)))
+        throw BESInternalError("Released a buffer that did not come from the buffer pool.", __FILE__, __LINE__);
+}
+
+/// Number of get() calls that reused a buffer
+unsigned long long FONgBufferPool::hits()
+{
+    pthread_mutex_lock(&pool_mutex);
+    unsigned long long n = pool_hits;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+/// Number of get() calls that allocated a buffer
+unsigned long long FONgBufferPool::misses()
+{
+    pthread_mutex_lock(&pool_mutex);
+    unsigned long long n = pool_misses;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+/// Bytes held in released buffers
+unsigned long long FONgBufferPool::size()
+{
+    pthread_mutex_lock(&pool_mutex);
+    unsigned long long n = pool_size;
+    pthread_mutex_unlock(&pool_mutex);
+    return n;
+}
+
+void FONgBufferPool::dump(ostream &strm)
+{
+    pthread_mutex_lock(&pool_mutex);
+    strm << "FONgBufferPool: size " << pool_size << " of " << pool_max_size << " bytes, " << in_use.size()
+        << " in use, hits " << pool_hits << ", misses " << pool_misses << ", foreign releases " << pool_foreign << endl;
+    pthread_mutex_unlock(&pool_mutex);
+}
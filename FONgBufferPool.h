@@ -0,0 +1,100 @@
+// FONgBufferPool.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgBufferPool_h_
+#define FONgBufferPool_h_ 1
+
+#include <ostream>
+
+/** @brief A process-wide pool of the buffers that hold band values
+ *
+ * Every band of every response needs a buffer the size of the band (or
+ * of a block of its rows). Allocating and freeing these for each request
+ * means mapping and unmapping hundreds of megabytes and faulting in fresh
+ * pages each time. Buffers taken from this pool are returned to it when
+ * they are released and reused by later bands and requests.
+ *
+ * Buffers are grouped in size classes (four between each power of two,
+ * so less than a fifth of a buffer is unused) so a buffer can be reused
+ * for a band of a similar size. Released buffers are kept until
+ * the pool holds FONg.BufferPoolSize bytes; beyond that they are freed.
+ * If FONg.BufferPoolHugePages is set, large buffers are aligned for and
+ * marked as candidates for transparent huge pages.
+ *
+ * The pool can be used by several threads.
+ */
+class FONgBufferPool {
+public:
+    static void initialize(unsigned long long max_size, bool huge_pages);
+    static void clear();
+
+    static char *get(unsigned long long size);
+    static double *get_doubles(unsigned long long n)
+    {
+        return reinterpret_cast<double*>(get(n * sizeof(double)));
+    }
+
+    static void release(void *buffer);
+    static void release_checked(void *buffer);
+
+    static unsigned long long hits();
+    static unsigned long long misses();
+    static unsigned long long size();
+
+    static void dump(std::ostream &strm);
+};
+
+/** @brief Release a pool buffer when it goes out of scope
+ *
+ * Use take() to keep the buffer, e.g., to return it.
+ */
+class FONgPoolBuffer {
+private:
+    char *d_data;
+
+    FONgPoolBuffer(const FONgPoolBuffer &);
+    FONgPoolBuffer &operator=(const FONgPoolBuffer &);
+
+public:
+    explicit FONgPoolBuffer(void *data = 0) : d_data(static_cast<char*>(data)) {}
+    ~FONgPoolBuffer() { FONgBufferPool::release(d_data); }
+
+    char *get() const { return d_data; }
+    double *doubles() const { return reinterpret_cast<double*>(d_data); }
+
+    void reset(void *data)
+    {
+        FONgBufferPool::release(d_data);
+        d_data = static_cast<char*>(data);
+    }
+
+    char *take()
+    {
+        char *data = d_data;
+        d_data = 0;
+        return data;
+    }
+};
+
+#endif // FONgBufferPool_h_
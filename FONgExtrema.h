@@ -0,0 +1,287 @@
+// FONgExtrema.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgExtrema_h_
+#define FONgExtrema_h_ 1
+
+#include <cmath>
+#include <limits>
+
+// Number of independent accumulators used by FONgExtrema::add(). The
+// per-lane updates have no dependencies between them, so the compiler can
+// keep them in vector registers.
+#define FONG_EXTREMA_LANES 8
+
+/** @brief The two smallest and two largest distinct values of a band
+ *
+ * This is what FONgTransform needs to move a band's no data value close
+ * to the real data values. It is found in a single pass, in constant
+ * space, using branch-free min/max updates. Values are accumulated as
+ * doubles, which hold every DAP numeric type used for bands exactly.
+ * NaNs are ignored.
+ *
+ * Because the class also counts the values at or beyond the no data
+ * value, the caller can skip the pass that replaces them when there are
+ * none.
+ *
+ * The same pass computes the statistics of the band's valid values (the
+ * ones that are neither NaN nor no data): their number, minimum, maximum,
+ * mean and standard deviation. The sums are taken relative to the first
+ * valid value so that the variance does not lose its precision when the
+ * values are large compared to their spread.
+ *
+ * Blocks of a band can be added one at a time and the results of two
+ * FONgExtrema objects can be merged.
+ */
+class FONgExtrema {
+private:
+    double d_no_data;
+
+    double d_min1, d_min2, d_max1, d_max2;
+
+    // Number of values <= and >= no data
+    unsigned long long d_at_or_below, d_at_or_above;
+
+    // Which values are no data for the statistics: < 0 those <= no data,
+    // > 0 those >= no data, 0 none (only NaNs are left out).
+    int d_no_data_side;
+
+    // Statistics of the valid values; the sums are of (v - d_shift)
+    bool d_shifted;
+    double d_shift;
+    unsigned long long d_count;
+    double d_sum, d_sum2, d_valid_min, d_valid_max;
+
+    static double inf() { return std::numeric_limits<double>::infinity(); }
+
+    // Branch-free test for a valid value
+    static inline bool valid(double v, double no_data, bool below, bool above)
+    {
+        return (v == v) & !((below & (v <= no_data)) | (above & (v >= no_data)));
+    }
+
+    // Branch-free updates of one accumulator. A value equal to min1 (max1)
+    // must not become min2 (max2), which is why 'c' is set to infinity in
+    // that case. Adding an infinity that is already the 'not set' value
+    // changes nothing.
+    static inline void update_min(double v, double &min1, double &min2)
+    {
+        double c = (v == min1) ? inf() : (v < min1 ? min1 : v);
+        min2 = c < min2 ? c : min2;
+        min1 = v < min1 ? v : min1;
+    }
+
+    static inline void update_max(double v, double &max1, double &max2)
+    {
+        double c = (v == max1) ? -inf() : (v > max1 ? max1 : v);
+        max2 = c > max2 ? c : max2;
+        max1 = v > max1 ? v : max1;
+    }
+
+public:
+    /** @brief An empty accumulator
+     *
+     * @param no_data The no data value
+     * @param no_data_side Values at or below no_data (if < 0) or at or
+     * above it (if > 0) are left out of the statistics. If 0, all values
+     * but NaNs are used.
+     */
+    FONgExtrema(double no_data = 0.0, int no_data_side = 0) :
+        d_no_data(no_data), d_min1(inf()), d_min2(inf()), d_max1(-inf()), d_max2(-inf()),
+        d_at_or_below(0), d_at_or_above(0), d_no_data_side(no_data_side),
+        d_shifted(false), d_shift(0.0), d_count(0), d_sum(0.0), d_sum2(0.0),
+        d_valid_min(inf()), d_valid_max(-inf())
+    {
+    }
+
+    /** @brief Add n values to the extrema
+     *
+     * @param data The values
+     * @param n The number of values
+     */
+    template <typename T>
+    void add(const T *data, unsigned long long n)
+    {
+        double min1[FONG_EXTREMA_LANES], min2[FONG_EXTREMA_LANES];
+        double max1[FONG_EXTREMA_LANES], max2[FONG_EXTREMA_LANES];
+        unsigned long long below[FONG_EXTREMA_LANES], above[FONG_EXTREMA_LANES];
+        unsigned long long count[FONG_EXTREMA_LANES];
+        double sum[FONG_EXTREMA_LANES], sum2[FONG_EXTREMA_LANES];
+        double lo[FONG_EXTREMA_LANES], hi[FONG_EXTREMA_LANES];
+        for (int l = 0; l < FONG_EXTREMA_LANES; ++l) {
+            min1[l] = min2[l] = lo[l] = inf();
+            max1[l] = max2[l] = hi[l] = -inf();
+            below[l] = above[l] = count[l] = 0;
+            sum[l] = sum2[l] = 0.0;
+        }
+
+        const double nd = d_no_data;
+        const bool nd_below = d_no_data_side < 0, nd_above = d_no_data_side > 0;
+
+        // The sums are relative to the first valid value
+        for (unsigned long long j = 0; !d_shifted && j < n; ++j) {
+            if (valid(data[j], nd, nd_below, nd_above)) {
+                d_shift = data[j];
+                d_shifted = true;
+            }
+        }
+        const double shift = d_shift;
+
+        unsigned long long i = 0;
+        for (; i + FONG_EXTREMA_LANES <= n; i += FONG_EXTREMA_LANES) {
+            for (int l = 0; l < FONG_EXTREMA_LANES; ++l) {
+                double v = data[i + l];
+                update_min(v, min1[l], min2[l]);
+                update_max(v, max1[l], max2[l]);
+                below[l] += (v <= nd);
+                above[l] += (v >= nd);
+
+                bool ok = valid(v, nd, nd_below, nd_above);
+                double d = ok ? v - shift : 0.0;
+                count[l] += ok;
+                sum[l] += d;
+                sum2[l] += d * d;
+                lo[l] = (ok & (v < lo[l])) ? v : lo[l];
+                hi[l] = (ok & (v > hi[l])) ? v : hi[l];
+            }
+        }
+
+        for (; i < n; ++i) {
+            double v = data[i];
+            update_min(v, min1[0], min2[0]);
+            update_max(v, max1[0], max2[0]);
+            below[0] += (v <= nd);
+            above[0] += (v >= nd);
+
+            bool ok = valid(v, nd, nd_below, nd_above);
+            double d = ok ? v - shift : 0.0;
+            count[0] += ok;
+            sum[0] += d;
+            sum2[0] += d * d;
+            lo[0] = (ok & (v < lo[0])) ? v : lo[0];
+            hi[0] = (ok & (v > hi[0])) ? v : hi[0];
+        }
+
+        for (int l = 0; l < FONG_EXTREMA_LANES; ++l) {
+            merge(min1[l], min2[l], max1[l], max2[l]);
+            d_at_or_below += below[l];
+            d_at_or_above += above[l];
+            d_count += count[l];
+            d_sum += sum[l];
+            d_sum2 += sum2[l];
+            d_valid_min = lo[l] < d_valid_min ? lo[l] : d_valid_min;
+            d_valid_max = hi[l] > d_valid_max ? hi[l] : d_valid_max;
+        }
+    }
+
+    /** Merge the extrema of another accumulator (e.g., another block of
+     * the same band) with these. */
+    void merge(double min1, double min2, double max1, double max2)
+    {
+        update_min(min1, d_min1, d_min2);
+        update_min(min2, d_min1, d_min2);
+        update_max(max1, d_max1, d_max2);
+        update_max(max2, d_max1, d_max2);
+    }
+
+    void merge(const FONgExtrema &e)
+    {
+        merge(e.d_min1, e.d_min2, e.d_max1, e.d_max2);
+        d_at_or_below += e.d_at_or_below;
+        d_at_or_above += e.d_at_or_above;
+
+        if (e.d_count == 0)
+            return;
+
+        if (!d_shifted) {
+            d_shift = e.d_shift;
+            d_shifted = true;
+        }
+
+        // Move e's sums so they are relative to this object's shift
+        double delta = e.d_shift - d_shift;
+        d_sum2 += e.d_sum2 + 2.0 * delta * e.d_sum + e.d_count * delta * delta;
+        d_sum += e.d_sum + e.d_count * delta;
+        d_count += e.d_count;
+        d_valid_min = e.d_valid_min < d_valid_min ? e.d_valid_min : d_valid_min;
+        d_valid_max = e.d_valid_max > d_valid_max ? e.d_valid_max : d_valid_max;
+    }
+
+    double no_data() const { return d_no_data; }
+
+    /// Are there at least two distinct values?
+    bool has_second() const { return d_min2 != inf(); }
+
+    double min() const { return d_min1; }
+    double second_min() const { return d_min2; }
+    double max() const { return d_max1; }
+    double second_max() const { return d_max2; }
+
+    unsigned long long at_or_below_no_data() const { return d_at_or_below; }
+    unsigned long long at_or_above_no_data() const { return d_at_or_above; }
+
+    /// The number of valid values; the statistics are defined when it's > 0
+    unsigned long long count() const { return d_count; }
+
+    double valid_min() const { return d_valid_min; }
+    double valid_max() const { return d_valid_max; }
+
+    double mean() const { return d_count ? d_shift + d_sum / d_count : 0.0; }
+
+    /// The population standard deviation of the valid values
+    double stddev() const
+    {
+        if (d_count == 0)
+            return 0.0;
+
+        double m = d_sum / d_count;
+        double variance = d_sum2 / d_count - m * m;
+        return variance > 0.0 ? std::sqrt(variance) : 0.0;
+    }
+
+    /** @brief Replace the values at or below (or above) the no data value
+     *
+     * The loop has no branches, so it vectorizes.
+     *
+     * @param data The values
+     * @param n The number of values
+     * @param below True to replace values <= no_data, false for >= no_data
+     * @param no_data The no data value
+     * @param value The replacement
+     */
+    template <typename T>
+    static void replace(T *data, unsigned long long n, bool below, double no_data, T value)
+    {
+        if (below) {
+            for (unsigned long long i = 0; i < n; ++i)
+                data[i] = (data[i] <= no_data) ? value : data[i];
+        }
+        else {
+            for (unsigned long long i = 0; i < n; ++i)
+                data[i] = (data[i] >= no_data) ? value : data[i];
+        }
+    }
+};
+
+#endif // FONgExtrema_h_
@@ -22,23 +22,21 @@
 // You can contact University Corporation for Atmospheric Research at
 // 3080 Center Green Drive, Boulder, CO 80301
 
-#include <algorithm>
-
 #include <gdal.h>
 #include <gdal_priv.h>
-#include <ogr_spatialref.h>
 
 #include <DDS.h>
 #include <Grid.h>
+#include <Array.h>
 // #include <ce_functions.h>
 #include <util.h>
 
 #include <BESInternalError.h>
 #include <BESDebug.h>
 
-#include "GeoTiffTransmitter.h"
 #include "FONgTransform.h"
 #include "FONgBaseType.h"
+#include "FONgArray.h"
 #include "FONgGrid.h"
 
 using namespace libdap;
@@ -47,33 +45,10 @@ using namespace libdap;
  *
  * @param g A DAP BaseType that should be a grid
  */
-FONgGrid::FONgGrid(Grid *g) : FONgBaseType(), d_grid(g), d_lat(0), d_lon(0)
+FONgGrid::FONgGrid(Grid *g) : FONgArray(g->get_array()), d_grid(g)
 {
+    d_name = g->name();
     d_type = dods_grid_c;
-
-    // Build sets of attribute values for easy searching.
-    // Copied from GeoConstriant in libdap. That class is
-    // abstract and didn't want to modify libdap's ABI for this hack.
-
-    d_coards_lat_units.insert("degrees_north");
-    d_coards_lat_units.insert("degree_north");
-    d_coards_lat_units.insert("degree_N");
-    d_coards_lat_units.insert("degrees_N");
-
-    d_coards_lon_units.insert("degrees_east");
-    d_coards_lon_units.insert("degree_east");
-    d_coards_lon_units.insert("degrees_E");
-    d_coards_lon_units.insert("degree_E");
-
-    d_lat_names.insert("COADSY");
-    d_lat_names.insert("lat");
-    d_lat_names.insert("Lat");
-    d_lat_names.insert("LAT");
-
-    d_lon_names.insert("COADSX");
-    d_lon_names.insert("lon");
-    d_lon_names.insert("Lon");
-    d_lon_names.insert("LON");
 }
 
 /** @brief Destructor that cleans up the grid
@@ -85,50 +60,15 @@ FONgGrid::~FONgGrid()
 {
 }
 
-/** This is used with find_if(). The GeoConstraint class holds a set of strings
-    which are prefixes for variable names. Using the regular find() locates
-    only the exact matches, using find_if() with this functor makes is easy
-    to treat those set<string> objects as collections of prefixes. */
-class is_prefix
+/** Get the value of one of the Grid's attributes, looking at the Grid
+ * and then at its Array. */
+string FONgGrid::m_get_attr(const string &name)
 {
-private:
-    string s;
-public:
-    is_prefix(const string & in): s(in)
-    {}
-
-    bool operator()(const string & prefix)
-    {
-        return s.find(prefix) == 0;
-    }
-};
+    string value = d_grid->get_attr_table().get_attr(name);
+    if (value.empty())
+        value = d_grid->get_array()->get_attr_table().get_attr(name);
 
-/** Is this a latitude map? Use CF's long_name attribute first, then
- * drop into heuristics based on units names or common variable names.
- *
- * @param var_units The value of the 'unit' attribute
- * @param var_name The name of the variable
- * @param long_name The value of the long_name attribute
- *
- * @return true if there's a match, otherwise false
- * @see m_lon_unit_or_name_match()
- */
-bool
-FONgGrid::m_lat_unit_or_name_match(const string &var_units, const string &var_name,
-                                   const string &long_name)
-{
-    return (long_name == "latitude"
-            || d_coards_lat_units.find(var_units) != d_coards_lat_units.end()
-            || find_if(d_lat_names.begin(), d_lat_names.end(), is_prefix(var_name)) != d_lat_names.end());
-}
-
-bool
-FONgGrid::m_lon_unit_or_name_match(const string &var_units, const string &var_name,
-                                   const string &long_name)
-{
-    return (long_name == "longitude"
-            || d_coards_lon_units.find(var_units) != d_coards_lon_units.end()
-            || find_if(d_lon_names.begin(), d_lon_names.end(), is_prefix(var_name)) != d_lon_names.end());
+    return value;
 }
 
 /** A private method called by the constructor that searches for latitude
@@ -136,7 +76,8 @@ FONgGrid::m_lon_unit_or_name_match(const string &var_units, const string &var_na
     cannot be found. It assumes that the d_grid and d_dds fields are set.
 
     The d_longitude, d_lon, d_lon_length and d_lon_grid_dim (and matching
-    lat) fields are modified.
+    lat) fields are modified. The maps are not read here; see
+    m_map_extent().
 
     @note Rules used to find Maps:<ul>
     <li>Latitude: If the Map has a units attribute of "degrees_north",
@@ -180,18 +121,12 @@ bool FONgGrid::find_lat_lon_maps()
             d_lat = dynamic_cast < Array * >(*m);
             if (!d_lat)
                 throw InternalErr(__FILE__, __LINE__, "Expected an array.");
-
-            if (!d_lat->read_p())
-                d_lat->read();
         }
 
         if (!d_lon && m_lon_unit_or_name_match(units_value, map_name, long_name)) {
             d_lon = dynamic_cast < Array * >(*m);
             if (!d_lon)
                 throw InternalErr(__FILE__, __LINE__, "Expected an array.");
-
-            if (!d_lon->read_p())
-                d_lon->read();
         }
 
         ++m;
@@ -200,159 +135,3 @@ bool FONgGrid::find_lat_lon_maps()
 
     return d_lat && d_lon;
 }
-
-/** Extract the size (pixels), element data type and top-left and
- * bottom-right lat/lon corner points for the Grid. Also determine
- * if this is a 2D or 3D Grid and, in the latter case, ensure that
- * the first dimension is not lat or lon. In that case, the geotiff
- * will have N bands, where N is the number of elements from the
- * first dimension in the current selection.
- *
- */
-void FONgGrid::extract_coordinates(FONgTransform &t)
-{
-    BESDEBUG("fong3", "Entering FONgGrid::extract_coordinates" << endl);
-
-    double *lat = 0, *lon = 0;
-    try {
-        // Find the lat and lon maps for this Grid; throws Error
-        // if the are not found.
-        find_lat_lon_maps();
-
-        // The array size
-        t.set_height(d_lat->length());
-        t.set_width(d_lon->length());
-
-        lat = extract_double_array(d_lat);
-        lon = extract_double_array(d_lon);
-
-        t.set_top(lat[0]);
-        t.set_left(lon[0]);
-        t.set_bottom(lat[t.height() - 1]);
-        t.set_right(lon[t.width() -1]);
-
-        // Read this from the 'missing_value' or '_FillValue' attributes
-        string missing_value = d_grid->get_attr_table().get_attr("missing_value");
-        if (missing_value.empty())
-            missing_value = d_grid->get_array()->get_attr_table().get_attr("missing_value");
-        if (missing_value.empty())
-            missing_value = d_grid->get_attr_table().get_attr("_FillValue");
-        if (missing_value.empty())
-            missing_value = d_grid->get_array()->get_attr_table().get_attr("_FillValue");
-
-        BESDEBUG("fong3", "missing_value attribute: " << missing_value << endl);
-
-        // NB: no_data_type() is 'none' by default
-        if (!missing_value.empty()) {
-            t.set_no_data(missing_value);
-            if (t.no_data() < 0)
-                t.set_no_data_type(FONgTransform::negative);
-            else
-                t.set_no_data_type(FONgTransform::positive);
-        }
-
-        t.geo_transform_set(true);
-
-        t.set_num_bands(t.num_bands() + 1);
-        t.push_var(this);
-
-        delete[] lat;
-        delete[] lon;
-    }
-    catch (Error &e) {
-        delete[] lat;
-        delete[] lon;
-
-        throw;
-    }
-}
-
-
-/** Use CF to determine if this is a 'Spherical Earth' datum */
-static bool is_spherical(BaseType *btp)
-{
-    /* crs:grid_mapping_name = "latitude_longitude"
-    crs:semi_major_axis = 6371000.0 ;
-    crs:inverse_flattening = 0 ; */
-
-    bool gmn = btp->get_attr_table().get_attr("grid_mapping_name") == "latitude_longitude";
-    bool sma = btp->get_attr_table().get_attr("semi_major_axis") == "6371000.0";
-    bool iflat = btp->get_attr_table().get_attr("inverse_flattening") == "0";
-
-    return gmn && sma && iflat;
-}
-
-/** Use CF to determine if this is a 'WGS84' datum */
-static bool is_wgs84(BaseType *btp)
-{
-    /*crs:grid_mapping_name = "latitude_longitude";
-    crs:longitude_of_prime_meridian = 0.0 ;
-    crs:semi_major_axis = 6378137.0 ;
-    crs:inverse_flattening = 298.257223563 ; */
-
-    bool gmn = btp->get_attr_table().get_attr("grid_mapping_name") == "latitude_longitude";
-    bool lpm = btp->get_attr_table().get_attr("longitude_of_prime_meridian") == "0.0";
-    bool sma = btp->get_attr_table().get_attr("semi_major_axis") == "6378137.0";
-    bool iflat = btp->get_attr_table().get_attr("inverse_flattening") == "298.257223563";
-
-    return gmn && lpm && sma && iflat;
-}
-
-/** @brief Set the projection information
- * For Grids, look for CF information. If it's not present, use the
- * default Geographic Coordinate system set in the bes/module conf
- * file. if it is present, look at the attributes and dope out a Well
- * Known Geographic coordinate string.
- */
-string FONgGrid::get_projection(DDS *dds)
-{
-    // Here's the information about the CF and projections
-    // http://cf-pcmdi.llnl.gov/documents/cf-conventions/1.4/cf-conventions.html#grid-mappings-and-projections
-    // How this code looks for mapping information: Look for an
-    // attribute named 'grid_mapping' and get it's value. This attribute
-    // with be the name of a variable in the dataset, so get that
-    // variable. Now, look at the attributes of that variable.
-    string mapping_info = d_grid->get_attr_table().get_attr("grid_mapping");
-    if (mapping_info.empty())
-        mapping_info = d_grid->get_array()->get_attr_table().get_attr("grid_mapping");
-
-    string WK_GCS = GeoTiffTransmitter::default_gcs;
-
-    if (!mapping_info.empty()) {
-        // "WGS84": same as "EPSG:4326" but has no dependence on EPSG data files.
-        // "WGS72": same as "EPSG:4322" but has no dependence on EPSG data files.
-        // "NAD27": same as "EPSG:4267" but has no dependence on EPSG data files.
-        // "NAD83": same as "EPSG:4269" but has no dependence on EPSG data files.
-        // "EPSG:n": same as doing an ImportFromEPSG(n).
-
-        // The mapping info is actually stored as attributes of an Int32 variable.
-        BaseType *btp = dds->var(mapping_info);
-        if (btp->name() == "crs") {
-            if (is_wgs84(btp))
-                WK_GCS = "WGS84";
-            else if (is_spherical(btp))
-                WK_GCS = "EPSG:4047";
-        }
-    }
-
-    OGRSpatialReference srs;
-    srs.SetWellKnownGeogCS(WK_GCS.c_str());
-    char *srs_wkt = NULL;
-    srs.exportToWkt(&srs_wkt);
-
-    string wkt = srs_wkt;   // save the result
-
-    CPLFree(srs_wkt);       // free memory alloc'd by GDAL
-
-    return wkt;
-}
-
-double *FONgGrid::get_data()
-{
-    if (!d_grid->get_array()->read_p())
-        d_grid->get_array()->read();
-
-    // This code assumes read() has been called.
-    return extract_double_array(d_grid->get_array());
-}
-
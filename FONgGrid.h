@@ -26,41 +26,29 @@
 #define FONgGrid_h_ 1
 
 class FONgTransform;
-class FONgBaseType;
+class FONgArray;
 
 namespace libdap {
     class Grid;
-    class Array;
 }
 
-/** @brief A DAP Grid with file out netcdf information included
+/** @brief A DAP Grid with file out gdal information included
  *
  * This class represents a DAP Grid with additional information
- * needed to write it out to a netcdf file. Includes a reference to the
- * actual DAP Grid being converted, the maps of the grid stored as
- * FOncMap instances, and the array of the grid stored as a FONgArray.
+ * needed to write it out to a gdal file. Includes a reference to the
+ * actual DAP Grid being converted; the Grid's array is handled by
+ * FONgArray, using the Grid's maps for the latitude and longitude.
  *
- * NetCDF does not have grid representation. For this reason, we flatten
- * out the grid as different arrays (maps) as well as the grid's actual
- * array.
- *
- * It is possible to share maps among grids, so a global map list is
- * kept as well.
+ * It is possible to share maps among grids; their extents are cached
+ * in the FONgTransform.
  */
-class FONgGrid: public FONgBaseType {
+class FONgGrid: public FONgArray {
 private:
     libdap::Grid *d_grid;
-    libdap::Array *d_lat, *d_lon;
-
-    // Sets of string values used to find stuff in attributes
-    set<string> d_coards_lat_units;
-    set<string> d_coards_lon_units;
-
-    set<string> d_lat_names;
-    set<string> d_lon_names;
 
-    bool m_lat_unit_or_name_match(const string &var_units, const string &var_name, const string &long_name);
-    bool m_lon_unit_or_name_match(const string &var_units, const string &var_name, const string &long_name);
+protected:
+    virtual string m_get_attr(const string &name);
+    virtual FONgArray *m_slice_copy() { return new FONgGrid(*this); }
 
 public:
     FONgGrid(libdap::Grid *g);
@@ -68,12 +56,7 @@ public:
 
     libdap::Grid *grid() { return d_grid; }
 
-    bool find_lat_lon_maps();
-
-    virtual void extract_coordinates(FONgTransform &t);
-    string get_projection(libdap::DDS *dds);
-    virtual double *get_data();
-
+    virtual bool find_lat_lon_maps();
 };
 
 #endif // FONgGrid_h_
@@ -31,7 +31,11 @@ using std::endl;
 #include "FONgModule.h"
 #include "GeoTiffTransmitter.h"
 #include "JPEG2000Transmitter.h"
+#include "StatisticsTransmitter.h"
 #include "FONgRequestHandler.h"
+#include "FONgResponseCache.h"
+#include "FONgProjectionCache.h"
+#include "FONgBufferPool.h"
 #include "BESRequestHandlerList.h"
 
 #include <BESReturnManager.h>
@@ -44,15 +48,16 @@ using std::endl;
 
 #define RETURNAS_GEOTIFF "geotiff"
 #define RETURNAS_JPEG2000 "jpeg2000"
-
-#define JP2 1
+#define RETURNAS_COG "cog"
+#define RETURNAS_STATISTICS "statistics"
 
 
 /** @brief initialize the module by adding call backs and registering
  * objects with the framework
  *
  * Registers the request handler to add to a version or help request,
- * and adds the File Out transmitter for a "returnAs geotiff" request.
+ * and adds the File Out transmitters for "returnAs geotiff", "returnAs
+ * cog" and "returnAs statistics" requests.
  * Also adds geotiff as a return for the dap service dods request and
  * registers the debug context.
  *
@@ -68,6 +73,12 @@ void FONgModule::initialize(const string &modname)
     BESDEBUG( "fong", "    adding " << RETURNAS_GEOTIFF << " transmitter" << endl );
     BESReturnManager::TheManager()->add_transmitter(RETURNAS_GEOTIFF, new GeoTiffTransmitter());
 
+    BESDEBUG( "fong", "    adding " << RETURNAS_COG << " transmitter" << endl );
+    BESReturnManager::TheManager()->add_transmitter(RETURNAS_COG, new GeoTiffTransmitter(true /*cog*/));
+
+    BESDEBUG( "fong", "    adding " << RETURNAS_STATISTICS << " transmitter" << endl );
+    BESReturnManager::TheManager()->add_transmitter(RETURNAS_STATISTICS, new StatisticsTransmitter());
+
 #if JP2
     BESDEBUG( "fong", "    adding " << RETURNAS_JPEG2000 << " transmitter" << endl );
     BESReturnManager::TheManager()->add_transmitter(RETURNAS_JPEG2000, new JPEG2000Transmitter());
@@ -76,11 +87,24 @@ void FONgModule::initialize(const string &modname)
     BESDEBUG( "fong", "    adding geotiff service to dap" << endl );
     BESServiceRegistry::TheRegistry()->add_format(OPENDAP_SERVICE, DATA_SERVICE, RETURNAS_GEOTIFF);
 
+    BESDEBUG( "fong", "    adding cog service to dap" << endl );
+    BESServiceRegistry::TheRegistry()->add_format(OPENDAP_SERVICE, DATA_SERVICE, RETURNAS_COG);
+
+    BESDEBUG( "fong", "    adding statistics service to dap" << endl );
+    BESServiceRegistry::TheRegistry()->add_format(OPENDAP_SERVICE, DATA_SERVICE, RETURNAS_STATISTICS);
+
 #if JP2
     BESDEBUG( "fong", "    adding jpeg2000 service to dap" << endl );
     BESServiceRegistry::TheRegistry()->add_format(OPENDAP_SERVICE, DATA_SERVICE, RETURNAS_JPEG2000);
 #endif
 
+    // Make the WKT for the coordinate systems the module uses now, so
+    // that setting the projection of a band is a lookup.
+    FONgProjectionCache::initialize(GeoTiffTransmitter::default_gcs);
+
+    // The request handler has read the pool's size from the BES keys
+    FONgBufferPool::initialize(FONgRequestHandler::buffer_pool_size, FONgRequestHandler::buffer_pool_huge_pages);
+
     BESDebug::Register("fong");
     BESDEBUG( "fong", "Done Initializing module " << modname << endl );
 }
@@ -100,6 +124,12 @@ void FONgModule::terminate(const string &modname)
 
     BESReturnManager::TheManager()->del_transmitter(RETURNAS_GEOTIFF);
 
+    BESDEBUG( "fong", "    removing " << RETURNAS_COG << " transmitter" << endl );
+    BESReturnManager::TheManager()->del_transmitter(RETURNAS_COG);
+
+    BESDEBUG( "fong", "    removing " << RETURNAS_STATISTICS << " transmitter" << endl );
+    BESReturnManager::TheManager()->del_transmitter(RETURNAS_STATISTICS);
+
 #if JP2
     BESDEBUG( "fong", "    removing " << RETURNAS_JPEG2000 << " transmitter" << endl );
     BESReturnManager::TheManager()->del_transmitter(RETURNAS_JPEG2000);
@@ -111,6 +141,11 @@ void FONgModule::terminate(const string &modname)
     if (rh)
         delete rh;
 
+    FONgResponseCache::delete_instance();
+
+    BESDEBUG( "fong", "    " << "buffer pool hits: " << FONgBufferPool::hits() << ", misses: " << FONgBufferPool::misses() << endl );
+    FONgBufferPool::clear();
+
     BESDEBUG( "fong", "Done Cleaning module " << modname << endl );
 }
 
@@ -0,0 +1,92 @@
+// FONgProjectionCache.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <pthread.h>
+
+#include <map>
+
+#include <ogr_spatialref.h>
+#include <cpl_conv.h>
+
+#include <BESDebug.h>
+
+#include "FONgProjectionCache.h"
+
+using namespace std;
+
+// Map from a GCS name given to SetWellKnownGeogCS() to its WKT
+static map<string, string> wkt_cache;
+static pthread_mutex_t wkt_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @brief Add the coordinate systems used by the module to the cache
+ *
+ * Called when the module is loaded.
+ *
+ * @param default_gcs The value of FONg.Default_GCS
+ */
+void FONgProjectionCache::initialize(const string &default_gcs)
+{
+    (void) get_wkt("WGS84");
+    (void) get_wkt("EPSG:4047");
+    (void) get_wkt(default_gcs);
+}
+
+/** @brief Get the WKT for a geographic coordinate system
+ *
+ * @param gcs A name that OGRSpatialReference::SetWellKnownGeogCS()
+ * accepts, e.g., WGS84 or EPSG:<num>
+ * @return The WKT for the coordinate system
+ */
+string FONgProjectionCache::get_wkt(const string &gcs)
+{
+    pthread_mutex_lock(&wkt_cache_mutex);
+    map<string, string>::iterator i = wkt_cache.find(gcs);
+    if (i != wkt_cache.end()) {
+        string wkt = i->second;
+        pthread_mutex_unlock(&wkt_cache_mutex);
+        return wkt;
+    }
+    pthread_mutex_unlock(&wkt_cache_mutex);
+
+    // Build the WKT without holding the lock; if two threads do this at
+    // the same time, they get the same result.
+    OGRSpatialReference srs;
+    srs.SetWellKnownGeogCS(gcs.c_str());
+    char *srs_wkt = NULL;
+    srs.exportToWkt(&srs_wkt);
+
+    string wkt = srs_wkt ? srs_wkt : "";   // save the result
+
+    CPLFree(srs_wkt);       // free memory alloc'd by GDAL
+
+    BESDEBUG("fong3", "Adding the WKT for " << gcs << " to the projection cache" << endl);
+
+    pthread_mutex_lock(&wkt_cache_mutex);
+    wkt_cache[gcs] = wkt;
+    pthread_mutex_unlock(&wkt_cache_mutex);
+
+    return wkt;
+}
@@ -0,0 +1,48 @@
+// FONgProjectionCache.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgProjectionCache_h_
+#define FONgProjectionCache_h_ 1
+
+#include <string>
+
+using std::string;
+
+/** @brief A process-wide cache of projection WKT strings
+ *
+ * Building the WKT for a geographic coordinate system means making an
+ * OGRSpatialReference and exporting it, and it was done for every band
+ * of every response. Only a few coordinate systems are used (WGS84,
+ * EPSG:4047 and FONg.Default_GCS), so their WKT is made once, when the
+ * module is loaded, and looked up after that. Other names are added the
+ * first time they are seen. The cache can be used by several threads.
+ */
+class FONgProjectionCache {
+public:
+    static void initialize(const string &default_gcs);
+
+    static string get_wkt(const string &gcs);
+};
+
+#endif // FONgProjectionCache_h_
@@ -22,18 +22,264 @@
 // You can contact University Corporation for Atmospheric Research at
 // 3080 Center Green Drive, Boulder, CO 80301
 
+#include <cstdlib>
+#include <cctype>
+
+#include <set>
+#include <sstream>
+
 #include <gdal.h>
+#include <gdal_frmts.h>
+#include <cpl_conv.h>
 
 #include <BESResponseHandler.h>
 #include <BESResponseNames.h>
 #include <BESVersionInfo.h>
 
 #include <TheBESKeys.h>
+#include <BESDebug.h>
 
 #include "config.h"
 
 #include "FONgRequestHandler.h"
 
+#define FONG_IN_MEMORY_MAX_SIZE_KEY "FONg.InMemoryMaxSize"
+#define FONG_IN_MEMORY_MAX_SIZE 64 // MB
+
+#define FONG_MEMORY_BUDGET_KEY "FONg.MemoryBudget"
+#define FONG_MAX_BAND_MEMORY_KEY "FONg.MaxBandMemory" // the old name
+#define FONG_MEMORY_BUDGET 256 // MB
+
+#define FONG_PIPELINE_KEY "FONg.Pipeline"
+#define FONG_PIPELINE_BLOCK_SIZE_KEY "FONg.PipelineBlockSize"
+#define FONG_PIPELINE_BLOCK_SIZE 16 // MB
+
+#define FONG_MULTIBAND_KEY "FONg.Multiband"
+
+#define FONG_FORCE_FLOAT64_KEY "FONg.ForceFloat64"
+
+#define FONG_TILED_KEY "FONg.Tiled"
+#define FONG_BLOCK_X_SIZE_KEY "FONg.BlockXSize"
+#define FONG_BLOCK_Y_SIZE_KEY "FONg.BlockYSize"
+#define FONG_COMPRESS_KEY "FONg.Compress"
+#define FONG_PREDICTOR_KEY "FONg.Predictor"
+#define FONG_ZLEVEL_KEY "FONg.ZLevel"
+#define FONG_NUM_THREADS_KEY "FONg.NumThreads"
+
+#define FONG_OVERVIEW_LEVELS_KEY "FONg.OverviewLevels"
+#define FONG_OVERVIEW_RESAMPLING_KEY "FONg.OverviewResampling"
+
+#define FONG_JP2_QUALITY_KEY "FONg.JP2Quality"
+#define FONG_JP2_QUALITY "100"
+#define FONG_JP2_REVERSIBLE_KEY "FONg.JP2Reversible"
+#define FONG_JP2_BLOCK_X_SIZE_KEY "FONg.JP2BlockXSize"
+#define FONG_JP2_BLOCK_Y_SIZE_KEY "FONg.JP2BlockYSize"
+#define FONG_JP2_RESOLUTIONS_KEY "FONg.JP2Resolutions"
+
+#define FONG_BAND_THREADS_KEY "FONg.BandThreads"
+#define FONG_BAND_THREADS 4
+
+#define FONG_BUFFER_POOL_SIZE_KEY "FONg.BufferPoolSize"
+#define FONG_BUFFER_POOL_SIZE 256 // MB
+#define FONG_BUFFER_POOL_HUGE_PAGES_KEY "FONg.BufferPoolHugePages"
+
+#define FONG_REQUEST_LOG_KEY "FONg.RequestLog"
+
+#define FONG_GDAL_REGISTER_ALL_KEY "FONg.GDALRegisterAll"
+#define FONG_GDAL_EXTRA_DRIVERS_KEY "FONg.GDALExtraDrivers"
+#define FONG_GDAL_CACHE_MAX_KEY "FONg.GDALCacheMax"
+#define FONG_GDAL_NUM_THREADS_KEY "FONg.GDALNumThreads"
+#define FONG_GDAL_DISABLE_READDIR_KEY "FONg.GDALDisableReadDirOnOpen"
+
+#define FONG_ADMISSION_BUDGET_KEY "FONg.AdmissionBudget"
+#define FONG_ADMISSION_TIMEOUT_KEY "FONg.AdmissionTimeout"
+#define FONG_ADMISSION_TIMEOUT 30 // seconds
+
+#define FONG_CACHE_DIR_KEY "FONg.CacheDir"
+#define FONG_CACHE_SIZE_KEY "FONg.CacheSize"
+#define FONG_CACHE_SIZE 500 // MB
+
+unsigned long long FONgRequestHandler::in_memory_max_size = 0;
+unsigned long long FONgRequestHandler::memory_budget = 0;
+
+bool FONgRequestHandler::pipeline = false;
+unsigned long long FONgRequestHandler::pipeline_block_size = 0;
+
+bool FONgRequestHandler::multiband = false;
+
+bool FONgRequestHandler::force_float64 = false;
+
+bool FONgRequestHandler::tiled = false;
+int FONgRequestHandler::block_x_size = 0;
+int FONgRequestHandler::block_y_size = 0;
+string FONgRequestHandler::compress;
+string FONgRequestHandler::predictor;
+string FONgRequestHandler::zlevel;
+string FONgRequestHandler::num_threads;
+
+string FONgRequestHandler::overview_levels;
+string FONgRequestHandler::overview_resampling;
+
+string FONgRequestHandler::jp2_quality;
+bool FONgRequestHandler::jp2_reversible = true;
+int FONgRequestHandler::jp2_block_x_size = 0;
+int FONgRequestHandler::jp2_block_y_size = 0;
+int FONgRequestHandler::jp2_resolutions = 0;
+
+int FONgRequestHandler::band_threads = 0;
+
+unsigned long long FONgRequestHandler::buffer_pool_size = 0;
+bool FONgRequestHandler::buffer_pool_huge_pages = false;
+
+bool FONgRequestHandler::request_log = false;
+
+bool FONgRequestHandler::gdal_register_all = true;
+string FONgRequestHandler::gdal_extra_drivers;
+unsigned long long FONgRequestHandler::gdal_cache_max = 0;
+string FONgRequestHandler::gdal_num_threads;
+bool FONgRequestHandler::gdal_disable_readdir = false;
+
+unsigned long long FONgRequestHandler::admission_budget = 0;
+int FONgRequestHandler::admission_timeout = 0;
+
+string FONgRequestHandler::cache_dir;
+unsigned long long FONgRequestHandler::cache_size = 0;
+
+/** @brief Read a string value from the BES keys
+ *
+ * @param key_name The name of the key
+ * @param key_value Value-result parameter
+ * @param default_value Value to use if the key is not set
+ */
+static void read_key_value(const string &key_name, string &key_value, const string &default_value)
+{
+    bool found = false;
+    TheBESKeys::TheKeys()->get_value(key_name, key_value, found);
+    if (!found || key_value.empty())
+        key_value = default_value;
+}
+
+/** @brief Read a size, given in megabytes, from the BES keys
+ *
+ * @param key_name The name of the key
+ * @param key_value Value-result parameter; holds the size in bytes
+ * @param default_value Size, in megabytes, to use if the key is not set
+ */
+static void read_key_value(const string &key_name, unsigned long long &key_value,
+    unsigned long long default_value)
+{
+    bool found = false;
+    string value;
+    TheBESKeys::TheKeys()->get_value(key_name, value, found);
+    unsigned long long mb = (found && !value.empty()) ? strtoull(value.c_str(), NULL, 10) : default_value;
+
+    key_value = mb * 1024 * 1024;
+}
+
+/** @brief Read an integer value from the BES keys
+ *
+ * @param key_name The name of the key
+ * @param key_value Value-result parameter
+ * @param default_value Value to use if the key is not set
+ */
+static void read_key_value(const string &key_name, int &key_value, int default_value)
+{
+    bool found = false;
+    string value;
+    TheBESKeys::TheKeys()->get_value(key_name, value, found);
+    key_value = (found && !value.empty()) ? atoi(value.c_str()) : default_value;
+}
+
+/** @brief Read a boolean value from the BES keys
+ *
+ * @param key_name The name of the key
+ * @param key_value Value-result parameter
+ * @param default_value Value to use if the key is not set
+ */
+static void read_key_value(const string &key_name, bool &key_value, bool default_value)
+{
+    bool found = false;
+    string value;
+    TheBESKeys::TheKeys()->get_value(key_name, value, found);
+    if (found && !value.empty()) {
+        for (string::size_type i = 0; i < value.length(); ++i)
+            value[i] = tolower(value[i]);
+        key_value = (value == "true" || value == "yes");
+    }
+    else {
+        key_value = default_value;
+    }
+}
+
+/** @brief Register the GDAL drivers the module uses
+ *
+ * GTiff and MEM are built into every GDAL and are registered directly,
+ * as are COG and JP2OpenJPEG when configure found their registration
+ * functions. If one of the drivers the module needs, or one of the
+ * extra drivers, is still missing (e.g., it is a plugin), all of the
+ * drivers are registered and the others are then removed.
+ *
+ * @param extra_drivers A comma separated list of other drivers to keep
+ */
+static void register_gdal_drivers(const string &extra_drivers)
+{
+    set<string> wanted;
+    wanted.insert("GTIFF");
+    wanted.insert("MEM");
+    wanted.insert("COG");
+#if JP2
+    wanted.insert("JP2OPENJPEG");
+#endif
+
+    vector<string> required;
+#if JP2
+    required.push_back("JP2OpenJPEG");
+#endif
+
+    istringstream iss(extra_drivers);
+    string name;
+    while (getline(iss, name, ',')) {
+        string::size_type b = name.find_first_not_of(" \t");
+        if (b == string::npos)
+            continue;
+        name = name.substr(b, name.find_last_not_of(" \t") - b + 1);
+        required.push_back(name);
+        for (string::size_type i = 0; i < name.length(); ++i)
+            name[i] = toupper(name[i]);
+        wanted.insert(name);
+    }
+
+    GDALRegister_GTiff();
+    GDALRegister_MEM();
+#ifdef HAVE_GDALREGISTER_COG
+    GDALRegister_COG();
+#endif
+#ifdef HAVE_GDALREGISTER_JP2OPENJPEG
+    GDALRegister_JP2OpenJPEG();
+#endif
+
+    bool missing = false;
+    for (vector<string>::iterator i = required.begin(); i != required.end(); ++i)
+        missing = missing || GDALGetDriverByName(i->c_str()) == 0;
+
+    if (!missing)
+        return;
+
+    BESDEBUG("fong", "Registering all GDAL drivers to find the plugins, then removing the unused ones" << endl);
+
+    GDALAllRegister();
+    for (int i = GDALGetDriverCount() - 1; i >= 0; --i) {
+        GDALDriverH driver = GDALGetDriver(i);
+        string name = GDALGetDriverShortName(driver);
+        for (string::size_type c = 0; c < name.length(); ++c)
+            name[c] = toupper(name[c]);
+        if (wanted.find(name) == wanted.end()) {
+            GDALDeregisterDriver(driver);
+            GDALDestroyDriver(driver);
+        }
+    }
+}
+
 /** @brief Constructor for FileOut GDAL module
  *
  * This constructor adds functions to add to the build of a help request
@@ -48,8 +294,70 @@ FONgRequestHandler::FONgRequestHandler(const string &name) :
     add_handler(HELP_RESPONSE, FONgRequestHandler::build_help);
     add_handler(VERS_RESPONSE, FONgRequestHandler::build_version);
 
-    GDALAllRegister();
     CPLSetErrorHandler(CPLQuietErrorHandler);
+
+    read_key_value(FONG_IN_MEMORY_MAX_SIZE_KEY, FONgRequestHandler::in_memory_max_size, FONG_IN_MEMORY_MAX_SIZE);
+
+    read_key_value(FONG_MAX_BAND_MEMORY_KEY, FONgRequestHandler::memory_budget, FONG_MEMORY_BUDGET);
+    read_key_value(FONG_MEMORY_BUDGET_KEY, FONgRequestHandler::memory_budget, FONgRequestHandler::memory_budget / (1024 * 1024));
+
+    read_key_value(FONG_PIPELINE_KEY, FONgRequestHandler::pipeline, false);
+    read_key_value(FONG_PIPELINE_BLOCK_SIZE_KEY, FONgRequestHandler::pipeline_block_size, FONG_PIPELINE_BLOCK_SIZE);
+
+    read_key_value(FONG_MULTIBAND_KEY, FONgRequestHandler::multiband, false);
+
+    read_key_value(FONG_FORCE_FLOAT64_KEY, FONgRequestHandler::force_float64, false);
+
+    read_key_value(FONG_TILED_KEY, FONgRequestHandler::tiled, false);
+    read_key_value(FONG_BLOCK_X_SIZE_KEY, FONgRequestHandler::block_x_size, 0);
+    read_key_value(FONG_BLOCK_Y_SIZE_KEY, FONgRequestHandler::block_y_size, 0);
+    read_key_value(FONG_COMPRESS_KEY, FONgRequestHandler::compress, "");
+    read_key_value(FONG_PREDICTOR_KEY, FONgRequestHandler::predictor, "");
+    read_key_value(FONG_ZLEVEL_KEY, FONgRequestHandler::zlevel, "");
+    read_key_value(FONG_NUM_THREADS_KEY, FONgRequestHandler::num_threads, "");
+
+    read_key_value(FONG_OVERVIEW_LEVELS_KEY, FONgRequestHandler::overview_levels, "AUTO");
+    read_key_value(FONG_OVERVIEW_RESAMPLING_KEY, FONgRequestHandler::overview_resampling, "AVERAGE");
+
+    read_key_value(FONG_JP2_QUALITY_KEY, FONgRequestHandler::jp2_quality, FONG_JP2_QUALITY);
+    read_key_value(FONG_JP2_REVERSIBLE_KEY, FONgRequestHandler::jp2_reversible, true);
+    read_key_value(FONG_JP2_BLOCK_X_SIZE_KEY, FONgRequestHandler::jp2_block_x_size, 0);
+    read_key_value(FONG_JP2_BLOCK_Y_SIZE_KEY, FONgRequestHandler::jp2_block_y_size, 0);
+    read_key_value(FONG_JP2_RESOLUTIONS_KEY, FONgRequestHandler::jp2_resolutions, 0);
+
+    read_key_value(FONG_BAND_THREADS_KEY, FONgRequestHandler::band_threads, FONG_BAND_THREADS);
+
+    read_key_value(FONG_BUFFER_POOL_SIZE_KEY, FONgRequestHandler::buffer_pool_size, FONG_BUFFER_POOL_SIZE);
+    read_key_value(FONG_BUFFER_POOL_HUGE_PAGES_KEY, FONgRequestHandler::buffer_pool_huge_pages, false);
+
+    read_key_value(FONG_REQUEST_LOG_KEY, FONgRequestHandler::request_log, false);
+
+    read_key_value(FONG_ADMISSION_BUDGET_KEY, FONgRequestHandler::admission_budget, 0);
+    read_key_value(FONG_ADMISSION_TIMEOUT_KEY, FONgRequestHandler::admission_timeout, FONG_ADMISSION_TIMEOUT);
+
+    read_key_value(FONG_CACHE_DIR_KEY, FONgRequestHandler::cache_dir, "");
+    read_key_value(FONG_CACHE_SIZE_KEY, FONgRequestHandler::cache_size, FONG_CACHE_SIZE);
+
+    read_key_value(FONG_GDAL_REGISTER_ALL_KEY, FONgRequestHandler::gdal_register_all, true);
+    read_key_value(FONG_GDAL_EXTRA_DRIVERS_KEY, FONgRequestHandler::gdal_extra_drivers, "");
+    read_key_value(FONG_GDAL_CACHE_MAX_KEY, FONgRequestHandler::gdal_cache_max, 0);
+    read_key_value(FONG_GDAL_NUM_THREADS_KEY, FONgRequestHandler::gdal_num_threads, "");
+    read_key_value(FONG_GDAL_DISABLE_READDIR_KEY, FONgRequestHandler::gdal_disable_readdir, false);
+
+    if (FONgRequestHandler::gdal_register_all)
+        GDALAllRegister();
+    else
+        register_gdal_drivers(FONgRequestHandler::gdal_extra_drivers);
+
+    BESDEBUG("fong", "GDAL drivers registered: " << GDALGetDriverCount() << endl);
+
+    // Zero and empty values leave GDAL's defaults in place
+    if (FONgRequestHandler::gdal_cache_max > 0)
+        GDALSetCacheMax64(FONgRequestHandler::gdal_cache_max);
+    if (!FONgRequestHandler::gdal_num_threads.empty())
+        CPLSetConfigOption("GDAL_NUM_THREADS", FONgRequestHandler::gdal_num_threads.c_str());
+    if (FONgRequestHandler::gdal_disable_readdir)
+        CPLSetConfigOption("GDAL_DISABLE_READDIR_ON_OPEN", "TRUE");
 }
 
 /** @brief Any cleanup that needs to take place
@@ -27,6 +27,10 @@
 
 #include "BESRequestHandler.h"
 
+// Build the JPEG2000 response. Used by FONgModule, to add the transmitter,
+// and by FONgRequestHandler, to register the JP2OpenJPEG driver.
+#define JP2 1
+
 /** @brief A Request Handler for the Fileout GDAL request
  *
  * This class is used to represent the Fileout GDAL module, including
@@ -43,6 +47,80 @@ public:
 
     static bool build_help(BESDataHandlerInterface &dhi);
     static bool build_version(BESDataHandlerInterface &dhi);
+
+    // Responses whose estimated size is at or below this many bytes are
+    // built in GDAL's /vsimem/ filesystem instead of in FONg.Tempdir.
+    static unsigned long long in_memory_max_size;
+
+    // Bands larger than this many bytes are read and written a window at
+    // a time. Zero means no limit.
+    static unsigned long long memory_budget;
+
+    // Read the variables in a separate thread while the bands are written,
+    // passing blocks of pipeline_block_size bytes between the threads.
+    static bool pipeline;
+    static unsigned long long pipeline_block_size;
+
+    // Write the leading dimensions of variables with more than two
+    // dimensions as bands (see FONgTransform::multiband()).
+    static bool multiband;
+
+    // Write GeoTiff bands as Float64 instead of the variables' own type.
+    static bool force_float64;
+
+    // GeoTiff layout and compression. Zero block sizes are chosen using
+    // the shape of the grid; empty strings use GDAL's defaults.
+    static bool tiled;
+    static int block_x_size;
+    static int block_y_size;
+    static string compress;
+    static string predictor;
+    static string zlevel;
+    static string num_threads;
+
+    // COG overviews: AUTO, NONE or a list of factors, and the resampling
+    // method passed to GDAL.
+    static string overview_levels;
+    static string overview_resampling;
+
+    // JPEG2000 encoding. Zero sizes and resolutions use GDAL's defaults.
+    static string jp2_quality;
+    static bool jp2_reversible;
+    static int jp2_block_x_size;
+    static int jp2_block_y_size;
+    static int jp2_resolutions;
+
+    // Number of threads that read and convert the bands of a multiband
+    // response at the same time.
+    static int band_threads;
+
+    // Keep up to buffer_pool_size bytes of band buffers for reuse (see
+    // FONgBufferPool); optionally use transparent huge pages for them.
+    static unsigned long long buffer_pool_size;
+    static bool buffer_pool_huge_pages;
+
+    // Write the phase times and byte counts of each request to the BES
+    // log (see FONgRequestLog).
+    static bool request_log;
+
+    // GDAL setup: register every driver, or only those the module uses
+    // plus gdal_extra_drivers; the block cache size in bytes (zero for
+    // GDAL's default); GDAL_NUM_THREADS; GDAL_DISABLE_READDIR_ON_OPEN.
+    static bool gdal_register_all;
+    static string gdal_extra_drivers;
+    static unsigned long long gdal_cache_max;
+    static string gdal_num_threads;
+    static bool gdal_disable_readdir;
+
+    // The memory, in bytes, the conversions running at once on this host
+    // may use (zero for no limit) and how long a request waits for it, in
+    // seconds (see FONgAdmission).
+    static unsigned long long admission_budget;
+    static int admission_timeout;
+
+    // The response cache; an empty cache_dir disables it. Size in bytes.
+    static string cache_dir;
+    static unsigned long long cache_size;
 };
 
 #endif
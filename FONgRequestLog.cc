@@ -0,0 +1,154 @@
+// FONgRequestLog.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <time.h>
+#include <sys/time.h>
+
+#include <sstream>
+#include <iomanip>
+
+#include <BESLog.h>
+#include <BESDebug.h>
+
+#include "FONgRequestLog.h"
+#include "FONgRequestHandler.h"
+
+using namespace std;
+
+/** @brief Start timing a request
+ *
+ * @param format The response format, e.g., geotiff
+ */
+FONgRequestLog::FONgRequestLog(const string &format) :
+    d_format(format), d_status("error"), d_start(now()), d_mark(d_start), d_bytes_read(0), d_bytes_encoded(0),
+    d_bytes_sent(0)
+{
+}
+
+/** @brief Write the request's line
+ *
+ * Unless set_status() was called, the request is logged as an error;
+ * the destructor runs when a phase throws, too.
+ */
+FONgRequestLog::~FONgRequestLog()
+{
+    try {
+        string l = line();
+
+        BESDEBUG("fong2", l << endl);
+
+        if (FONgRequestHandler::request_log)
+            *(BESLog::TheLog()) << l << endl;
+    }
+    catch (...) {
+        // Never let logging change the outcome of a request
+    }
+}
+
+/// Seconds from an arbitrary start, using a monotonic clock if there is one
+double FONgRequestLog::now()
+{
+#ifdef CLOCK_MONOTONIC
+    struct timespec ts;
+    if (clock_gettime(CLOCK_MONOTONIC, &ts) == 0)
+        return ts.tv_sec + ts.tv_nsec / 1.0e9;
+#endif
+
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1.0e6;
+}
+
+/** @brief End a phase
+ *
+ * The phase's time is the time since the previous phase ended (or since
+ * the request started).
+ *
+ * @param name The phase
+ */
+void FONgRequestLog::phase(const string &name)
+{
+    double t = now();
+    add_phase(name, t - d_mark);
+    d_mark = t;
+}
+
+/** @brief Record a phase timed elsewhere
+ *
+ * Used for the parts of a transform, which FONgTransform times itself.
+ * The time is added to the phase's time if it has one already.
+ *
+ * @param name The phase
+ * @param seconds Its time
+ */
+void FONgRequestLog::add_phase(const string &name, double seconds)
+{
+    for (vector<pair<string, double> >::iterator i = d_phases.begin(); i != d_phases.end(); ++i) {
+        if (i->first == name) {
+            i->second += seconds;
+            return;
+        }
+    }
+
+    d_phases.push_back(make_pair(name, seconds));
+}
+
+/** @brief End the transform phase
+ *
+ * The transform's time is split in two: the part spent getting the band
+ * values (convert) and the rest, which is GDAL encoding the response
+ * (encode).
+ *
+ * @param convert_seconds FONgTransform::convert_time()
+ */
+void FONgRequestLog::transform_phase(double convert_seconds)
+{
+    double t = now();
+    double encode_seconds = t - d_mark - convert_seconds;
+    add_phase("convert", convert_seconds);
+    add_phase("encode", encode_seconds > 0 ? encode_seconds : 0);
+    d_mark = t;
+}
+
+/** @brief The request's log line
+ *
+ * A list of name=value pairs: format, dataset, status, the total time,
+ * the time of each phase (name_s) and the byte counts.
+ */
+string FONgRequestLog::line() const
+{
+    ostringstream oss;
+    oss << fixed << setprecision(6);
+    oss << "fong request: format=" << d_format << " dataset=" << (d_dataset.empty() ? "-" : d_dataset)
+        << " status=" << d_status << " total_s=" << now() - d_start;
+
+    for (vector<pair<string, double> >::const_iterator i = d_phases.begin(); i != d_phases.end(); ++i)
+        oss << " " << i->first << "_s=" << i->second;
+
+    oss << " bytes_read=" << d_bytes_read << " bytes_encoded=" << d_bytes_encoded << " bytes_sent=" << d_bytes_sent;
+
+    return oss.str();
+}
@@ -0,0 +1,83 @@
+// FONgRequestLog.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgRequestLog_h_
+#define FONgRequestLog_h_ 1
+
+#include <string>
+#include <vector>
+#include <utility>
+
+using std::string;
+
+/** @brief Time the phases of one request and count its bytes
+ *
+ * A transmitter makes one of these for each request and calls phase()
+ * as each step (cache lookup, constraint parsing, reading, transforming,
+ * sending) finishes. When the object is destroyed, it writes a single
+ * line with the time spent in each phase, the bytes read, encoded and
+ * sent and the request's status. The line goes to the BES log if
+ * FONg.RequestLog is set and to the fong2 debug channel in any case.
+ *
+ * Times use a monotonic clock.
+ */
+class FONgRequestLog {
+private:
+    string d_format;
+    string d_dataset;
+    string d_status;
+
+    double d_start;
+    double d_mark;
+
+    std::vector<std::pair<string, double> > d_phases;
+
+    unsigned long long d_bytes_read;
+    unsigned long long d_bytes_encoded;
+    unsigned long long d_bytes_sent;
+
+    FONgRequestLog(const FONgRequestLog &);
+    FONgRequestLog &operator=(const FONgRequestLog &);
+
+public:
+    FONgRequestLog(const string &format);
+    ~FONgRequestLog();
+
+    static double now();
+
+    void phase(const string &name);
+    void add_phase(const string &name, double seconds);
+    void transform_phase(double convert_seconds);
+
+    void set_dataset(const string &dataset) { d_dataset = dataset; }
+    void set_status(const string &status) { d_status = status; }
+
+    void set_bytes_read(unsigned long long n) { d_bytes_read = n; }
+    void set_bytes_encoded(unsigned long long n) { d_bytes_encoded = n; }
+    void add_bytes_sent(unsigned long long n) { d_bytes_sent += n; }
+
+    string line() const;
+};
+
+#endif // FONgRequestLog_h_
@@ -0,0 +1,556 @@
+// FONgResponseCache.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <sstream>
+
+#include <BESDataHandlerInterface.h>
+#include <BESContainer.h>
+#include <BESDataNames.h>
+#include <BESInternalError.h>
+#include <BESDebug.h>
+#include <TheBESKeys.h>
+
+#include <gdal.h>
+
+#include "FONgResponseCache.h"
+#include "FONgRequestHandler.h"
+
+using namespace std;
+
+// Cache entries are named ENTRY_PREFIX<hash>; files being built are named
+// TEMP_PREFIX<random>. The lock file serializes purging and holds the
+// cache's size, as found by the last purge plus the entries added since.
+#define ENTRY_PREFIX "fong_"
+#define TEMP_PREFIX "tmp_fong_"
+#define LOCK_FILE "lock_fong"
+
+// Temporary files older than this (seconds) were left by a process that
+// died while building a response.
+#define STALE_TEMP_AGE 3600
+
+// The recorded size drifts (entries replaced or removed by hand aren't
+// subtracted); scan the directory at least this often (seconds).
+#define RESCAN_INTERVAL 600
+
+// Each entry ends with its key followed by the key's length, written as
+// this many hex digits.
+#define KEY_LENGTH_DIGITS 16
+
+FONgResponseCache *FONgResponseCache::d_instance = 0;
+
+/** @brief Build the cache, making the cache directory if needed
+ *
+ * @param cache_dir The directory that holds the cache
+ * @param max_size The size, in bytes, the cache should not exceed
+ * @throws BESInternalError if the directory cannot be made
+ */
+FONgResponseCache::FONgResponseCache(const string &cache_dir, unsigned long long max_size) :
+    d_cache_dir(cache_dir), d_max_size(max_size)
+{
+    if (d_cache_dir.length() > 1 && d_cache_dir[d_cache_dir.length() - 1] == '/')
+        d_cache_dir = d_cache_dir.substr(0, d_cache_dir.length() - 1);
+
+    if (mkdir(d_cache_dir.c_str(), 0775) == -1 && errno != EEXIST)
+        throw BESInternalError("Could not make the response cache directory " + d_cache_dir + ": " + strerror(errno), __FILE__, __LINE__);
+}
+
+/** @brief Get the single instance of the response cache
+ *
+ * @return The cache or null if FONg.CacheDir is not set
+ */
+FONgResponseCache *FONgResponseCache::get_instance()
+{
+    if (!d_instance && !FONgRequestHandler::cache_dir.empty())
+        d_instance = new FONgResponseCache(FONgRequestHandler::cache_dir, FONgRequestHandler::cache_size);
+
+    return d_instance;
+}
+
+void FONgResponseCache::delete_instance()
+{
+    delete d_instance;
+    d_instance = 0;
+}
+
+/** 64-bit FNV-1a hash, used to turn a cache key into a file name */
+static unsigned long long fnv1a(const string &s)
+{
+    unsigned long long h = 14695981039346656037ULL;
+    for (string::size_type i = 0; i < s.length(); ++i) {
+        h ^= static_cast<unsigned char>(s[i]);
+        h *= 1099511628211ULL;
+    }
+
+    return h;
+}
+
+/** @brief The module's configuration, for the cache key
+ *
+ * Server keys such as FONg.Default_GCS change the bytes of a response
+ * without being one of the options the transmitters list, so every
+ * FONg.* key goes into the cache key, as a hash, along with GDAL's
+ * version. The keys don't change while the BES runs, so this is only
+ * built once.
+ */
+static string config_key()
+{
+    static string key;
+    if (key.empty()) {
+        ostringstream config;
+        TheBESKeys *keys = TheBESKeys::TheKeys();
+        for (TheBESKeys::Keys_citer i = keys->keys_begin(); i != keys->keys_end(); ++i) {
+            if (i->first.find("FONg.") != 0)
+                continue;
+            config << i->first << '=';
+            for (vector<string>::const_iterator v = i->second.begin(); v != i->second.end(); ++v)
+                config << *v << ';';
+            config << '\n';
+        }
+
+        char hash[17];
+        snprintf(hash, sizeof hash, "%016llx", fnv1a(config.str()));
+        key = string(",config=") + hash + ",gdal=" + GDALVersionInfo("RELEASE_NAME");
+    }
+
+    return key;
+}
+
+/** @brief Build the key for a request
+ *
+ * The key combines the dataset's path and modification time, the
+ * constraint expression, the response format, the options that
+ * affect how the response is built and the module's configuration (see
+ * config_key()).
+ *
+ * @param dhi The request
+ * @param format The response format (e.g., "geotiff")
+ * @param options Anything else that changes the response
+ * @return The key, or the empty string if the response cannot be cached
+ */
+string FONgResponseCache::get_key(BESDataHandlerInterface &dhi, const string &format, const string &options)
+{
+    if (!dhi.container)
+        return "";
+
+    string path = dhi.container->get_real_name();
+    struct stat st;
+    if (path.empty() || stat(path.c_str(), &st) == -1)
+        return "";
+
+    ostringstream key;
+    key << path << '\n' << st.st_mtime << '\n' << st.st_size << '\n' << dhi.data[POST_CONSTRAINT] << '\n'
+        << format << '\n' << options << config_key();
+
+    return key.str();
+}
+
+string FONgResponseCache::m_entry_name(const string &key) const
+{
+    char hash[17];
+    snprintf(hash, sizeof hash, "%016llx", fnv1a(key));
+
+    return d_cache_dir + "/" + ENTRY_PREFIX + hash;
+}
+
+/** @brief A template, suitable for mkstemp(), for a new cache entry
+ *
+ * Responses are built in the cache directory so that they can be
+ * renamed into place.
+ */
+string FONgResponseCache::get_temp_template() const
+{
+    return d_cache_dir + "/" + TEMP_PREFIX + "XXXXXX";
+}
+
+/** Read exactly n bytes at offset; false on error or a short read */
+static bool read_at(int fd, char *buf, size_t n, off_t offset)
+{
+    while (n > 0) {
+        ssize_t r = pread(fd, buf, n, offset);
+        if (r == -1 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            return false;
+        buf += r;
+        n -= r;
+        offset += r;
+    }
+
+    return true;
+}
+
+/** @brief Does this entry hold the response for key?
+ *
+ * Entry names are hashes of their keys, so two keys can share an entry
+ * name; the key stored at the end of the entry tells them apart.
+ *
+ * @param fd The entry
+ * @param key The key for the response
+ * @param size Value-result parameter; the size of the response, without
+ * the key
+ * @return True if the entry's key is key
+ */
+static bool entry_matches(int fd, const string &key, unsigned long long &size)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size < KEY_LENGTH_DIGITS)
+        return false;
+
+    char digits[KEY_LENGTH_DIGITS + 1];
+    if (!read_at(fd, digits, KEY_LENGTH_DIGITS, st.st_size - KEY_LENGTH_DIGITS))
+        return false;
+    digits[KEY_LENGTH_DIGITS] = '\0';
+
+    char *end = 0;
+    unsigned long long length = strtoull(digits, &end, 16);
+    if (*end != '\0' || length != key.length()
+        || length + KEY_LENGTH_DIGITS > static_cast<unsigned long long>(st.st_size))
+        return false;
+
+    size = st.st_size - KEY_LENGTH_DIGITS - length;
+
+    vector<char> stored(length + 1);
+    if (!read_at(fd, &stored[0], length, size))
+        return false;
+
+    return key.compare(0, string::npos, &stored[0], length) == 0;
+}
+
+/** @brief Look for a cached response
+ *
+ * On a hit the entry's modification time is updated; that time is used
+ * to find the least recently used entries when purging. An entry whose
+ * name matches but whose stored key does not is a miss.
+ *
+ * @param key The key for the response
+ * @param size Value-result parameter; the number of bytes of the entry
+ * that are the response (see FONgUtils::send_file())
+ * @return An open file descriptor for the entry or -1 if there is no entry
+ */
+int FONgResponseCache::get_read_fd(const string &key, unsigned long long &size)
+{
+    string entry = m_entry_name(key);
+
+    int fd = open(entry.c_str(), O_RDONLY);
+    if (fd == -1)
+        return -1;
+
+    if (!entry_matches(fd, key, size)) {
+        BESDEBUG("fong2", "FONgResponseCache: " << entry << " holds another response" << endl);
+        close(fd);
+        return -1;
+    }
+
+    (void) utimes(entry.c_str(), NULL);
+
+    BESDEBUG("fong2", "FONgResponseCache: hit for " << entry << endl);
+
+    return fd;
+}
+
+/** Write all of buf to fd */
+static bool write_all(int fd, const char *buf, unsigned long long len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+
+    return true;
+}
+
+/** @brief Add a response to the cache
+ *
+ * The file must be in the cache directory (see get_temp_template()). The
+ * key is appended to it, so that get_read_fd() can tell responses whose
+ * keys hash to the same name apart, and it is renamed into place, which
+ * is atomic, so a process reading the cache never sees a partial entry.
+ * If the file cannot be added it is removed.
+ *
+ * The entry's size is added to the size recorded in the lock file; the
+ * cache directory is only scanned (see purge()) when that exceeds
+ * FONg.CacheSize or the last scan is more than RESCAN_INTERVAL seconds
+ * old.
+ *
+ * @param temp_file The response
+ * @param key The key for the response
+ * @return True if the response was added
+ */
+bool FONgResponseCache::put(const string &temp_file, const string &key)
+{
+    string entry = m_entry_name(key);
+
+    char digits[KEY_LENGTH_DIGITS + 1];
+    snprintf(digits, sizeof digits, "%016llx", static_cast<unsigned long long>(key.length()));
+
+    unsigned long long size = 0;
+    int fd = open(temp_file.c_str(), O_WRONLY | O_APPEND);
+    bool ok = fd != -1 && write_all(fd, key.data(), key.length()) && write_all(fd, digits, KEY_LENGTH_DIGITS);
+    struct stat st;
+    if (ok && fstat(fd, &st) == 0)
+        size = st.st_size;
+    if (fd != -1 && close(fd) == -1)
+        ok = false;
+
+    if (!ok) {
+        BESDEBUG("fong2", "FONgResponseCache: could not add the key to " << temp_file << ": " << strerror(errno) << endl);
+        (void) unlink(temp_file.c_str());
+        return false;
+    }
+
+    if (rename(temp_file.c_str(), entry.c_str()) == -1) {
+        BESDEBUG("fong2", "FONgResponseCache: could not add " << entry << ": " << strerror(errno) << endl);
+        (void) unlink(temp_file.c_str());
+        return false;
+    }
+
+    BESDEBUG("fong2", "FONgResponseCache: added " << entry << endl);
+
+    m_add_to_size(size);
+
+    return true;
+}
+
+/** @brief Add a response held in memory to the cache
+ *
+ * @param buf The response
+ * @param len Number of bytes in buf
+ * @param key The key for the response
+ * @return True if the response was added
+ */
+bool FONgResponseCache::put_buffer(const char *buf, unsigned long long len, const string &key)
+{
+    string temp_file_name = get_temp_template();
+    vector<char> temp_file(temp_file_name.begin(), temp_file_name.end());
+    temp_file.push_back('\0');
+
+    mode_t original_mode = umask(077);
+    int fd = mkstemp(&temp_file[0]);
+    umask(original_mode);
+
+    if (fd == -1)
+        return false;
+
+    if (!write_all(fd, buf, len)) {
+        close(fd);
+        (void) unlink(&temp_file[0]);
+        return false;
+    }
+
+    close(fd);
+
+    return put(&temp_file[0], key);
+}
+
+struct cache_entry {
+    string name;
+    unsigned long long size;
+    time_t mtime;
+
+    bool operator<(const cache_entry &rhs) const { return mtime < rhs.mtime; }
+};
+
+/** Open and lock the cache's lock file; -1 on error */
+static int lock_cache(const string &lock_file)
+{
+    int lock_fd = open(lock_file.c_str(), O_RDWR | O_CREAT, 0664);
+    if (lock_fd == -1)
+        return -1;
+
+    if (flock(lock_fd, LOCK_EX) == -1) {
+        close(lock_fd);
+        return -1;
+    }
+
+    return lock_fd;
+}
+
+static void unlock_cache(int lock_fd)
+{
+    flock(lock_fd, LOCK_UN);
+    close(lock_fd);
+}
+
+/** Read the size and scan time recorded in the lock file; false if there
+ * are none (e.g., the lock file is new) */
+static bool read_size(int lock_fd, unsigned long long &size, time_t &scanned)
+{
+    char buf[64];
+    ssize_t n;
+    do {
+        n = pread(lock_fd, buf, sizeof buf - 1, 0);
+    } while (n == -1 && errno == EINTR);
+    if (n <= 0)
+        return false;
+    buf[n] = '\0';
+
+    long long t;
+    if (sscanf(buf, "%llu %lld", &size, &t) != 2)
+        return false;
+    scanned = static_cast<time_t>(t);
+
+    return true;
+}
+
+static void write_size(int lock_fd, unsigned long long size, time_t scanned)
+{
+    char buf[64];
+    int n = snprintf(buf, sizeof buf, "%llu %lld\n", size, static_cast<long long>(scanned));
+    if (ftruncate(lock_fd, 0) == 0)
+        (void) pwrite(lock_fd, buf, n, 0);
+}
+
+/** @brief Record that an entry of this many bytes was added
+ *
+ * Purge the cache if the recorded size exceeds FONg.CacheSize, if there
+ * is no recorded size or if the last scan is RESCAN_INTERVAL seconds
+ * old; otherwise just record the new size.
+ *
+ * @param size The size of the new entry
+ */
+void FONgResponseCache::m_add_to_size(unsigned long long size)
+{
+    int lock_fd = lock_cache(d_cache_dir + "/" + LOCK_FILE);
+    if (lock_fd == -1)
+        return;
+
+    unsigned long long total = 0;
+    time_t scanned = 0;
+    bool known = read_size(lock_fd, total, scanned);
+    total += size;
+
+    if (!known || total > d_max_size || time(NULL) - scanned > RESCAN_INTERVAL)
+        m_purge(lock_fd);
+    else
+        write_size(lock_fd, total, scanned);
+
+    unlock_cache(lock_fd);
+}
+
+/** @brief Remove the least recently used entries until the cache fits
+ *
+ * Also remove temporary files left by processes that died while building
+ * a response. An exclusive lock on the cache's lock file ensures that only
+ * one process purges at a time. Removing an entry another process is
+ * reading is safe; the reader keeps its open descriptor.
+ */
+void FONgResponseCache::purge()
+{
+    int lock_fd = lock_cache(d_cache_dir + "/" + LOCK_FILE);
+    if (lock_fd == -1)
+        return;
+
+    m_purge(lock_fd);
+
+    unlock_cache(lock_fd);
+}
+
+/** @brief Scan the cache directory and remove entries until it fits
+ *
+ * The size that remains is recorded in the lock file.
+ *
+ * @param lock_fd The lock file, which the caller has locked
+ */
+void FONgResponseCache::m_purge(int lock_fd)
+{
+    DIR *dir = opendir(d_cache_dir.c_str());
+    if (!dir)
+        return;
+
+    vector<cache_entry> entries;
+    unsigned long long total = 0;
+    time_t now = time(NULL);
+
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        string name = de->d_name;
+        string path = d_cache_dir + "/" + name;
+        struct stat st;
+
+        if (name.find(ENTRY_PREFIX) == 0) {
+            if (stat(path.c_str(), &st) == -1)
+                continue;
+
+            cache_entry e;
+            e.name = path;
+            e.size = st.st_size;
+            e.mtime = st.st_mtime;
+            entries.push_back(e);
+
+            total += st.st_size;
+        }
+        else if (name.find(TEMP_PREFIX) == 0) {
+            if (stat(path.c_str(), &st) == 0 && now - st.st_mtime > STALE_TEMP_AGE)
+                (void) unlink(path.c_str());
+        }
+    }
+
+    closedir(dir);
+
+    if (total > d_max_size) {
+        sort(entries.begin(), entries.end());
+
+        vector<cache_entry>::iterator i = entries.begin();
+        while (total > d_max_size && i != entries.end()) {
+            BESDEBUG("fong2", "FONgResponseCache: purging " << i->name << endl);
+            if (unlink(i->name.c_str()) == 0)
+                total -= i->size;
+            ++i;
+        }
+    }
+
+    write_size(lock_fd, total, now);
+}
+
+void FONgResponseCache::dump(ostream &strm) const
+{
+    strm << BESIndent::LMarg << "FONgResponseCache::dump - (" << (void *) this << ")" << endl;
+    BESIndent::Indent();
+    strm << BESIndent::LMarg << "cache dir: " << d_cache_dir << endl;
+    strm << BESIndent::LMarg << "max size: " << d_max_size << endl;
+    BESIndent::UnIndent();
+}
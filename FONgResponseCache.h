@@ -0,0 +1,79 @@
+// FONgResponseCache.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgResponseCache_h_
+#define FONgResponseCache_h_ 1
+
+#include <string>
+
+#include <BESObj.h>
+
+class BESDataHandlerInterface;
+
+/** @brief An on-disk cache of GeoTiff and JPEG2000 responses
+ *
+ * Responses are stored in FONg.CacheDir, one file per response, named
+ * using a hash of the dataset's path and modification time, the
+ * constraint expression, the response format, the options used to
+ * build the response and the module's configuration. Each entry ends with its full key, which is
+ * checked on every hit, so keys that hash to the same name never return
+ * each other's responses. Entries are written to a temporary file and
+ * renamed into place, so several BES processes can share one cache
+ * directory. The cache's size is recorded in its lock file and updated
+ * as entries are added. When it exceeds FONg.CacheSize, the least
+ * recently used entries are removed.
+ */
+class FONgResponseCache : public BESObj {
+private:
+    string d_cache_dir;
+    unsigned long long d_max_size;
+
+    static FONgResponseCache *d_instance;
+
+    FONgResponseCache(const string &cache_dir, unsigned long long max_size);
+
+    string m_entry_name(const string &key) const;
+    void m_add_to_size(unsigned long long size);
+    void m_purge(int lock_fd);
+
+public:
+    virtual ~FONgResponseCache() {}
+
+    static FONgResponseCache *get_instance();
+    static void delete_instance();
+
+    static string get_key(BESDataHandlerInterface &dhi, const string &format, const string &options);
+
+    string get_temp_template() const;
+
+    int get_read_fd(const string &key, unsigned long long &size);
+    bool put(const string &temp_file, const string &key);
+    bool put_buffer(const char *buf, unsigned long long len, const string &key);
+
+    void purge();
+
+    virtual void dump(ostream &strm) const;
+};
+
+#endif // FONgResponseCache_h_
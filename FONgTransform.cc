@@ -24,7 +24,16 @@
 
 #include "config.h"
 
+#include <pthread.h>
+
+#include <algorithm>
 #include <cstdlib>
+#include <cctype>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <limits>
+#include <sstream>
 
 #include <gdal.h>
 #include <gdal_priv.h>
@@ -39,15 +48,36 @@
 
 #include <BESDebug.h>
 #include <BESInternalError.h>
+#include <BESInternalFatalError.h>
+#include <BESError.h>
+#include <BESSyntaxUserError.h>
+#include <BESForbiddenError.h>
+#include <BESNotFoundError.h>
 
 #include "FONgTransform.h"
 
 #include "FONgBaseType.h"
+#include "FONgArray.h"
 #include "FONgGrid.h"
+#include "FONgExtrema.h"
+#include "FONgRequestHandler.h"
+#include "FONgUtils.h"
+#include "FONgRequestLog.h"
 
 using namespace std;
 using namespace libdap;
 
+// Number of blocks the pipeline's reader may get ahead of the writer
+#define FONG_PIPELINE_DEPTH 2
+
+// Tile width and height used when FONg.Tiled is set and no block size is
+// given
+#define FONG_DEFAULT_TILE_SIZE 256
+
+// JPEG2000 images with at least this many pixels are encoded using all
+// the CPUs unless FONg.NumThreads is set
+#define FONG_JP2_THREADED_PIXELS (1024 * 1024)
+
 /** @brief Constructor that creates transformation object from the specified
  * DataDDS object to the specified file
  *
@@ -61,12 +91,33 @@ using namespace libdap;
 FONgTransform::FONgTransform(DDS *dds, ConstraintEvaluator &/*evaluator*/, const string &localfile) :
     d_dest(0), d_dds(dds), d_localfile(localfile),
     d_geo_transform_set(false), d_width(0.0), d_height(0.0), d_top(0.0), d_left(0.0),
-    d_bottom(0.0), d_right(0.0), d_no_data(0.0), d_no_data_type(none), d_num_bands(0)
+    d_bottom(0.0), d_right(0.0), d_no_data(0.0), d_no_data_type(none), d_num_bands(0),
+    d_pipeline(FONgRequestHandler::pipeline),
+    d_force_float64(FONgUtils::get_bool_context("fong_force_float64", FONgRequestHandler::force_float64)),
+    d_cog(false), d_compressed(false), d_convert_time(0.0), d_source_width(0), d_source_height(0)
 {
     if (localfile.empty())
         throw BESInternalError("Empty local file name passed to constructor", __FILE__, __LINE__);
 }
 
+/** @brief Constructor for responses that are not files
+ *
+ * Only transform_to_statistics() can be used with an object made this
+ * way.
+ *
+ * @param dds DataDDS object that contains the data structure, attributes
+ * and data
+ * @param evaluator The constraint evaluator
+ */
+FONgTransform::FONgTransform(DDS *dds, ConstraintEvaluator &/*evaluator*/) :
+    d_dest(0), d_dds(dds),
+    d_geo_transform_set(false), d_width(0.0), d_height(0.0), d_top(0.0), d_left(0.0),
+    d_bottom(0.0), d_right(0.0), d_no_data(0.0), d_no_data_type(none), d_num_bands(0),
+    d_pipeline(false), d_force_float64(false),
+    d_cog(false), d_compressed(false), d_convert_time(0.0), d_source_width(0), d_source_height(0)
+{
+}
+
 /** @brief Destructor
  *
  * Cleans up any temporary data created during the transformation
@@ -78,456 +129,2613 @@ FONgTransform::~FONgTransform()
     while (i != e) {
         delete (*i++);
     }
+
+    BESDEBUG("fong2", "Buffer pool hits: " << FONgBufferPool::hits() << ", misses: " << FONgBufferPool::misses() << endl);
 }
 
 /** @brief can this DAP type be turned into a GeoTiff or JP2 file?
  *
+ * Grids and numeric Arrays of two or more dimensions can. Arrays with
+ * one dimension are left out because they are the coordinates of the
+ * others.
  */
 static bool
-is_convertable_type(const BaseType *b)
+is_convertable_type(BaseType *b)
 {
     switch (b->type()) {
         case dods_grid_c:
             return true;
 
-        // TODO Add support for Array (?)
-        case dods_array_c:
+        case dods_array_c: {
+            Array *a = static_cast<Array*>(b);
+            switch (a->var()->type()) {
+            case dods_byte_c:
+            case dods_int16_c:
+            case dods_uint16_c:
+            case dods_int32_c:
+            case dods_uint32_c:
+            case dods_float32_c:
+            case dods_float64_c:
+                return a->dimensions() >= 2;
+            default:
+                return false;
+            }
+        }
+
         default:
             return false;
     }
 }
 
+/** The Array that holds the values of a variable is_convertable_type()
+ * accepts. */
+static Array *band_array(BaseType *b)
+{
+    if (b->type() == dods_grid_c)
+        return static_cast<Grid*>(b)->get_array();
+
+    return static_cast<Array*>(b);
+}
+
+/** The number of dimensions of an Array whose size is not one */
+static int varying_dimensions(Array *a)
+{
+    int dims = 0;
+    for (Array::Dim_iter d = a->dim_begin(); d != a->dim_end(); ++d) {
+        if (a->dimension_size(d, true) > 1)
+            ++dims;
+    }
+
+    return dims;
+}
+
 /** @brief creates a FONg object for the given DAP object
  *
  * @param v The DAP object to convert
+ * @param dds The DDS that holds v; used to find the coordinates of Arrays
  * @returns The FONg object created via the DAP object
  * @throws BESInternalError if the DAP object is not an expected type
  */
-static FONgBaseType *convert(BaseType *v)
+static FONgBaseType *convert(BaseType *v, DDS *dds)
 {
     switch (v->type()) {
     case dods_grid_c:
         return  new FONgGrid(static_cast<Grid*>(v));
 
+    case dods_array_c:
+        return new FONgArray(static_cast<Array*>(v), dds);
+
     default:
         throw BESInternalError("file out GeoTiff, unable to write unknown variable type", __FILE__, __LINE__);
     }
 }
 
-/** @breif scale the values for a better looking result
- *
- * Often datasets use very small (or less often, very large) values
- * to indicate 'no data' or 'missing data'. The GDAL library scales
- * data so that the entire range of data values are represented in
- * a grayscale image. When the no data value is very small this
- * skews the mean of the values to some very small number. This code
- * builds a histogram of the data and then computes a new 'no data'
- * value based on the smallest (or largest) value that is greater
- * than (or less than) the no data value.
+/** Can the value v be stored in a T without overflow? */
+template <typename T>
+static bool representable(double v)
+{
+    if (!numeric_limits<T>::is_integer)
+        return true;
+
+    return v >= numeric_limits<T>::min() && v <= numeric_limits<T>::max();
+}
+
+/** Can the value v be stored in a band of this type without overflow? */
+static bool representable(double v, GDALDataType type)
+{
+    switch (type) {
+    case GDT_Byte: return representable<dods_byte>(v);
+    case GDT_Int16: return representable<dods_int16>(v);
+    case GDT_UInt16: return representable<dods_uint16>(v);
+    case GDT_Int32: return representable<dods_int32>(v);
+    case GDT_UInt32: return representable<dods_uint32>(v);
+    default: return true;
+    }
+}
+
+// Values of FONg.Compress (or fong_compress) that are passed to GDAL
+static const char *compress_methods[] = {
+    "NONE", "DEFLATE", "LZW", "ZSTD", "LERC", "LERC_DEFLATE", "LERC_ZSTD", "PACKBITS", 0
+};
+
+/** @brief The size of a GeoTiff tile along one dimension
  *
- * @note The initial no data value is determined be looking at attributes and
- * is done by FONgBaseType::extract_coordinates().
- * @note It's an error to call this if no_data_type() is 'none'.
+ * GeoTiff tiles must be a multiple of 16 pixels. When no size is given,
+ * use FONG_DEFAULT_TILE_SIZE or, for small grids, the grid's size so
+ * that tiles are not mostly padding.
  *
- * @param data The data values to fiddle
+ * @param size The configured size; zero or less to use the grid's shape
+ * @param dim The grid's size along the same dimension
  */
-void FONgTransform::m_scale_data(double *data)
+static int tile_size(int size, int dim)
 {
-    // It is an error to call this if no_data_type() is 'none'
-    set<double> hist;
-    for (int i = 0; i < width() * height(); ++i)
-        hist.insert(data[i]);
+    if (size <= 0)
+        size = min(dim, FONG_DEFAULT_TILE_SIZE);
 
-    BESDEBUG("fong3", "Hist count: " << hist.size() << endl);
+    return max(16, (size + 15) / 16 * 16);
+}
 
-    if (no_data_type() == negative && hist.size() > 1) {
-        // Values are sorted by 'weak' <, so this is the smallest value
-        // and ++i is the next smallest value. Assume no_data is the
-        // smallest value in the data set and ++i is the smallest actual
-        // data value. Reset the no_data value to be 1.0 < the smallest
-        // actual value. This makes for a good grayscale photometric
-        // GeoTiff w/o changing the actual data values.
-        set<double>::iterator i = hist.begin();
-        double smallest = *(++i);
-        if (fabs(smallest + no_data()) > 1) {
-            smallest -= 1.0;
+/** @brief Read the compression settings
+ *
+ * The settings come from FONg.Compress, FONg.Predictor and FONg.ZLevel,
+ * or the contexts fong_compress, fong_predictor and fong_zlevel. When
+ * DEFLATE, LZW or ZSTD compression is used and no predictor is given,
+ * use horizontal differencing (2) for integer bands and the floating
+ * point predictor (3) for Float32/64 bands.
+ *
+ * @param band_type The type of the dataset's bands
+ * @param compress Value-result parameter; the compression scheme, in
+ * upper case, or empty for no compression
+ * @param predictor Value-result parameter; the TIFF predictor or empty
+ * @param zlevel Value-result parameter; the compression level or empty;
+ * empty for schemes that have no level
+ * @exception BESSyntaxUserError if the compression scheme is not known,
+ * the predictor is not 1, 2 or 3, or the level is out of range for the
+ * scheme
+ */
+static void get_compression(GDALDataType band_type, string &compress, string &predictor, string &zlevel)
+{
+    compress = FONgUtils::get_string_context("fong_compress", FONgRequestHandler::compress);
+    for (string::size_type i = 0; i < compress.length(); ++i)
+        compress[i] = toupper(compress[i]);
 
-            BESDEBUG("fong3", "New no_data value: " << smallest << endl);
+    predictor = "";
+    zlevel = "";
 
-            for (int i = 0; i < width() * height(); ++i) {
-                if (data[i] <= no_data()) {
-                    data[i] = smallest;
-                }
-            }
-        }
+    if (compress.empty() || compress == "NONE") {
+        compress = "";
+        return;
     }
-    else {
-        set<double>::reverse_iterator r = hist.rbegin();
-        double biggest = *(++r);
-        if (fabs(no_data() - biggest) > 1) {
-            biggest += 1.0;
-
-            BESDEBUG("fong3", "New no_data value: " << biggest << endl);
 
-            for (int i = 0; i < width() * height(); ++i) {
-                if (data[i] >= no_data()) {
-                    data[i] = biggest;
-                }
-            }
-        }
+    bool known = false;
+    for (const char **m = compress_methods; *m && !known; ++m)
+        known = (compress == *m);
+    if (!known)
+        throw BESSyntaxUserError("Unknown GeoTiff compression: '" + compress + "'.", __FILE__, __LINE__);
+
+    predictor = FONgUtils::get_string_context("fong_predictor", FONgRequestHandler::predictor);
+    if (predictor.empty() && (compress == "DEFLATE" || compress == "LZW" || compress == "ZSTD"))
+        predictor = (band_type == GDT_Float32 || band_type == GDT_Float64) ? "3" : "2";
+    if (!predictor.empty() && predictor != "1" && predictor != "2" && predictor != "3")
+        throw BESSyntaxUserError("The GeoTiff predictor (fong_predictor) must be 1, 2 or 3, not '" + predictor + "'.", __FILE__, __LINE__);
+
+    // Only DEFLATE and ZSTD (and the LERC variants that use them) have a level
+    zlevel = FONgUtils::get_string_context("fong_zlevel", FONgRequestHandler::zlevel);
+    int max_level = compress.find("ZSTD") != string::npos ? 22 : (compress.find("DEFLATE") != string::npos ? 9 : 0);
+    if (max_level == 0) {
+        zlevel = "";
+    }
+    else if (!zlevel.empty()) {
+        char *end = 0;
+        long level = strtol(zlevel.c_str(), &end, 10);
+        if (*end != '\0' || level < 1 || level > max_level)
+            throw BESSyntaxUserError("The " + compress + " level (fong_zlevel) must be between 1 and " + long_to_string(max_level)
+                + ", not '" + zlevel + "'.", __FILE__, __LINE__);
     }
 }
 
-/** @brief Build the geotransform array needed by GDAL
- *
- * This code uses values gleaned by FONgBaseType:extract_coordinates()
- * to build up the six value array of transform parameters that
- * GDAL needs to set the geographic transform.
+/** The number of threads GDAL uses to compress a GeoTiff or COG:
+ * fong_num_threads or FONg.NumThreads, or all of the CPUs when neither is
+ * set. */
+static string compression_threads()
+{
+    string num_threads = FONgUtils::get_string_context("fong_num_threads", FONgRequestHandler::num_threads);
+    return num_threads.empty() ? "ALL_CPUS" : num_threads;
+}
+
+/** @brief Build the GeoTiff creation options
  *
- * @note This method returns a pointer to a class field; don't delete
- * it.
+ * The layout and compression come from the FONg.Tiled, FONg.BlockXSize,
+ * FONg.BlockYSize, FONg.Compress, FONg.Predictor, FONg.ZLevel and
+ * FONg.NumThreads keys. A request can override each of these using the
+ * contexts fong_tiled, fong_block_x_size, fong_block_y_size,
+ * fong_compress, fong_predictor, fong_zlevel and fong_num_threads.
  *
- * @return A pointer to the six element array of parameters (doubles)
+ * @param band_type The type of the dataset's bands
+ * @param force_tiled Make a tiled GeoTiff regardless of FONg.Tiled
+ * @param compressed If false, don't compress the GeoTiff
+ * @return The options; the caller must free them using CSLDestroy().
+ * @exception BESSyntaxUserError if the compression settings are not valid
+ * @see get_compression()
  */
-double *FONgTransform::geo_transform()
+char **FONgTransform::m_geotiff_options(GDALDataType band_type, bool force_tiled, bool compressed)
 {
+    char **options = NULL;
+    // NB: Changing PHOTOMETIC to MINISWHITE doesn't seem to have any visible affect,
+    // although the resulting files differ. jhrg 11/21/12
+    options = CSLSetNameValue(options, "PHOTOMETRIC", "MINISBLACK" ); // The default for GDAL
 
-    BESDEBUG("fong3", "left: " << d_left << ", top: " << d_top << ", right: " << d_right << ", bottom: " << d_bottom << endl);
-    BESDEBUG("fong3", "width: " << d_width << ", height: " << d_height << endl);
-
-    d_gt[0] = d_left; // The leftmost 'x' value, which is longitude
-    d_gt[3] = d_top;  // The topmost 'y' value, which is latitude
+    int block_x_size = FONgUtils::get_int_context("fong_block_x_size", FONgRequestHandler::block_x_size);
+    int block_y_size = FONgUtils::get_int_context("fong_block_y_size", FONgRequestHandler::block_y_size);
+    if (force_tiled || FONgUtils::get_bool_context("fong_tiled", FONgRequestHandler::tiled)) {
+        options = CSLSetNameValue(options, "TILED", "YES");
+        options = CSLSetNameValue(options, "BLOCKXSIZE", long_to_string(tile_size(block_x_size, width())).c_str());
+        options = CSLSetNameValue(options, "BLOCKYSIZE", long_to_string(tile_size(block_y_size, height())).c_str());
+    }
+    else if (block_y_size > 0) {
+        // For a stripped GeoTiff, this is the number of rows per strip
+        options = CSLSetNameValue(options, "BLOCKYSIZE", long_to_string(block_y_size).c_str());
+    }
 
-    // We assume data w/o any rotation (a north-up image)
-    d_gt[2] = 0.0;
-    d_gt[4] = 0.0;
+    string compress, predictor, zlevel;
+    if (compressed)
+        get_compression(band_type, compress, predictor, zlevel);
 
-    // Compute the lower left values. Note that wehn GDAL builds the geotiff
-    // output dataset, it correctly inverts the image when the source data has
-    // inverted latitude values.
-    d_gt[1] = (d_right - d_left) / d_width; // width in pixels; top and bottom in lat
-    d_gt[5] = (d_bottom - d_top) / d_height;
+    if (!compress.empty()) {
+        options = CSLSetNameValue(options, "COMPRESS", compress.c_str());
+        if (!predictor.empty())
+            options = CSLSetNameValue(options, "PREDICTOR", predictor.c_str());
+        if (!zlevel.empty())
+            options = CSLSetNameValue(options, compress.find("ZSTD") != string::npos ? "ZSTD_LEVEL" : "ZLEVEL", zlevel.c_str());
 
-    BESDEBUG("fong3", "gt[0]: " << d_gt[0] << ", gt[1]: " << d_gt[1] << ", gt[2]: " << d_gt[2] \
-             << ", gt[3]: " << d_gt[3] << ", gt[4]: " << d_gt[4] << ", gt[5]: " << d_gt[5] << endl);
+        options = CSLSetNameValue(options, "NUM_THREADS", compression_threads().c_str());
+    }
 
-   return d_gt;
+    return options;
 }
 
-/** @brief Is this effectively a two-dimensional variable?
+/** @brief Build the creation options for GDAL's COG driver
  *
- * Look at the Grid's Array and see if it is either a 2D array
- * or if it has been subset so that all but two dimensions are
- * removed. Assume that users know what they are doing.
- *
- * @note This code returns false for anything other than a
- * Grid.
+ * Uses the same keys and contexts as m_geotiff_options(), but with the
+ * COG driver's names for them. A COG's tiles are square, so only
+ * FONg.BlockXSize is used.
  *
- * @return True if this is a 2D array, false otherwise.
+ * @param band_type The type of the dataset's bands
+ * @param overviews True if the source dataset has overviews to copy
+ * @return The options; the caller must free them using CSLDestroy().
  */
-bool FONgTransform::effectively_two_D(FONgBaseType *fbtp)
+char **FONgTransform::m_cog_options(GDALDataType band_type, bool overviews)
 {
-    if (fbtp->type() == dods_grid_c) {
-        Grid *g = static_cast<FONgGrid*>(fbtp)->grid();
+    char **options = NULL;
 
-        if (g->get_array()->dimensions() == 2)
-            return true;
+    int block_size = FONgUtils::get_int_context("fong_block_x_size", FONgRequestHandler::block_x_size);
+    options = CSLSetNameValue(options, "BLOCKSIZE", long_to_string(tile_size(block_size, max(width(), height()))).c_str());
 
-        // count the dimensions with sizes other than 1
-        Array *a = g->get_array();
-        int dims = 0;
-        for (Array::Dim_iter d = a->dim_begin(); d != a->dim_end(); ++d) {
-            if (a->dimension_size(d, true) > 1)
-                ++dims;
-        }
+    string compress, predictor, zlevel;
+    get_compression(band_type, compress, predictor, zlevel);
 
-        return dims == 2;
-    }
+    // The COG driver compresses using LZW unless told otherwise
+    options = CSLSetNameValue(options, "COMPRESS", compress.empty() ? "NONE" : compress.c_str());
+    if (!compress.empty()) {
+        if (predictor == "1")
+            options = CSLSetNameValue(options, "PREDICTOR", "NO");
+        else if (predictor == "2")
+            options = CSLSetNameValue(options, "PREDICTOR", "STANDARD");
+        else if (predictor == "3")
+            options = CSLSetNameValue(options, "PREDICTOR", "FLOATING_POINT");
 
-    return false;
-}
+        if (!zlevel.empty())
+            options = CSLSetNameValue(options, "LEVEL", zlevel.c_str());
+    }
 
-static void build_delegate(BaseType *btp, FONgTransform &t)
-{
-    if (btp->send_p() && is_convertable_type(btp)) {
-        BESDEBUG( "fong3", "converting " << btp->name() << endl);
+    options = CSLSetNameValue(options, "NUM_THREADS", compression_threads().c_str());
 
-        // Build the delegate
-        FONgBaseType *fb = convert(btp);
+    options = CSLSetNameValue(options, "OVERVIEWS", overviews ? "FORCE_USE_EXISTING" : "NONE");
 
-        // Get the information needed for the transform.
-        // Note that FONgBaseType::extract_coordinates() also pushes the
-        // new FONgBaseType instance onto the FONgTransform's vector of
-        // delagate variable objects.
-        fb->extract_coordinates(t);
-    }
+    return options;
 }
 
-// Helper function to descend into Structures looking for Grids (and Arrays
-// someday).
-static void find_vars_helper(Structure *s, FONgTransform &t)
+/** @brief The overview levels for a COG
+ *
+ * FONg.OverviewLevels (or the context fong_overview_levels) is either
+ * AUTO, NONE or a comma separated list of decimation factors (e.g.,
+ * 2,4,8,16). With AUTO, overviews are added, each half the size of the
+ * last, until one fits in a single tile.
+ *
+ * @return The decimation factors; empty for no overviews.
+ * @exception BESSyntaxUserError if the levels can't be parsed
+ */
+vector<int> FONgTransform::m_overview_levels()
 {
-    Structure::Vars_iter vi = s->var_begin();
-    while (vi != s->var_end()) {
-        if ((*vi)->send_p() && is_convertable_type(*vi)) {
-            build_delegate(*vi, t);
-        }
-        else if ((*vi)->type() == dods_structure_c) {
-            find_vars_helper(static_cast<Structure*>(*vi), t);
+    string value = FONgUtils::get_string_context("fong_overview_levels", FONgRequestHandler::overview_levels);
+    for (string::size_type i = 0; i < value.length(); ++i)
+        value[i] = toupper(value[i]);
+
+    vector<int> levels;
+    if (value == "NONE")
+        return levels;
+
+    if (value.empty() || value == "AUTO") {
+        int block_size = FONgUtils::get_int_context("fong_block_x_size", FONgRequestHandler::block_x_size);
+        int tile = tile_size(block_size, max(width(), height()));
+        int factor = 1;
+        for (int size = max(width(), height()); size > tile; size = (size + 1) / 2) {
+            factor *= 2;
+            levels.push_back(factor);
         }
+        return levels;
+    }
 
-        ++vi;
+    const char *start = value.c_str();
+    while (*start) {
+        char *end = 0;
+        long factor = strtol(start, &end, 10);
+        if (end == start || factor < 2 || (*end != ',' && *end != '\0'))
+            throw BESSyntaxUserError("Overview levels must be AUTO, NONE or a list of factors like 2,4,8, not '" + value + "'.", __FILE__, __LINE__);
+        levels.push_back(factor);
+        start = (*end == ',') ? end + 1 : end;
     }
+
+    return levels;
 }
 
-// Helper function to scan the DDS top-level for Grids, ...
-// Note that FONgBaseType::extract_coordinates() sets a bunch of
-// values in the FONgBaseType instance _and_ this instance of
-// FONgTransform. One of these is 'num_bands()'. For GeoTiff,
-// num_bands() must be 1. This is tested in transform().
-static void find_vars(DDS *dds, FONgTransform &t)
+/** @brief The settings that change the GeoTiff built for a request
+ *
+ * This is used as part of the response cache key, so it must include
+ * everything read by m_geotiff_options() and m_band_type() that changes
+ * the response (FONg.NumThreads does not).
+ *
+ * @param cog True to include the settings used only for COGs
+ */
+string FONgTransform::geotiff_options_key(bool cog)
 {
-    DDS::Vars_iter vi = dds->var_begin();
-    while (vi != dds->var_end()) {
-        BESDEBUG( "fong3", "looking at: " << (*vi)->name() << " and it is/isn't selected: " << (*vi)->send_p() << endl);
-        if ((*vi)->send_p() && is_convertable_type(*vi)) {
-            BESDEBUG( "fong3", "converting " << (*vi)->name() << endl);
-            build_delegate(*vi, t);
-        }
-        else if ((*vi)->type() == dods_structure_c) {
-            find_vars_helper(static_cast<Structure*>(*vi), t);
-        }
-
-        ++vi;
-    }
+    string cog_key = cog ? ",overviews=" + FONgUtils::get_string_context("fong_overview_levels", FONgRequestHandler::overview_levels)
+        + ",resampling=" + FONgUtils::get_string_context("fong_overview_resampling", FONgRequestHandler::overview_resampling) : "";
+
+    return string("float64=") + (FONgUtils::get_bool_context("fong_force_float64", FONgRequestHandler::force_float64) ? "1" : "0")
+        + ",tiled=" + (FONgUtils::get_bool_context("fong_tiled", FONgRequestHandler::tiled) ? "1" : "0")
+        + ",bx=" + long_to_string(FONgUtils::get_int_context("fong_block_x_size", FONgRequestHandler::block_x_size))
+        + ",by=" + long_to_string(FONgUtils::get_int_context("fong_block_y_size", FONgRequestHandler::block_y_size))
+        + ",compress=" + FONgUtils::get_string_context("fong_compress", FONgRequestHandler::compress)
+        + ",predictor=" + FONgUtils::get_string_context("fong_predictor", FONgRequestHandler::predictor)
+        + ",zlevel=" + FONgUtils::get_string_context("fong_zlevel", FONgRequestHandler::zlevel)
+        + cog_key + output_size_key();
 }
 
-/** @brief Transforms the variables of the DataDDS to a GeoTiff file.
+/** @brief Build the JP2OpenJPEG creation options
  *
- * Scan the DDS of the dataset and find the Grids that have been projected.
- * Try to render their content as a GeoTiff. The result is a N-band GeoTiff
- * file.
+ * The encoding is set by the FONg.JP2Quality, FONg.JP2Reversible,
+ * FONg.JP2BlockXSize, FONg.JP2BlockYSize, FONg.JP2Resolutions and
+ * FONg.NumThreads keys. A request can override each of these using the
+ * contexts fong_jp2_quality, fong_jp2_reversible, fong_jp2_block_x_size,
+ * fong_jp2_block_y_size, fong_jp2_resolutions and fong_num_threads.
+ *
+ * When FONg.NumThreads is not set, images of FONG_JP2_THREADED_PIXELS
+ * or more pixels are encoded using all the CPUs.
+ *
+ * @return The options; the caller must free them using CSLDestroy().
  */
-void FONgTransform::transform_to_geotiff()
+char **FONgTransform::m_jpeg2000_options()
 {
-    // Scan the entire DDS looking for variables that have been 'projected' and
-    // build the delegate objects for them.
-    find_vars(d_dds, *this);
-
-    for (int i = 0; i < num_bands(); ++i)
-        if (!effectively_two_D(var(i)))
-            throw Error("GeoTiff responses can consist of two-dimensional variables only; use constraints to reduce the size of Grids as needed.");
-
-#if 0
-    GDALAllRegister();
-    CPLSetErrorHandler(CPLQuietErrorHandler);
-#endif
-
-    GDALDriver *Driver = GetGDALDriverManager()->GetDriverByName("GTiff");
-    if( Driver == NULL )
-        throw Error("Could not get the GTiff driver from/for GDAL: " + string(CPLGetLastErrorMsg()));
-
-    char **Metadata = Driver->GetMetadata();
-    if (!CSLFetchBoolean(Metadata, GDAL_DCAP_CREATE, FALSE))
-        throw Error("Could not make output format.");
-
-    BESDEBUG("fong3", "num_bands: " << num_bands() << "." << endl);
-
-    // NB: Changing PHOTOMETIC to MINISWHITE doesn't seem to have any visible affect,
-    // although the resulting files differ. jhrg 11/21/12
     char **options = NULL;
-    options = CSLSetNameValue(options, "PHOTOMETRIC", "MINISBLACK" ); // The default for GDAL
-    d_dest = Driver->Create(d_localfile.c_str(), width(), height(), num_bands(), GDT_Float64, options);
-    if (!d_dest)
-        throw Error("Could not create the geotiff dataset: " + string(CPLGetLastErrorMsg()));
+    options = CSLSetNameValue(options, "CODEC", "JP2");
+    options = CSLSetNameValue(options, "GMLJP2", "YES");
+    options = CSLSetNameValue(options, "GeoJP2", "NO");
+    // Put the band statistics (see m_set_statistics()) in the file's
+    // GDAL metadata box; otherwise they would go to a .aux.xml file
+    options = CSLSetNameValue(options, "WRITE_METADATA", "YES");
+
+    // QUALITY=100 and REVERSIBLE=YES is lossless; GDAL's defaults are 25 and NO
+    string quality = FONgUtils::get_string_context("fong_jp2_quality", FONgRequestHandler::jp2_quality);
+    options = CSLSetNameValue(options, "QUALITY", quality.c_str());
+
+    bool reversible = FONgUtils::get_bool_context("fong_jp2_reversible", FONgRequestHandler::jp2_reversible);
+    options = CSLSetNameValue(options, "REVERSIBLE", reversible ? "YES" : "NO");
+
+    int block_x_size = FONgUtils::get_int_context("fong_jp2_block_x_size", FONgRequestHandler::jp2_block_x_size);
+    if (block_x_size > 0)
+        options = CSLSetNameValue(options, "BLOCKXSIZE", long_to_string(block_x_size).c_str());
+
+    int block_y_size = FONgUtils::get_int_context("fong_jp2_block_y_size", FONgRequestHandler::jp2_block_y_size);
+    if (block_y_size > 0)
+        options = CSLSetNameValue(options, "BLOCKYSIZE", long_to_string(block_y_size).c_str());
+
+    int resolutions = FONgUtils::get_int_context("fong_jp2_resolutions", FONgRequestHandler::jp2_resolutions);
+    if (resolutions > 0)
+        options = CSLSetNameValue(options, "RESOLUTIONS", long_to_string(resolutions).c_str());
+
+    string num_threads = FONgUtils::get_string_context("fong_num_threads", FONgRequestHandler::num_threads);
+    if (num_threads.empty() && static_cast<unsigned long long>(width()) * height() >= FONG_JP2_THREADED_PIXELS)
+        num_threads = "ALL_CPUS";
+    if (!num_threads.empty())
+        options = CSLSetNameValue(options, "NUM_THREADS", num_threads.c_str());
+
+    for (char **o = options; o && *o; ++o)
+        BESDEBUG("fong3", "JPEG2000 option: " << *o << endl);
+
+    return options;
+}
 
-    d_dest->SetGeoTransform(geo_transform());
-    // Take the mapping data from the first variable
-    // var(0)->get_projection(d_dds, d_dest);
+/** @brief The settings that change the JPEG2000 built for a request
+ *
+ * Used as part of the response cache key. FONg.NumThreads does not change
+ * the response.
+ */
+string FONgTransform::jpeg2000_options_key()
+{
+    return string("float64=") + (FONgUtils::get_bool_context("fong_force_float64", FONgRequestHandler::force_float64) ? "1" : "0")
+        + ",quality=" + FONgUtils::get_string_context("fong_jp2_quality", FONgRequestHandler::jp2_quality)
+        + ",reversible=" + (FONgUtils::get_bool_context("fong_jp2_reversible", FONgRequestHandler::jp2_reversible) ? "1" : "0")
+        + ",bx=" + long_to_string(FONgUtils::get_int_context("fong_jp2_block_x_size", FONgRequestHandler::jp2_block_x_size))
+        + ",by=" + long_to_string(FONgUtils::get_int_context("fong_jp2_block_y_size", FONgRequestHandler::jp2_block_y_size))
+        + ",resolutions=" + long_to_string(FONgUtils::get_int_context("fong_jp2_resolutions", FONgRequestHandler::jp2_resolutions))
+        + output_size_key();
+}
 
-    BESDEBUG("fong3", "Made new temp file and set georeferencing (" << num_bands() << " vars)." << endl);
+/** @brief The per-request output size and band options, for the response
+ * cache key
+ *
+ * @see m_set_output_size(), multiband()
+ */
+string FONgTransform::output_size_key()
+{
+    return ",width=" + long_to_string(FONgUtils::get_int_context("fong_width", 0))
+        + ",height=" + long_to_string(FONgUtils::get_int_context("fong_height", 0))
+        + ",scale=" + FONgUtils::get_string_context("fong_scale", "")
+        + ",resampling=" + FONgUtils::get_string_context("fong_resampling", "average")
+        + ",multiband=" + (multiband() ? "1" : "0");
+}
 
-    bool projection_set = false;
-    string wkt = "";
-    for (int i = 0; i < num_bands(); ++i) {
-        FONgBaseType *fbtp = var(i);
+/** @brief Write the extra dimensions of a variable as bands?
+ *
+ * When set (by FONg.Multiband or the context fong_multiband), a variable
+ * with more than two dimensions whose size is not one, e.g., time, lat,
+ * lon, is written as one band for each element of its leading
+ * dimensions. Otherwise such a variable is an error.
+ */
+bool FONgTransform::multiband()
+{
+    return FONgUtils::get_bool_context("fong_multiband", FONgRequestHandler::multiband);
+}
 
-        if (!projection_set) {
-            wkt = fbtp->get_projection(d_dds);
-            if (d_dest->SetProjection(wkt.c_str()) != CPLE_None)
-                throw Error("Could not set the projection: " + string(CPLGetLastErrorMsg()));
-            projection_set = true;
-        }
-        else {
-            string wkt_i = fbtp->get_projection(d_dds);
-            if (wkt_i != wkt)
-                throw Error("In building a multiband response, different bands had different projection information.");
-        }
-#if 0
-        d_dest->AddBand(GDT_Float64, 0);
-        GDALRasterBand *band = d_dest->GetRasterBand(d_dest->GetRasterCount());
-        if (!band)
-            throw Error("Could not get the " + long_to_string(i) + "th band: " + string(CPLGetLastErrorMsg()));
-#endif
-        GDALRasterBand *band = d_dest->GetRasterBand(i+1);
-        if (!band)
-            throw Error("Could not get the " + long_to_string(i+1) + "th band: " + string(CPLGetLastErrorMsg()));
+/** @brief Align a block of rows with the band's blocks (strips or tiles)
+ *
+ * Writing whole blocks keeps GDAL from holding partly written blocks in
+ * its cache, which matters for tiled and compressed GeoTiffs.
+ *
+ * @param rows The number of rows
+ * @param band The band
+ * @return The number of rows, rounded down to a multiple of the band's
+ * block height when rows is bigger than one block.
+ */
+static int align_rows(int rows, GDALRasterBand *band)
+{
+    int block_x = 0, block_y = 0;
+    band->GetBlockSize(&block_x, &block_y);
+    if (block_y > 0 && rows > block_y)
+        rows -= rows % block_y;
 
-        try {
-            // TODO We can read any of the basic DAP2 types and let RasterIO convert it to any other type.
-            double *data = fbtp->get_data();
-
-            // hack the values; because the missing value used with many datasets
-            // is often really small it'll skew the mapping of values to the grayscale
-            // that GDAL performs. Move the no_data values to something closer to the
-            // other values in the dataset.
-            BESDEBUG("fong3", "no_data_type(): " << no_data_type() << endl);
-            if (no_data_type() != none)
-                m_scale_data(data);
-
-            BESDEBUG("fong3", "calling band->RasterIO" << endl);
-            CPLErr error = band->RasterIO(GF_Write, 0, 0, width(), height(),
-                                          data, width(), height(), GDT_Float64, 0, 0);
-            delete[] data;
+    return rows;
+}
 
-            if (error != CPLE_None)
-                throw Error("Could not write data for band: " + long_to_string(i+1) + ": " + string(CPLGetLastErrorMsg()));
-        }
-        catch (...) {
-            GDALClose(d_dest);
-            throw;
-        }
+/** @brief Where should the no data value go?
+ *
+ * Assume no_data is the smallest (or largest, for a positive no_data
+ * type) value in the data set and the second smallest (largest) is the
+ * smallest (largest) actual data value. The new no_data value is 1.0 less
+ * than (greater than) that. This makes for a good grayscale photometric
+ * GeoTiff w/o changing the actual data values.
+ *
+ * @param extrema The band's extrema
+ * @param new_no_data Value-result parameter; the new no data value
+ * @return False if the no data values don't need to be moved because the
+ * band has only one value, the new value is within 1 of the old value or
+ * there are no values to move.
+ */
+bool FONgTransform::m_new_no_data(const FONgExtrema &extrema, double &new_no_data)
+{
+    if (!extrema.has_second())
+        return false;
+
+    if (no_data_type() == negative) {
+        if (extrema.at_or_below_no_data() == 0 || !(fabs(extrema.second_min() + no_data()) > 1))
+            return false;
+        new_no_data = extrema.second_min() - 1.0;
+    }
+    else {
+        if (extrema.at_or_above_no_data() == 0 || !(fabs(no_data() - extrema.second_max()) > 1))
+            return false;
+        new_no_data = extrema.second_max() + 1.0;
     }
 
-    GDALClose(d_dest);
+    return true;
 }
 
-/** @brief Transforms the variables of the DataDDS to a JPEG2000 file.
+/** @breif scale the values for a better looking result
  *
- * Scan the DDS of the dataset and find the Grids that have been projected.
- * Try to render their content as a JPEG2000. The result is a N-band JPEG2000
- * file.
+ * Often datasets use very small (or less often, very large) values
+ * to indicate 'no data' or 'missing data'. The GDAL library scales
+ * data so that the entire range of data values are represented in
+ * a grayscale image. When the no data value is very small this
+ * skews the mean of the values to some very small number. This code
+ * finds the two smallest (or largest) values of the data in one pass
+ * (see FONgExtrema) and then computes a new 'no data' value based on
+ * the smallest (or largest) value that is greater than (or less than)
+ * the no data value.
  *
- * @note This method is a copy of the transform_to_geotiff() method and most
- * of the code here could be factored out. However, the real utility of this
- * method will be in its ability to write GML for a GMLJP2 response... 12/14/12
+ * The same pass computes the band's statistics, which are returned. When
+ * no_data_type() is 'none' that is all this does.
  *
- * @note Since the available GMLJP2 drivers for GDAL only support making
- * files using the CreateCopy() mathod, we make a MEM dataset, load it with data
- * and then use that to make GMLJP2 file.
+ * @note The initial no data value is determined be looking at attributes and
+ * is done by FONgBaseType::extract_coordinates().
+ *
+ * @note For integer types the no data value is only moved if the new value
+ * can be represented by the type.
+ *
+ * @param data The data values to fiddle
+ * @return The band's extrema and statistics, found before the no data
+ * value was moved
  */
-void FONgTransform::transform_to_jpeg2000()
+template <typename T>
+FONgExtrema FONgTransform::m_scale_data(T *data)
 {
-    // Scan the entire DDS looking for variables that have been 'projected' and
-    // build the delegate objects for them.
-    find_vars(d_dds, *this);
+    unsigned long long n = static_cast<unsigned long long>(width()) * height();
 
-    for (int i = 0; i < num_bands(); ++i)
-        if (!effectively_two_D(var(i)))
-            throw Error("GeoTiff responses can consist of two-dimensional variables only; use constraints to reduce the size of Grids as needed.");
+    FONgExtrema extrema = m_extrema();
+    extrema.add(data, n);
 
-    GDALDriver *Driver = GetGDALDriverManager()->GetDriverByName("MEM");
-    if( Driver == NULL )
-        throw Error("Could not get the MEM driver from/for GDAL: " + string(CPLGetLastErrorMsg()));
+    double new_no_data;
+    if (no_data_type() == none || !m_new_no_data(extrema, new_no_data) || !representable<T>(new_no_data))
+        return extrema;
+
+    FONgExtrema::replace(data, n, no_data_type() == negative, no_data(), static_cast<T>(new_no_data));
+
+    return extrema;
+}
+
+/** @brief Scale the values of a band held in its DAP type
+ *
+ * @param data The values
+ * @param type The DAP type of the values
+ * @see m_scale_data(T *data)
+ */
+FONgExtrema FONgTransform::m_scale_data(char *data, Type type)
+{
+    switch (type) {
+    case dods_byte_c:
+        return m_scale_data(reinterpret_cast<dods_byte*>(data));
+    case dods_int16_c:
+        return m_scale_data(reinterpret_cast<dods_int16*>(data));
+    case dods_uint16_c:
+        return m_scale_data(reinterpret_cast<dods_uint16*>(data));
+    case dods_int32_c:
+        return m_scale_data(reinterpret_cast<dods_int32*>(data));
+    case dods_uint32_c:
+        return m_scale_data(reinterpret_cast<dods_uint32*>(data));
+    case dods_float32_c:
+        return m_scale_data(reinterpret_cast<dods_float32*>(data));
+    case dods_float64_c:
+        return m_scale_data(reinterpret_cast<dods_float64*>(data));
+    default:
+        throw BESInternalError("file out GeoTiff, unexpected band type " + long_to_string(type), __FILE__, __LINE__);
+    }
+}
+
+/** An empty FONgExtrema that leaves this transform's no data values out
+ * of the statistics. */
+FONgExtrema FONgTransform::m_extrema()
+{
+    switch (no_data_type()) {
+    case negative: return FONgExtrema(no_data(), -1);
+    case positive: return FONgExtrema(no_data(), 1);
+    default: return FONgExtrema(no_data());
+    }
+}
+
+/** @brief Record a band's statistics in its metadata
+ *
+ * The minimum, maximum, mean and standard deviation of the valid values
+ * are written as GDAL's STATISTICS_* metadata items, so readers of the
+ * response don't have to compute them, along with the number and the
+ * percentage of pixels that are valid. A band with no valid values gets
+ * no statistics.
+ *
+ * @param band The band
+ * @param extrema The band's statistics
+ */
+void FONgTransform::m_set_statistics(GDALRasterBand *band, const FONgExtrema &extrema)
+{
+    if (extrema.count() == 0)
+        return;
+
+    band->SetStatistics(extrema.valid_min(), extrema.valid_max(), extrema.mean(), extrema.stddev());
+
+    ostringstream count, percent;
+    count << extrema.count();
+    percent << 100.0 * extrema.count() / (static_cast<double>(width()) * height());
+    band->SetMetadataItem("STATISTICS_VALID_COUNT", count.str().c_str());
+    band->SetMetadataItem("STATISTICS_VALID_PERCENT", percent.str().c_str());
+}
+
+/** @brief The GDAL type that matches a DAP type
+ *
+ * @return The GDAL type or GDT_Unknown if there is no match.
+ */
+static GDALDataType gdal_type(Type type)
+{
+    switch (type) {
+    case dods_byte_c: return GDT_Byte;
+    case dods_int16_c: return GDT_Int16;
+    case dods_uint16_c: return GDT_UInt16;
+    case dods_int32_c: return GDT_Int32;
+    case dods_uint32_c: return GDT_UInt32;
+    case dods_float32_c: return GDT_Float32;
+    case dods_float64_c: return GDT_Float64;
+    default: return GDT_Unknown;
+    }
+}
+
+/** @brief The number of bytes of variable values the transform reads
+ *
+ * This is the size of the bands in the variables' own types.
+ */
+unsigned long long FONgTransform::bytes_read()
+{
+    unsigned long long bytes = 0;
+    for (int i = 0; i < num_var(); ++i)
+        bytes += static_cast<unsigned long long>(width()) * height() * (GDALGetDataTypeSize(gdal_type(var(i)->elem_type())) / 8);
+
+    return bytes;
+}
+
+/** @brief Choose the type of the GeoTiff's bands
+ *
+ * Use the variables' own type, as long as they all have the same type
+ * and GDAL supports it. Otherwise, or if FONg.ForceFloat64 (or the
+ * per-request context fong_force_float64) is set, use Float64.
+ */
+GDALDataType FONgTransform::m_band_type()
+{
+    if (d_force_float64 || num_bands() == 0)
+        return GDT_Float64;
+
+    Type type = var(0)->elem_type();
+    for (int i = 1; i < num_bands(); ++i) {
+        if (var(i)->elem_type() != type)
+            return GDT_Float64;
+    }
+
+    GDALDataType gtype = gdal_type(type);
+
+    return gtype == GDT_Unknown ? GDT_Float64 : gtype;
+}
+
+/** @brief Will this variable be read window by window?
+ *
+ * Variables whose (constrained) Array is larger than FONg.MemoryBudget
+ * are read a window at a time by the transforms, all variables
+ * are read by the pipeline when FONg.Pipeline is set, and variables that
+ * are downsampled (fong_width, fong_height or fong_scale) are read a
+ * block of rows at a time by m_downsample(). The transmitter should not
+ * read those variables itself.
+ *
+ * @param btp The variable
+ * @return True if FONgTransform will read the variable
+ */
+bool FONgTransform::reads_incrementally(BaseType *btp)
+{
+    if (!is_convertable_type(btp))
+        return false;
+
+    // The bands of a multiband variable are read one at a time
+    if (multiband() && varying_dimensions(band_array(btp)) > 2)
+        return true;
+
+    // The pipeline reads the variables while the bands are being written
+    if (FONgRequestHandler::pipeline)
+        return true;
+
+    // Downsampling reads only the rows it needs, a block at a time (see
+    // m_set_output_size() for the contexts)
+    if (FONgUtils::get_int_context("fong_width", 0) != 0 || FONgUtils::get_int_context("fong_height", 0) != 0
+        || !FONgUtils::get_string_context("fong_scale", "").empty())
+        return true;
+
+    if (FONgRequestHandler::memory_budget == 0)
+        return false;
+
+    unsigned long long bytes = band_array(btp)->length() * sizeof(double);
+
+    return bytes > FONgRequestHandler::memory_budget;
+}
+
+/** Should this band be read and written in windows? Only variables that
+ * have not already been read can be, since otherwise the whole band is
+ * in memory anyway. */
+bool FONgTransform::m_read_in_windows(FONgBaseType *fbtp)
+{
+    if (FONgRequestHandler::memory_budget == 0 || fbtp->read_p())
+        return false;
+
+    unsigned long long bytes = static_cast<unsigned long long>(width()) * height() * sizeof(double);
+
+    return bytes > FONgRequestHandler::memory_budget;
+}
+
+/** @brief Apply the per-request output size
+ *
+ * A request can ask for a response smaller than its variables using the
+ * contexts fong_width and fong_height (in pixels) or fong_scale (a
+ * fraction of the variables' size, greater than 0 and at most 1). If only
+ * one of fong_width and fong_height is given, the other keeps the
+ * variables' aspect ratio. The context fong_resampling chooses how the
+ * pixels of the variables are combined: average (the default), nearest
+ * or mode. No data values are left out of averages and modes.
+ *
+ * After this is called, width() and height() are the size of the
+ * response; geo_transform() uses them, so the pixel size grows to match.
+ *
+ * @exception BESSyntaxUserError if the options are not valid or ask for
+ * a response larger than the variables
+ */
+void FONgTransform::m_set_output_size()
+{
+    d_source_width = width();
+    d_source_height = height();
+
+    int w = FONgUtils::get_int_context("fong_width", 0);
+    int h = FONgUtils::get_int_context("fong_height", 0);
+    string scale = FONgUtils::get_string_context("fong_scale", "");
+
+    if (w == 0 && h == 0 && scale.empty())
+        return;
+
+    if (!scale.empty()) {
+        if (w != 0 || h != 0)
+            throw BESSyntaxUserError("Use either fong_scale or fong_width and fong_height, not both.", __FILE__, __LINE__);
+
+        char *end = 0;
+        double s = strtod(scale.c_str(), &end);
+        if (*end != '\0' || !(s > 0.0 && s <= 1.0))
+            throw BESSyntaxUserError("The context fong_scale must be a number greater than 0 and at most 1, not '" + scale + "'.", __FILE__, __LINE__);
+
+        w = max(1, static_cast<int>(d_source_width * s + 0.5));
+        h = max(1, static_cast<int>(d_source_height * s + 0.5));
+    }
+    else if (w == 0) {
+        w = max(1, static_cast<int>(static_cast<double>(d_source_width) * h / d_source_height + 0.5));
+    }
+    else if (h == 0) {
+        h = max(1, static_cast<int>(static_cast<double>(d_source_height) * w / d_source_width + 0.5));
+    }
+
+    if (w < 1 || h < 1 || w > d_source_width || h > d_source_height)
+        throw BESSyntaxUserError("The response can be at most the size of the variables (" + long_to_string(d_source_width)
+            + " by " + long_to_string(d_source_height) + " pixels); fong_width and fong_height must be positive.", __FILE__, __LINE__);
+
+    if (w == d_source_width && h == d_source_height)
+        return;
+
+    string method = FONgUtils::get_string_context("fong_resampling", "average");
+    for (string::size_type i = 0; i < method.length(); ++i)
+        method[i] = tolower(method[i]);
+    if (method != "average" && method != "nearest" && method != "mode")
+        throw BESSyntaxUserError("The context fong_resampling must be average, nearest or mode, not '" + method + "'.", __FILE__, __LINE__);
+
+    BESDEBUG("fong3", "Downsampling from " << d_source_width << "x" << d_source_height << " to " << w << "x" << h
+             << " using " << method << endl);
+
+    d_resampling = method;
+    set_width(w);
+    set_height(h);
+}
+
+// The rules m_scale_data() uses to find no data values, one type for each
+// no_data_type(), so m_downsample() chooses the rule once and not for
+// each pixel. NaNs are always no data.
+struct nan_is_no_data {
+    bool operator()(double v) const { return v != v; }
+};
+
+struct no_data_at_or_below {
+    double d_no_data;
+    no_data_at_or_below(double no_data) : d_no_data(no_data) {}
+    bool operator()(double v) const { return v != v || v <= d_no_data; }
+};
+
+struct no_data_at_or_above {
+    double d_no_data;
+    no_data_at_or_above(double no_data) : d_no_data(no_data) {}
+    bool operator()(double v) const { return v != v || v >= d_no_data; }
+};
+
+// The first pixel of the variable that is part of output pixel i, when n
+// pixels are reduced to m
+static int source_start(int i, int n, int m)
+{
+    return static_cast<int>(static_cast<long long>(i) * n / m);
+}
+
+// One past the last pixel of the variable that is part of output pixel i
+static int source_end(int i, int n, int m)
+{
+    return max(source_start(i, n, m) + 1, source_start(i + 1, n, m));
+}
+
+/** @brief Compute one row of a downsampled band
+ *
+ * Each output pixel x combines the source pixels in rows [r0, r1) and
+ * columns [c0[x], c1[x]) of s, leaving out those that are no data. Output
+ * pixels whose source pixels are all no data get 'fill'.
+ *
+ * @param average Use the average if true, otherwise the mode: the most
+ * common value, the smallest one on a tie
+ * @param is_no_data The no data rule
+ * @param box Scratch space for the mode
+ */
+template <class NoData>
+static void downsample_row(bool average, NoData is_no_data, const double *s, int src_w, int r0, int r1,
+    const vector<int> &c0, const vector<int> &c1, double fill, vector<double> &box, double *d)
+{
+    const int w = c0.size();
+
+    if (average) {
+        for (int x = 0; x < w; ++x) {
+            double sum = 0.0;
+            int count = 0;
+            for (int r = r0; r < r1; ++r) {
+                const double *p = s + static_cast<unsigned long long>(r) * src_w;
+                for (int c = c0[x]; c < c1[x]; ++c) {
+                    if (!is_no_data(p[c])) {
+                        sum += p[c];
+                        ++count;
+                    }
+                }
+            }
+            d[x] = count ? sum / count : fill;
+        }
+        return;
+    }
+
+    for (int x = 0; x < w; ++x) {
+        box.clear();
+        for (int r = r0; r < r1; ++r) {
+            const double *p = s + static_cast<unsigned long long>(r) * src_w;
+            for (int c = c0[x]; c < c1[x]; ++c)
+                if (!is_no_data(p[c]))
+                    box.push_back(p[c]);
+        }
+
+        if (box.empty()) {
+            d[x] = fill;
+            continue;
+        }
+
+        sort(box.begin(), box.end());
+        double best = box[0];
+        vector<double>::size_type best_n = 0;
+        for (vector<double>::size_type i = 0; i < box.size();) {
+            vector<double>::size_type k = i;
+            while (k < box.size() && box[k] == box[i])
+                ++k;
+            if (k - i > best_n) {
+                best_n = k - i;
+                best = box[i];
+            }
+            i = k;
+        }
+        d[x] = best;
+    }
+}
+
+/** @brief Downsample rows of a band
+ *
+ * Compute the response's rows [row, row + rows) from the variable. The
+ * variable is read a block of rows at a time, using no more than
+ * FONg.MemoryBudget bytes, so when that is set the whole variable is
+ * never in memory at once (the transmitters leave downsampled variables
+ * to be read here; see reads_incrementally()). Nearest neighbor
+ * resampling reads only the rows it uses.
+ *
+ * An output pixel whose source pixels are all no data gets the no data
+ * value (or NaN when there is no no data value).
+ *
+ * @param fbtp The variable
+ * @param row The first row of the response
+ * @param rows The number of rows
+ * @param dest Put the values here, as doubles; width() * rows of them
+ */
+void FONgTransform::m_downsample(FONgBaseType *fbtp, int row, int rows, double *dest)
+{
+    const int src_w = d_source_width, src_h = d_source_height;
+    const int w = width(), h = height();
+    const double fill = (no_data_type() != none) ? no_data() : numeric_limits<double>::quiet_NaN();
+
+    vector<int> c0(w), c1(w);
+    for (int x = 0; x < w; ++x) {
+        c0[x] = source_start(x, src_w, w);
+        c1[x] = source_end(x, src_w, w);
+    }
+
+    if (d_resampling == "nearest") {
+        for (int j = 0; j < rows; ++j) {
+            int r = (source_start(row + j, src_h, h) + source_end(row + j, src_h, h) - 1) / 2;
+            FONgPoolBuffer src(fbtp->get_rows(r, 1));
+            double *s = src.doubles();
+            double *d = dest + static_cast<unsigned long long>(j) * w;
+            for (int x = 0; x < w; ++x)
+                d[x] = s[(c0[x] + c1[x] - 1) / 2];
+        }
+        return;
+    }
+
+    // Read as many output rows' worth of the variable at once as fit in
+    // FONg.MemoryBudget, but at least one.
+    unsigned long long rows_per_output_row = (src_h + h - 1) / h;
+    unsigned long long src_row_bytes = static_cast<unsigned long long>(src_w) * sizeof(double);
+    int block = FONgRequestHandler::memory_budget == 0 ? rows
+        : static_cast<int>(max(1ULL, min(static_cast<unsigned long long>(rows),
+                FONgRequestHandler::memory_budget / (src_row_bytes * rows_per_output_row))));
+
+    // Choose the method and the no data rule once
+    const bool average = d_resampling == "average";
+    const no_data_type_t rule = no_data_type();
+    const double nd = no_data();
+
+    vector<double> box;
+    for (int b = row; b < row + rows; b += block) {
+        int b_rows = min(block, row + rows - b);
+        int first = source_start(b, src_h, h);
+        int last = source_end(b + b_rows - 1, src_h, h);
+
+        FONgPoolBuffer src(fbtp->get_rows(first, last - first));
+        const double *s = src.doubles();
+
+        for (int j = b; j < b + b_rows; ++j) {
+            int r0 = source_start(j, src_h, h) - first;
+            int r1 = source_end(j, src_h, h) - first;
+            double *d = dest + static_cast<unsigned long long>(j - row) * w;
+
+            switch (rule) {
+            case negative:
+                downsample_row(average, no_data_at_or_below(nd), s, src_w, r0, r1, c0, c1, fill, box, d);
+                break;
+            case positive:
+                downsample_row(average, no_data_at_or_above(nd), s, src_w, r0, r1, c0, c1, fill, box, d);
+                break;
+            default:
+                downsample_row(average, nan_is_no_data(), s, src_w, r0, r1, c0, c1, fill, box, d);
+                break;
+            }
+        }
+    }
+}
+
+/** @brief Get rows of a band, as doubles
+ *
+ * The rows are rows of the response: when downsampling they are computed
+ * by m_downsample(), otherwise they are read from the variable.
+ *
+ * @return The values, in a buffer from FONgBufferPool
+ */
+double *FONgTransform::m_band_rows(FONgBaseType *fbtp, int row, int rows)
+{
+    if (!m_downsampling())
+        return fbtp->get_rows(row, rows);
+
+    FONgPoolBuffer data(FONgBufferPool::get_doubles(static_cast<unsigned long long>(width()) * rows));
+    m_downsample(fbtp, row, rows, data.doubles());
+
+    return reinterpret_cast<double*>(data.take());
+}
+
+/** @brief Choose the size of the windows a band is written in
+ *
+ * A window is as many whole rows as fit in FONg.MemoryBudget (as
+ * doubles), rounded to the band's blocks. When a single row does not fit,
+ * a window is one block of rows high (one row for a GeoTiff that is not
+ * tiled) and as wide as fits, rounded down to a multiple of the block
+ * width. Downsampled bands are always written in whole rows.
+ *
+ * @param band The band
+ * @param rows Value-result parameter; the window height
+ * @param cols Value-result parameter; the window width
+ */
+void FONgTransform::m_window_size(GDALRasterBand *band, int &rows, int &cols)
+{
+    unsigned long long pixels = max(1ULL, FONgRequestHandler::memory_budget / sizeof(double));
+
+    if (m_downsampling() || pixels >= static_cast<unsigned long long>(width())) {
+        cols = width();
+        rows = align_rows(max(1ULL, min(static_cast<unsigned long long>(height()), pixels / width())), band);
+        return;
+    }
+
+    int block_x = 0, block_y = 0;
+    band->GetBlockSize(&block_x, &block_y);
+
+    rows = (block_x > 0 && block_x < width() && block_y > 0) ? min(block_y, height()) : 1;
+    cols = max(1ULL, min(static_cast<unsigned long long>(width()), pixels / rows));
+    if (block_x > 0 && cols > block_x)
+        cols -= cols % block_x;
+}
+
+/** Get a window of a band, as doubles. Whole rows go through
+ * m_band_rows(), so they can be downsampled. */
+double *FONgTransform::m_band_window(FONgBaseType *fbtp, int row, int rows, int col, int cols)
+{
+    if (col == 0 && cols == width())
+        return m_band_rows(fbtp, row, rows);
+
+    return fbtp->get_window(row, rows, col, cols);
+}
+
+/** Where should the no data value of a band go? Like m_new_no_data(),
+ * but false when the new value cannot be stored in the band's type, as
+ * m_scale_data() does for bands held in their DAP type. */
+bool FONgTransform::m_band_no_data(GDALRasterBand *band, const FONgExtrema &extrema, double &new_no_data)
+{
+    return no_data_type() != none && m_new_no_data(extrema, new_no_data)
+        && representable(new_no_data, band->GetRasterDataType());
+}
+
+/** Move the no data values of a band that was written in windows, once
+ * the band's extrema are known. Same rules as m_scale_data(). The band is
+ * read back from the dataset, fixed and rewritten a window of
+ * window_rows by window_cols at a time. Not used for compressed
+ * GeoTiffs, whose rewritten blocks would be added to the file instead of
+ * replacing the old ones. */
+void FONgTransform::m_fix_no_data(GDALRasterBand *band, const FONgExtrema &extrema, int window_rows, int window_cols)
+{
+    double new_no_data;
+    if (!m_band_no_data(band, extrema, new_no_data))
+        return;
+
+    BESDEBUG("fong3", "New no_data value: " << new_no_data << endl);
+
+    FONgPoolBuffer buffer(FONgBufferPool::get_doubles(static_cast<unsigned long long>(window_cols) * window_rows));
+    double *data = buffer.doubles();
+    for (int row = 0; row < height(); row += window_rows) {
+        int rows = min(window_rows, height() - row);
+        for (int col = 0; col < width(); col += window_cols) {
+            int cols = min(window_cols, width() - col);
+
+            if (band->RasterIO(GF_Read, col, row, cols, rows, data, cols, rows, GDT_Float64, 0, 0) != CPLE_None)
+                throw Error("Could not read back data for band: " + string(CPLGetLastErrorMsg()));
+
+            FONgExtrema::replace(data, static_cast<unsigned long long>(cols) * rows, no_data_type() == negative,
+                                 no_data(), new_no_data);
+
+            if (band->RasterIO(GF_Write, col, row, cols, rows, data, cols, rows, GDT_Float64, 0, 0) != CPLE_None)
+                throw Error("Could not write data for band: " + string(CPLGetLastErrorMsg()));
+        }
+    }
+}
+
+/** @brief Write a band a window at a time
+ *
+ * Each window is read from the variable, constraining the DAP Array to
+ * just that window, and written to the band, so that no more than
+ * FONg.MemoryBudget bytes of the band are in memory at once whatever the
+ * size of the variable (see m_window_size()). If the no data value needs
+ * to be moved (see m_scale_data()), the band is read back from the
+ * dataset, a window at a time, fixed and rewritten once the
+ * smallest/largest values are known. A compressed GeoTiff is not
+ * rewritten: the band's extrema are found by reading the variable first
+ * (see m_band_statistics()) and the no data values are moved as each
+ * window is written. The band's statistics are found as the windows are
+ * written.
+ *
+ * @param fbtp The variable
+ * @param band Write to this band
+ */
+void FONgTransform::m_write_band_in_windows(FONgBaseType *fbtp, GDALRasterBand *band)
+{
+    int window_rows, window_cols;
+    m_window_size(band, window_rows, window_cols);
+
+    BESDEBUG("fong3", "Writing band in windows of " << window_rows << " rows by " << window_cols << " columns" << endl);
+
+    FONgExtrema extrema = m_extrema();
+    bool prescan = no_data_type() != none && d_compressed;
+    double new_no_data = 0.0;
+    bool move = false;
+    if (prescan) {
+        double start = FONgRequestLog::now();
+        extrema = m_band_statistics(fbtp);
+        move = m_band_no_data(band, extrema, new_no_data);
+        d_convert_time += FONgRequestLog::now() - start;
+    }
+
+    for (int row = 0; row < height(); row += window_rows) {
+        int rows = min(window_rows, height() - row);
+        for (int col = 0; col < width(); col += window_cols) {
+            int cols = min(window_cols, width() - col);
+
+            double start = FONgRequestLog::now();
+            FONgPoolBuffer data(m_band_window(fbtp, row, rows, col, cols));
+
+            unsigned long long n = static_cast<unsigned long long>(cols) * rows;
+            if (!prescan)
+                extrema.add(data.doubles(), n);
+            else if (move)
+                FONgExtrema::replace(data.doubles(), n, no_data_type() == negative, no_data(), new_no_data);
+            d_convert_time += FONgRequestLog::now() - start;
+
+            CPLErr error = band->RasterIO(GF_Write, col, row, cols, rows, data.get(), cols, rows, GDT_Float64, 0, 0);
+
+            if (error != CPLE_None)
+                throw Error("Could not write data for band: " + string(CPLGetLastErrorMsg()));
+        }
+    }
+
+    if (!prescan)
+        m_fix_no_data(band, extrema, window_rows, window_cols);
+
+    m_set_statistics(band, extrema);
+}
+
+/** @brief Set the dataset's projection using the first variable
+ *
+ * All of the variables must have the same projection.
+ *
+ * @param dest The dataset
+ */
+void FONgTransform::m_set_projection(GDALDataset *dest)
+{
+    string wkt = var(0)->get_projection(d_dds);
+    if (dest->SetProjection(wkt.c_str()) != CPLE_None)
+        throw Error("Could not set the projection: " + string(CPLGetLastErrorMsg()));
+
+    for (int i = 1; i < num_bands(); ++i) {
+        if (var(i)->get_projection(d_dds) != wkt)
+            throw Error("In building a multiband response, different bands had different projection information.");
+    }
+}
+
+/** An exception caught on one of the threads that read the variables,
+ * kept so that the thread that started them can throw an equivalent one.
+ * libdap Errors keep their code and BESErrors their type, so the
+ * transmitters report them as they would if the data were read on the
+ * calling thread. */
+class thread_error {
+private:
+    enum kind { no_error, dap_error, bes_error };
+
+    kind d_kind;
+    int d_code;         // The Error's code or the BESError's type
+    string d_message;
+    string d_file;
+    int d_line;
+
+public:
+    thread_error() : d_kind(no_error), d_code(0), d_line(0) {}
+
+    bool empty() const { return d_kind == no_error; }
+
+    void set(const Error &e)
+    {
+        d_kind = dap_error;
+        d_code = e.get_error_code();
+        d_message = e.get_error_message();
+    }
+
+    void set(BESError &e)
+    {
+        d_kind = bes_error;
+        d_code = e.get_bes_error_type();
+        d_message = e.get_message();
+        d_file = e.get_file();
+        d_line = e.get_line();
+    }
+
+    void set(const string &message, const char *file, int line)
+    {
+        d_kind = bes_error;
+        d_code = BES_INTERNAL_ERROR;
+        d_message = message;
+        d_file = file;
+        d_line = line;
+    }
+
+    void rethrow() const
+    {
+        if (d_kind == dap_error)
+            throw Error(d_code, d_message);
+
+        switch (d_code) {
+        case BES_SYNTAX_USER_ERROR:
+            throw BESSyntaxUserError(d_message, d_file, d_line);
+        case BES_FORBIDDEN_ERROR:
+            throw BESForbiddenError(d_message, d_file, d_line);
+        case BES_NOT_FOUND_ERROR:
+            throw BESNotFoundError(d_message, d_file, d_line);
+        case BES_INTERNAL_FATAL_ERROR:
+            throw BESInternalFatalError(d_message, d_file, d_line);
+        default:
+            throw BESInternalError(d_message, d_file, d_line);
+        }
+    }
+};
+
+// A block of rows read by the pipeline's reader thread
+struct pipeline_block {
+    int band;
+    int row;
+    int rows;
+    double *data;
+
+    // Set for the last block of a band read in strips; 'fixed' is set if
+    // the band's no data values were moved as it was read
+    bool last;
+    bool fixed;
+    FONgExtrema extrema;
+
+    pipeline_block() : band(0), row(0), rows(0), data(0), last(false), fixed(false) {}
+};
+
+/** A bounded queue of blocks passed from the pipeline's reader thread to
+ * the thread writing the GDAL dataset. push() waits while the queue is
+ * full and pop() waits while it is empty, so at most 'max' blocks (plus
+ * the one being read and the one being written) are in memory. */
+class block_queue {
+private:
+    pthread_mutex_t d_mutex;
+    pthread_cond_t d_not_empty;
+    pthread_cond_t d_not_full;
+
+    deque<pipeline_block> d_blocks;
+    unsigned int d_max;
+
+    bool d_done;        // the reader has finished
+    bool d_cancel;      // the writer has given up
+    thread_error d_error;
+
+public:
+    block_queue(unsigned int max) : d_max(max), d_done(false), d_cancel(false)
+    {
+        pthread_mutex_init(&d_mutex, 0);
+        pthread_cond_init(&d_not_empty, 0);
+        pthread_cond_init(&d_not_full, 0);
+    }
+
+    ~block_queue()
+    {
+        for (deque<pipeline_block>::iterator i = d_blocks.begin(); i != d_blocks.end(); ++i)
+            FONgBufferPool::release(i->data);
+
+        pthread_cond_destroy(&d_not_full);
+        pthread_cond_destroy(&d_not_empty);
+        pthread_mutex_destroy(&d_mutex);
+    }
+
+    // Returns false, without taking the block, if the writer has given up
+    bool push(const pipeline_block &b)
+    {
+        pthread_mutex_lock(&d_mutex);
+        while (d_blocks.size() >= d_max && !d_cancel)
+            pthread_cond_wait(&d_not_full, &d_mutex);
+
+        bool ok = !d_cancel;
+        if (ok) {
+            d_blocks.push_back(b);
+            pthread_cond_signal(&d_not_empty);
+        }
+        pthread_mutex_unlock(&d_mutex);
+
+        return ok;
+    }
+
+    // Returns false once the reader has finished and the queue is empty
+    bool pop(pipeline_block &b)
+    {
+        pthread_mutex_lock(&d_mutex);
+        while (d_blocks.empty() && !d_done)
+            pthread_cond_wait(&d_not_empty, &d_mutex);
+
+        bool ok = !d_blocks.empty();
+        if (ok) {
+            b = d_blocks.front();
+            d_blocks.pop_front();
+            pthread_cond_signal(&d_not_full);
+        }
+        pthread_mutex_unlock(&d_mutex);
+
+        return ok;
+    }
+
+    void finish(const thread_error &error)
+    {
+        pthread_mutex_lock(&d_mutex);
+        d_done = true;
+        d_error = error;
+        pthread_cond_broadcast(&d_not_empty);
+        pthread_mutex_unlock(&d_mutex);
+    }
+
+    void cancel()
+    {
+        pthread_mutex_lock(&d_mutex);
+        d_cancel = true;
+        pthread_cond_broadcast(&d_not_full);
+        pthread_mutex_unlock(&d_mutex);
+    }
+
+    thread_error error()
+    {
+        pthread_mutex_lock(&d_mutex);
+        thread_error e = d_error;
+        pthread_mutex_unlock(&d_mutex);
+        return e;
+    }
+};
+
+// Passed to the pipeline's reader thread
+struct reader_args {
+    FONgTransform *transform;
+    block_queue *queue;
+    int block_rows;
+
+    // The bands' type; used, when the GeoTiff is compressed, to find the
+    // no data value before the bands are written
+    GDALDataType band_type;
+};
+
+/** @brief The pipeline's reader thread
+ *
+ * Read each band, block_rows rows at a time, and pass the blocks to the
+ * writer. This is the only thread that reads the DAP
+ * variables while the pipeline is running. Errors are passed to the writer
+ * using the queue. Nothing this runs uses BESDEBUG, whose stream is not
+ * thread safe.
+ */
+void *FONgTransform::m_read_blocks(void *arg)
+{
+    reader_args *args = static_cast<reader_args*>(arg);
+    FONgTransform &t = *args->transform;
+
+    thread_error error;
+    try {
+        for (int i = 0; i < t.num_bands(); ++i) {
+            FONgBaseType *fbtp = t.var(i);
+
+            // A compressed GeoTiff can't be fixed after it's written (see
+            // m_fix_no_data()), so find the extrema first and move the no
+            // data values in each block.
+            FONgExtrema extrema = t.m_extrema();
+            bool prescan = t.no_data_type() != none && t.d_compressed;
+            double new_no_data = 0.0;
+            bool move = false;
+            if (prescan) {
+                extrema = t.m_band_statistics(fbtp);
+                move = t.m_new_no_data(extrema, new_no_data) && representable(new_no_data, args->band_type);
+            }
+
+            for (int row = 0; row < t.height(); row += args->block_rows) {
+                pipeline_block b;
+                b.band = i;
+                b.row = row;
+                b.rows = min(args->block_rows, t.height() - row);
+                b.data = t.m_band_rows(fbtp, b.row, b.rows);
+
+                unsigned long long n = static_cast<unsigned long long>(t.width()) * b.rows;
+                if (!prescan)
+                    extrema.add(b.data, n);
+                else if (move)
+                    FONgExtrema::replace(b.data, n, t.no_data_type() == negative, t.no_data(), new_no_data);
+
+                if (row + b.rows == t.height()) {
+                    b.last = true;
+                    b.fixed = prescan;
+                    b.extrema = extrema;
+                }
+
+                if (!args->queue->push(b)) {
+                    FONgBufferPool::release(b.data);
+                    i = t.num_bands();
+                    break;
+                }
+            }
+        }
+    }
+    catch (Error &e) {
+        error.set(e);
+    }
+    catch (BESError &e) {
+        error.set(e);
+    }
+    catch (std::exception &e) {
+        error.set(string("Error while reading data: ") + e.what(), __FILE__, __LINE__);
+    }
+    catch (...) {
+        error.set("Unknown error while reading data.", __FILE__, __LINE__);
+    }
+
+    args->queue->finish(error);
+
+    return 0;
+}
+
+/** @brief Read the variables and write the bands at the same time
+ *
+ * A reader thread reads the variables, a block of rows at a time, into a
+ * bounded queue while this thread writes the blocks to the dataset. This
+ * hides the latency of the data handler behind the work GDAL does to
+ * write the dataset.
+ *
+ * The blocks are FONg.PipelineBlockSize bytes and the no data values are
+ * moved, and the statistics recorded, after each band is written.
+ *
+ * @param dest Write the bands of this dataset
+ */
+void FONgTransform::m_write_bands_pipelined(GDALDataset *dest)
+{
+    unsigned long long row_bytes = static_cast<unsigned long long>(width()) * sizeof(double);
+    int block_rows = max(1ULL, min(static_cast<unsigned long long>(height()), FONgRequestHandler::pipeline_block_size / row_bytes));
+    if (dest->GetRasterBand(1))
+        block_rows = align_rows(block_rows, dest->GetRasterBand(1));
+
+    BESDEBUG("fong3", "Pipelined transform, blocks of " << block_rows << " rows" << endl);
+
+    block_queue queue(FONG_PIPELINE_DEPTH);
+
+    reader_args args;
+    args.transform = this;
+    args.queue = &queue;
+    args.block_rows = block_rows;
+    args.band_type = dest->GetRasterBand(1) ? dest->GetRasterBand(1)->GetRasterDataType() : GDT_Float64;
+
+    pthread_t reader;
+    if (pthread_create(&reader, 0, FONgTransform::m_read_blocks, &args) != 0)
+        throw BESInternalError("Could not start the pipeline's reader thread.", __FILE__, __LINE__);
+
+    try {
+        pipeline_block b;
+        double start = FONgRequestLog::now();
+        while (queue.pop(b)) {
+            // Time spent waiting for the reader
+            d_convert_time += FONgRequestLog::now() - start;
+
+            GDALRasterBand *band = dest->GetRasterBand(b.band + 1);
+            CPLErr error = CE_Failure;
+            if (band)
+                error = band->RasterIO(GF_Write, 0, b.row, width(), b.rows, b.data, width(), b.rows, GDT_Float64, 0, 0);
+            FONgBufferPool::release_checked(b.data);
+
+            if (error != CPLE_None)
+                throw Error("Could not write data for band: " + long_to_string(b.band + 1) + ": " + string(CPLGetLastErrorMsg()));
+
+            if (b.last) {
+                if (!b.fixed)
+                    m_fix_no_data(band, b.extrema, block_rows, width());
+                m_set_statistics(band, b.extrema);
+            }
+
+            start = FONgRequestLog::now();
+        }
+    }
+    catch (...) {
+        queue.cancel();
+        pthread_join(reader, 0);
+        throw;
+    }
+
+    pthread_join(reader, 0);
+
+    thread_error error = queue.error();
+    if (!error.empty())
+        error.rethrow();
+}
+
+/** @brief Build the geotransform array needed by GDAL
+ *
+ * This code uses values gleaned by FONgBaseType:extract_coordinates()
+ * to build up the six value array of transform parameters that
+ * GDAL needs to set the geographic transform.
+ *
+ * @note This method returns a pointer to a class field; don't delete
+ * it.
+ *
+ * @return A pointer to the six element array of parameters (doubles)
+ */
+double *FONgTransform::geo_transform()
+{
+
+    BESDEBUG("fong3", "left: " << d_left << ", top: " << d_top << ", right: " << d_right << ", bottom: " << d_bottom << endl);
+    BESDEBUG("fong3", "width: " << d_width << ", height: " << d_height << endl);
+
+    d_gt[0] = d_left; // The leftmost 'x' value, which is longitude
+    d_gt[3] = d_top;  // The topmost 'y' value, which is latitude
+
+    // We assume data w/o any rotation (a north-up image)
+    d_gt[2] = 0.0;
+    d_gt[4] = 0.0;
+
+    // Compute the lower left values. Note that wehn GDAL builds the geotiff
+    // output dataset, it correctly inverts the image when the source data has
+    // inverted latitude values.
+    d_gt[1] = (d_right - d_left) / d_width; // width in pixels; top and bottom in lat
+    d_gt[5] = (d_bottom - d_top) / d_height;
+
+    BESDEBUG("fong3", "gt[0]: " << d_gt[0] << ", gt[1]: " << d_gt[1] << ", gt[2]: " << d_gt[2] \
+             << ", gt[3]: " << d_gt[3] << ", gt[4]: " << d_gt[4] << ", gt[5]: " << d_gt[5] << endl);
+
+   return d_gt;
+}
+
+/** @brief Is this effectively a two-dimensional variable?
+ *
+ * Look at the Grid's Array and see if it is either a 2D array
+ * or if it has been subset so that all but two dimensions are
+ * removed. Assume that users know what they are doing.
+ *
+ * @note This code returns false for anything other than a
+ * Grid or an Array.
+ *
+ * @return True if this is a 2D array, false otherwise.
+ */
+bool FONgTransform::effectively_two_D(FONgBaseType *fbtp)
+{
+    if (fbtp->type() == dods_grid_c || fbtp->type() == dods_array_c) {
+        Array *a = static_cast<FONgArray*>(fbtp)->array();
+
+        if (a->dimensions() == 2)
+            return true;
+
+        // Dimensions mapped to bands are not counted
+        return varying_dimensions(a) - static_cast<FONgArray*>(fbtp)->band_dimensions() == 2;
+    }
+
+    return false;
+}
+
+/** @brief Will this variable be a band?
+ *
+ * Projected Grids are, and so are projected numeric Arrays whose latitude
+ * and longitude can be found (see FONgArray::find_lat_lon_maps()). Other
+ * Arrays, e.g. a two-dimensional 'lat(y,x)' or a variable without CF
+ * coordinates requested alongside a Grid, are left out of the response.
+ * This does not read any data.
+ */
+static bool is_band_variable(BaseType *btp, DDS *dds)
+{
+    if (!btp->send_p() || !is_convertable_type(btp))
+        return false;
+
+    if (btp->type() == dods_grid_c)
+        return true;
+
+    FONgArray *fa = static_cast<FONgArray*>(convert(btp, dds));
+    bool found = fa->find_lat_lon_maps();
+    delete fa;
+
+    return found;
+}
+
+static void build_delegate(BaseType *btp, DDS *dds, FONgTransform &t)
+{
+    if (is_band_variable(btp, dds)) {
+        BESDEBUG( "fong3", "converting " << btp->name() << endl);
+
+        // Build the delegate
+        FONgBaseType *fb = convert(btp, dds);
+
+        // Get the information needed for the transform.
+        // Note that FONgBaseType::extract_coordinates() also pushes the
+        // new FONgBaseType instance onto the FONgTransform's vector of
+        // delagate variable objects.
+        fb->extract_coordinates(t);
+    }
+}
+
+// Helper function to descend into Structures looking for Grids and Arrays.
+static void find_vars_helper(Structure *s, DDS *dds, FONgTransform &t)
+{
+    Structure::Vars_iter vi = s->var_begin();
+    while (vi != s->var_end()) {
+        if (is_band_variable(*vi, dds)) {
+            build_delegate(*vi, dds, t);
+        }
+        else if ((*vi)->type() == dods_structure_c) {
+            find_vars_helper(static_cast<Structure*>(*vi), dds, t);
+        }
+
+        ++vi;
+    }
+}
+
+// Helper function to scan the DDS top-level for Grids and Arrays.
+// Note that FONgBaseType::extract_coordinates() sets a bunch of
+// values in the FONgBaseType instance _and_ this instance of
+// FONgTransform. One of these is 'num_bands()'. For GeoTiff,
+// num_bands() must be 1. This is tested in transform().
+static void find_vars(DDS *dds, FONgTransform &t)
+{
+    DDS::Vars_iter vi = dds->var_begin();
+    while (vi != dds->var_end()) {
+        BESDEBUG( "fong3", "looking at: " << (*vi)->name() << " and it is/isn't selected: " << (*vi)->send_p() << endl);
+        if (is_band_variable(*vi, dds)) {
+            BESDEBUG( "fong3", "converting " << (*vi)->name() << endl);
+            build_delegate(*vi, dds, t);
+        }
+        else if ((*vi)->type() == dods_structure_c) {
+            find_vars_helper(static_cast<Structure*>(*vi), dds, t);
+        }
+
+        ++vi;
+    }
+}
+
+// Helper for band_variables(); descends into Structures the same way
+// find_vars() does.
+static void band_vars_helper(Structure *s, DDS *dds, vector<BaseType*> &vars)
+{
+    for (Structure::Vars_iter vi = s->var_begin(); vi != s->var_end(); ++vi) {
+        if (is_band_variable(*vi, dds))
+            vars.push_back(*vi);
+        else if ((*vi)->type() == dods_structure_c)
+            band_vars_helper(static_cast<Structure*>(*vi), dds, vars);
+    }
+}
+
+/** @brief Find the projected variables that will become bands
+ *
+ * These are the variables find_vars() makes delegates for (see
+ * is_band_variable()); the transmitters read only these (unless FONgTransform reads them itself;
+ * see reads_incrementally()).
+ *
+ * @param dds The constrained DDS
+ * @param vars Value-result parameter; the variables are appended
+ */
+void FONgTransform::band_variables(DDS *dds, vector<BaseType*> &vars)
+{
+    for (DDS::Vars_iter vi = dds->var_begin(); vi != dds->var_end(); ++vi) {
+        if (is_band_variable(*vi, dds))
+            vars.push_back(*vi);
+        else if ((*vi)->type() == dods_structure_c)
+            band_vars_helper(static_cast<Structure*>(*vi), dds, vars);
+    }
+}
+
+/** @brief Estimate the size of the raster data in a response
+ *
+ * Sum the sizes of the projected Grids and Arrays, using the constrained
+ * sizes of their Arrays, as they will be written (as doubles). This does
+ * not need the data to have been read, so it can be used to decide how
+ * to build a response before doing the real work.
+ *
+ * @param dds The constrained DDS
+ * @return The estimated number of bytes of raster data
+ */
+unsigned long long FONgTransform::estimated_size(DDS *dds)
+{
+    vector<BaseType*> vars;
+    band_variables(dds, vars);
+
+    unsigned long long bytes = 0;
+    for (vector<BaseType*>::iterator i = vars.begin(); i != vars.end(); ++i)
+        bytes += band_array(*i)->length() * sizeof(double);
+
+    return bytes;
+}
+
+/** @brief Estimate the memory needed to build a response
+ *
+ * A variable the transmitter reads up front is held in its own type and,
+ * while it is converted, as doubles. One that is read incrementally (see
+ * reads_incrementally()) needs a window of FONg.MemoryBudget bytes and a
+ * second one to move its no data value. A response built in memory (see
+ * FONg.InMemoryMaxSize) is counted too. GDAL's block cache is not: there
+ * is one per process, shared by all of its requests, so it is part of the
+ * memory FONg.AdmissionBudget leaves for the processes themselves. Like
+ * estimated_size(), this only needs the constrained DDS.
+ *
+ * @param dds The constrained DDS
+ * @return The estimated number of bytes
+ */
+unsigned long long FONgTransform::estimated_working_set(DDS *dds)
+{
+    vector<BaseType*> vars;
+    band_variables(dds, vars);
+
+    unsigned long long bytes = 0;
+    for (vector<BaseType*>::iterator i = vars.begin(); i != vars.end(); ++i) {
+        Array *a = band_array(*i);
+        unsigned long long doubles = a->length() * sizeof(double);
+
+        if (reads_incrementally(*i))
+            bytes += 2 * (FONgRequestHandler::memory_budget > 0 ? min(doubles, FONgRequestHandler::memory_budget) : doubles);
+        else
+            bytes += a->length() * a->var()->width() + doubles;
+    }
+
+    unsigned long long size = estimated_size(dds);
+    if (FONgRequestHandler::in_memory_max_size > 0 && size <= FONgRequestHandler::in_memory_max_size)
+        bytes += size;
+
+    return bytes;
+}
+
+/** @brief Check that a request can be converted, before reading its data
+ *
+ * Using only the constrained DDS, check that at least one Grid, or Array
+ * with latitude and longitude, is projected, that each is effectively
+ * two-dimensional (or, with multiband(), has more dimensions) and that
+ * the latitude and longitude of each Grid can be found. The same checks are made by the transforms, but only
+ * after the data have been read, which for a large variable can take a
+ * long time.
+ *
+ * @param dds The constrained DDS
+ * @exception Error if the request cannot be converted
+ */
+void FONgTransform::validate(DDS *dds)
+{
+    vector<BaseType*> vars;
+    band_variables(dds, vars);
+
+    if (vars.empty())
+        throw Error("GeoTiff and JPEG2000 responses need at least one Grid, or Array with latitude and longitude coordinates; none were found in the request.");
+
+    for (vector<BaseType*>::iterator i = vars.begin(); i != vars.end(); ++i) {
+        Array *a = band_array(*i);
+        int dims = varying_dimensions(a);
+        if (!(a->dimensions() == 2 || dims == 2 || (dims > 2 && multiband())))
+            throw Error("GeoTiff responses can consist of two-dimensional variables only; use constraints to reduce the size of Grids as needed, or set fong_multiband to write the other dimensions as bands.");
+
+        // Arrays without a latitude and longitude are not bands (see
+        // is_band_variable()); find the maps of a Grid the way
+        // extract_coordinates() does. This does not read them.
+        if ((*i)->type() != dods_grid_c)
+            continue;
+
+        FONgArray *fa = static_cast<FONgArray*>(convert(*i, dds));
+        bool found = fa->find_lat_lon_maps();
+        delete fa;
+
+        if (!found)
+            throw Error("Could not find the latitude and longitude of '" + (*i)->name() + "'.");
+    }
+}
+
+/** @brief Transforms the variables of the DataDDS to a GeoTiff file.
+ *
+ * Scan the DDS of the dataset and find the Grids that have been projected.
+ * Try to render their content as a GeoTiff. The result is a N-band GeoTiff
+ * file.
+ */
+void FONgTransform::transform_to_geotiff()
+{
+    // Scan the entire DDS looking for variables that have been 'projected' and
+    // build the delegate objects for them.
+    find_vars(d_dds, *this);
+
+    for (int i = 0; i < num_bands(); ++i)
+        if (!effectively_two_D(var(i)))
+            throw Error("GeoTiff responses can consist of two-dimensional variables only; use constraints to reduce the size of Grids as needed, or set fong_multiband to write the other dimensions as bands.");
+
+    m_set_output_size();
+
+#if 0
+    GDALAllRegister();
+    CPLSetErrorHandler(CPLQuietErrorHandler);
+#endif
+
+    GDALDriver *Driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    if( Driver == NULL )
+        throw Error("Could not get the GTiff driver from/for GDAL: " + string(CPLGetLastErrorMsg()));
 
     char **Metadata = Driver->GetMetadata();
     if (!CSLFetchBoolean(Metadata, GDAL_DCAP_CREATE, FALSE))
-        throw Error("Driver JP2OpenJPEG does not support dataset creation.");
+        throw Error("Could not make output format.");
+
+    BESDEBUG("fong3", "num_bands: " << num_bands() << "." << endl);
+
+    // Write the bands using the variables' own type when possible.
+    GDALDataType band_type = m_band_type();
+    BESDEBUG("fong3", "band type: " << GDALGetDataTypeName(band_type) << endl);
+
+    // An intermediate GeoTiff for a COG is tiled, so its overviews can be
+    // built quickly, and left uncompressed; it's compressed when copied.
+    char **options = m_geotiff_options(band_type, d_cog, !d_cog);
+    const char *compress = CSLFetchNameValue(options, "COMPRESS");
+    d_compressed = compress && !EQUAL(compress, "NONE");
+    d_dest = Driver->Create(d_localfile.c_str(), width(), height(), num_bands(), band_type, options);
+    CSLDestroy(options);
+    if (!d_dest)
+        throw Error("Could not create the geotiff dataset: " + string(CPLGetLastErrorMsg()));
+
+    d_dest->SetGeoTransform(geo_transform());
+    // Take the mapping data from the first variable
+    // var(0)->get_projection(d_dds, d_dest);
+
+    BESDEBUG("fong3", "Made new temp file and set georeferencing (" << num_bands() << " vars)." << endl);
+
+    if (d_pipeline) {
+        try {
+            m_set_projection(d_dest);
+            m_write_bands_pipelined(d_dest);
+        }
+        catch (...) {
+            GDALClose(d_dest);
+            throw;
+        }
+    }
+    else {
+        try {
+            m_set_projection(d_dest);
+
+            int i = 0;
+            while (i < num_bands()) {
+                // Very large bands are read and written a window at a time
+                if (m_read_in_windows(var(i))) {
+                    GDALRasterBand *band = d_dest->GetRasterBand(i+1);
+                    if (!band)
+                        throw Error("Could not get the " + long_to_string(i+1) + "th band: " + string(CPLGetLastErrorMsg()));
+                    m_write_band_in_windows(var(i), band);
+                    ++i;
+                    continue;
+                }
+
+                // Read up to FONg.BandThreads bands at the same time, then
+                // write them in order
+                vector<int> batch;
+                while (i < num_bands() && batch.size() < static_cast<unsigned int>(max(1, FONgRequestHandler::band_threads))
+                       && !m_read_in_windows(var(i)))
+                    batch.push_back(i++);
+
+                vector<band_buffer> buffers;
+                double start = FONgRequestLog::now();
+                m_read_bands(batch, band_type, false /*jpeg2000*/, buffers);
+                d_convert_time += FONgRequestLog::now() - start;
+
+                try {
+                    for (unsigned int j = 0; j < buffers.size(); ++j) {
+                        GDALRasterBand *band = d_dest->GetRasterBand(batch[j]+1);
+                        if (!band)
+                            throw Error("Could not get the " + long_to_string(batch[j]+1) + "th band: " + string(CPLGetLastErrorMsg()));
+
+                        // NB: Here the type is the type of the data in the buffer;
+                        // RasterIO() converts it to the band's type.
+                        BESDEBUG("fong3", "calling band->RasterIO" << endl);
+                        CPLErr error = band->RasterIO(GF_Write, 0, 0, width(), height(), buffers[j].data, width(), height(),
+                                                      buffers[j].doubles ? GDT_Float64 : band_type, 0, 0);
+                        buffers[j].free();
+
+                        if (error != CPLE_None)
+                            throw Error("Could not write data for band: " + long_to_string(batch[j]+1) + ": " + string(CPLGetLastErrorMsg()));
+
+                        m_set_statistics(band, buffers[j].extrema);
+                    }
+                }
+                catch (...) {
+                    for (unsigned int j = 0; j < buffers.size(); ++j)
+                        buffers[j].free();
+                    throw;
+                }
+            }
+        }
+        catch (...) {
+            GDALClose(d_dest);
+            throw;
+        }
+    }
 
-    // No creation options for a memory dataset
-    // NB: This is where the type of the bands is set. JPEG2000 only supports integer types.
-    d_dest = Driver->Create("in_memory_dataset", width(), height(), num_bands(), GDT_Int32, 0 /*options*/);
-    if (!d_dest)
-        throw Error("Could not create in-memory dataset: " + string(CPLGetLastErrorMsg()));
+    GDALClose(d_dest);
+}
 
-    d_dest->SetGeoTransform(geo_transform());
+/** @brief Transforms the variables of the DataDDS to a Cloud Optimized
+ * GeoTiff (COG)
+ *
+ * A tiled, uncompressed GeoTiff is built next to the COG using
+ * transform_to_geotiff(). Its overviews are built (see
+ * FONg.OverviewLevels and FONg.OverviewResampling) and it is copied to
+ * the COG using GDAL's COG driver, which puts the IFDs at the start of
+ * the file and orders the tiles so that each resolution level can be read
+ * with a few range requests. If GDAL has no COG driver, the GTiff driver
+ * is used with COPY_SRC_OVERVIEWS, which makes the same layout.
+ *
+ * Overviews are computed using FONg.NumThreads threads.
+ */
+void FONgTransform::transform_to_cog()
+{
+    string cog_file = d_localfile;
+    string source_file = cog_file + ".src.tif";
 
-    BESDEBUG("fong3", "Made new temp file and set georeferencing (" << num_bands() << " vars)." << endl);
+    d_cog = true;
+    d_localfile = source_file;
+    try {
+        transform_to_geotiff();
+    }
+    catch (...) {
+        d_cog = false;
+        d_localfile = cog_file;
+        (void) VSIUnlink(source_file.c_str());
+        throw;
+    }
+    d_cog = false;
+    d_localfile = cog_file;
 
-    bool projection_set = false;
-    string wkt = "";
-    for (int i = 0; i < num_bands(); ++i) {
-        FONgBaseType *fbtp = var(i);
+    try {
+        m_write_cog(source_file, cog_file);
+    }
+    catch (...) {
+        (void) VSIUnlink(source_file.c_str());
+        throw;
+    }
+
+    (void) VSIUnlink(source_file.c_str());
+}
+
+/** @brief Build the overviews of a GeoTiff and copy it to a COG
+ *
+ * @param source_file The tiled GeoTiff made by transform_to_geotiff()
+ * @param cog_file The COG to write
+ */
+void FONgTransform::m_write_cog(const string &source_file, const string &cog_file)
+{
+    GDALDataset *source = static_cast<GDALDataset*>(GDALOpen(source_file.c_str(), GA_Update));
+    if (!source)
+        throw Error("Could not open the GeoTiff used to build the COG: " + string(CPLGetLastErrorMsg()));
+
+    try {
+        vector<int> levels = m_overview_levels();
+        if (!levels.empty()) {
+            string resampling = FONgUtils::get_string_context("fong_overview_resampling", FONgRequestHandler::overview_resampling);
+            string num_threads = FONgUtils::get_string_context("fong_num_threads", FONgRequestHandler::num_threads);
+
+            BESDEBUG("fong3", "Building " << levels.size() << " overviews using " << resampling << endl);
+
+            // GDAL computes the overviews using GDAL_NUM_THREADS threads
+            if (!num_threads.empty())
+                CPLSetThreadLocalConfigOption("GDAL_NUM_THREADS", num_threads.c_str());
+
+            CPLErr error = source->BuildOverviews(resampling.c_str(), levels.size(), &levels[0], 0, NULL, NULL, NULL);
+
+            if (!num_threads.empty())
+                CPLSetThreadLocalConfigOption("GDAL_NUM_THREADS", NULL);
+
+            if (error != CE_None)
+                throw Error("Could not build the overviews: " + string(CPLGetLastErrorMsg()));
+        }
+
+        GDALDataType band_type = source->GetRasterBand(1)->GetRasterDataType();
 
-        if (!projection_set) {
-            wkt = fbtp->get_projection(d_dds);
-            if (d_dest->SetProjection(wkt.c_str()) != CPLE_None)
-                throw Error("Could not set the projection: " + string(CPLGetLastErrorMsg()));
-            projection_set = true;
+        char **options = NULL;
+        GDALDriver *driver = GetGDALDriverManager()->GetDriverByName("COG");
+        if (driver) {
+            options = m_cog_options(band_type, !levels.empty());
         }
         else {
-            string wkt_i = fbtp->get_projection(d_dds);
-            if (wkt_i != wkt)
-                throw Error("In building a multiband response, different bands had different projection information.");
+            BESDEBUG("fong3", "No COG driver, using GTiff with COPY_SRC_OVERVIEWS" << endl);
+            driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+            if (!driver)
+                throw Error("Could not get the GTiff driver from/for GDAL: " + string(CPLGetLastErrorMsg()));
+
+            options = m_geotiff_options(band_type, true /*tiled*/, true /*compressed*/);
+            options = CSLSetNameValue(options, "COPY_SRC_OVERVIEWS", "YES");
         }
 
-        GDALRasterBand *band = d_dest->GetRasterBand(i+1);
-        if (!band)
-            throw Error("Could not get the " + long_to_string(i+1) + "th band: " + string(CPLGetLastErrorMsg()));
+        GDALDataset *cog = driver->CreateCopy(cog_file.c_str(), source, FALSE, options, NULL, NULL);
+        CSLDestroy(options);
+        if (!cog)
+            throw Error("Could not create the COG: " + string(CPLGetLastErrorMsg()));
+
+        GDALClose(cog);
+    }
+    catch (...) {
+        GDALClose(source);
+        throw;
+    }
+
+    GDALClose(source);
+}
+
+/** @brief Get a variable's values as a GeoTiff band
+ *
+ * When the band's type is the variable's type, read the values in that
+ * type; otherwise read them as doubles and let GDAL convert them. The no
+ * data value is moved in either case.
+ *
+ * @param fbtp The variable
+ * @param band_type The band's type
+ * @return The band's values
+ */
+FONgTransform::band_buffer FONgTransform::m_geotiff_band_data(FONgBaseType *fbtp, GDALDataType band_type)
+{
+    band_buffer buffer;
 
+    // The band type matches the variable's type; no need to
+    // convert the values to doubles. A downsampled band is always
+    // computed as doubles.
+    if (!m_downsampling() && (band_type != GDT_Float64 || fbtp->elem_type() == dods_float64_c)) {
+        buffer.data = fbtp->get_native_data();
         try {
-            // TODO We can read any of the basic DAP2 types and let RasterIO convert it to any other type.
-            double *data = fbtp->get_data();
+            buffer.extrema = m_scale_data(buffer.data, fbtp->elem_type());
+        }
+        catch (...) {
+            buffer.free();
+            throw;
+        }
+
+        return buffer;
+    }
+
+    // TODO We can read any of the basic DAP2 types and let RasterIO convert it to any other type.
+    double *data = m_band_rows(fbtp, 0, height());
+    buffer.data = reinterpret_cast<char*>(data);
+    buffer.doubles = true;
+
+    // hack the values; because the missing value used with many datasets
+    // is often really small it'll skew the mapping of values to the grayscale
+    // that GDAL performs. Move the no_data values to something closer to the
+    // other values in the dataset. This also finds the band's statistics.
+    try {
+        buffer.extrema = m_scale_data(data);
+    }
+    catch (...) {
+        buffer.free();
+        throw;
+    }
 
-            // hack the values; because the missing value used with many datasets
-            // is often really small it'll skew the mapping of values to the grayscale
-            // that GDAL performs. Move the no_data values to something closer to the
-            // other values in the dataset.
-            BESDEBUG("fong3", "no_data_type(): " << no_data_type() << endl);
-            if (no_data_type() != none)
-                m_scale_data(data);
+    return buffer;
+}
 
-            BESDEBUG("fong3", "calling band->RasterIO" << endl);
+// The bands read by one call to m_read_bands(), shared by its threads
+struct band_pool {
+    FONgTransform *transform;
+    const vector<int> *bands;
+    GDALDataType band_type;
+    bool jpeg2000;
+    vector<FONgTransform::band_buffer> *buffers;
+
+    // Guards next and error
+    pthread_mutex_t mutex;
+    unsigned int next;
+    thread_error error;
+
+    // Held while a variable that has not been read is read; the data
+    // handlers are not thread safe
+    pthread_mutex_t read_mutex;
+
+    // Which of 'bands' must be read holding read_mutex. This is decided
+    // before the threads start: the bands of a multiband variable share
+    // one Array, which m_read_window() constrains and reads, so a worker
+    // must not look at the Array's read_p() without the lock.
+    vector<bool> serialize;
+};
+
+/** @brief Read and convert bands until there are none left
+ *
+ * Run by each of the threads started by m_read_bands(). The first error
+ * is kept in the pool and thrown again by m_read_bands(). Nothing this
+ * runs uses BESDEBUG, whose stream is not thread safe.
+ */
+void *FONgTransform::m_read_band_worker(void *arg)
+{
+    band_pool *pool = static_cast<band_pool*>(arg);
+    FONgTransform &t = *pool->transform;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        unsigned int n = pool->next++;
+        bool stop = n >= pool->bands->size() || !pool->error.empty();
+        pthread_mutex_unlock(&pool->mutex);
+        if (stop)
+            break;
+
+        FONgBaseType *fbtp = t.var((*pool->bands)[n]);
+        thread_error error;
+        bool locked = pool->serialize[n];
+        if (locked)
+            pthread_mutex_lock(&pool->read_mutex);
 
-            // NB: Here the 'type' value indicates the type of data in the buffer. The
-            // type of the band is set above when the dataset is created.
-            CPLErr error = band->RasterIO(GF_Write, 0, 0, width(), height(),
-                                          data, width(), height(), GDT_Float64, 0, 0);
-            delete[] data;
+        try {
+            band_buffer buffer;
+            if (pool->jpeg2000)
+                buffer = t.m_jpeg2000_band_data(fbtp, pool->band_type);
+            else
+                buffer = t.m_geotiff_band_data(fbtp, pool->band_type);
 
-            if (error != CPLE_None)
-                throw Error(CPLGetLastErrorMsg());
+            (*pool->buffers)[n] = buffer;
+        }
+        catch (Error &e) {
+            error.set(e);
+        }
+        catch (BESError &e) {
+            error.set(e);
+        }
+        catch (std::exception &e) {
+            error.set(string("Error while reading data: ") + e.what(), __FILE__, __LINE__);
         }
         catch (...) {
-            GDALClose(d_dest);
-            throw;
+            error.set("Unknown error while reading data.", __FILE__, __LINE__);
+        }
+
+        if (locked)
+            pthread_mutex_unlock(&pool->read_mutex);
+
+        if (!error.empty()) {
+            pthread_mutex_lock(&pool->mutex);
+            if (pool->error.empty())
+                pool->error = error;
+            pthread_mutex_unlock(&pool->mutex);
         }
     }
 
-    // Now get the OpenJPEG driver and use CreateCopy() on the d_dest "MEM" dataset
+    return 0;
+}
+
+/** @brief Read and convert several bands at the same time
+ *
+ * Up to FONg.BandThreads threads read the variables, move their no data
+ * values and convert them to the band type. Variables that have already
+ * been read (which is the usual case, since the transmitters read the
+ * data before the transform) are processed in parallel; those that must
+ * be read from the data handler are read one at a time.
+ *
+ * @param bands The indexes of the variables to read
+ * @param band_type The type of the bands
+ * @param jpeg2000 If true, get the values using m_jpeg2000_band_data(),
+ * otherwise m_geotiff_band_data().
+ * @param buffers Value-result parameter; the values of each band, in the
+ * order of 'bands'. The caller must free these.
+ */
+void FONgTransform::m_read_bands(const vector<int> &bands, GDALDataType band_type, bool jpeg2000,
+    vector<band_buffer> &buffers)
+{
+    buffers.assign(bands.size(), band_buffer());
+
+    band_pool pool;
+    pool.transform = this;
+    pool.bands = &bands;
+    pool.band_type = band_type;
+    pool.jpeg2000 = jpeg2000;
+    pool.buffers = &buffers;
+    pool.next = 0;
+    for (vector<int>::const_iterator i = bands.begin(); i != bands.end(); ++i)
+        pool.serialize.push_back(!var(*i)->read_p());
+    pthread_mutex_init(&pool.mutex, 0);
+    pthread_mutex_init(&pool.read_mutex, 0);
+
+    unsigned int num_threads = min(bands.size(), static_cast<vector<int>::size_type>(max(1, FONgRequestHandler::band_threads)));
+
+    BESDEBUG("fong3", "Reading " << bands.size() << " bands using " << num_threads << " threads, no_data_type(): "
+             << no_data_type() << endl);
+
+    // This thread is one of the workers
+    vector<pthread_t> threads;
+    for (unsigned int i = 1; i < num_threads; ++i) {
+        pthread_t thread;
+        if (pthread_create(&thread, 0, FONgTransform::m_read_band_worker, &pool) != 0)
+            break;
+        threads.push_back(thread);
+    }
+
+    m_read_band_worker(&pool);
+
+    for (vector<pthread_t>::iterator i = threads.begin(); i != threads.end(); ++i)
+        pthread_join(*i, 0);
+
+    pthread_mutex_destroy(&pool.mutex);
+    pthread_mutex_destroy(&pool.read_mutex);
+
+    if (!pool.error.empty()) {
+        for (vector<band_buffer>::iterator i = buffers.begin(); i != buffers.end(); ++i)
+            i->free();
+        pool.error.rethrow();
+    }
+}
+
+/** Convert a value to the integer type T the way GDAL does: round to the
+ * nearest integer, clamp to the range of T and map NaN to zero. */
+template <typename T>
+static T to_integer(double v)
+{
+    if (v != v)
+        return 0;
+    if (v >= numeric_limits<T>::max())
+        return numeric_limits<T>::max();
+    if (v <= numeric_limits<T>::min())
+        return numeric_limits<T>::min();
+
+    return static_cast<T>(v > 0 ? v + 0.5 : v - 0.5);
+}
+
+static dods_int32 to_int32(double v)
+{
+    return to_integer<dods_int32>(v);
+}
+
+/** Copy n doubles to dest as values of the integer type T. */
+template <typename T>
+static void from_doubles(const double *values, char *dest, unsigned long long n)
+{
+    for (unsigned long long i = 0; i < n; ++i) {
+        T r = to_integer<T>(values[i]);
+        memcpy(dest + i * sizeof(T), &r, sizeof(T));
+    }
+}
+
+/** @brief Convert n values of type T to Int32 in place
+ *
+ * Works because T is at least as wide as an Int32 and the values are
+ * converted from the start of the buffer. memcpy() is used so that the
+ * buffer is never accessed through two pointer types.
+ */
+template <typename T>
+static void convert_to_int32(char *data, unsigned long long n)
+{
+    for (unsigned long long i = 0; i < n; ++i) {
+        T v;
+        memcpy(&v, data + i * sizeof(T), sizeof(T));
+        dods_int32 r = to_int32(v);
+        memcpy(data + i * sizeof(dods_int32), &r, sizeof(dods_int32));
+    }
+}
+
+/** @brief Get a variable's values as a JPEG2000 band
+ *
+ * Read the values in their DAP type and move the no data value. Integer
+ * values whose type is the band's type are used as is. Float32 and
+ * Float64 values are converted to Int32 in the same buffer. Only when the
+ * bands have different types are the values copied (as Int32s) into a new
+ * buffer. A downsampled band is computed as doubles and then converted
+ * to the band's type.
+ *
+ * The same pass finds the band's statistics (see m_scale_data()), which
+ * transform_to_jpeg2000() records on the band.
+ *
+ * @param fbtp The variable
+ * @param band_type The band's type
+ * @return The band's values, in a buffer from FONgBufferPool, and its
+ * statistics; the caller must free the buffer.
+ */
+FONgTransform::band_buffer FONgTransform::m_jpeg2000_band_data(FONgBaseType *fbtp, GDALDataType band_type)
+{
+    unsigned long long n = static_cast<unsigned long long>(width()) * height();
+    Type type = fbtp->elem_type();
+    band_buffer buffer;
+
+    if (m_downsampling()) {
+        FONgPoolBuffer values(m_band_rows(fbtp, 0, height()));
+        buffer.extrema = m_scale_data(values.doubles());
+
+        FONgPoolBuffer data(FONgBufferPool::get(n * GDALGetDataTypeSize(band_type) / 8));
+        switch (band_type) {
+        case GDT_Byte: from_doubles<dods_byte>(values.doubles(), data.get(), n); break;
+        case GDT_Int16: from_doubles<dods_int16>(values.doubles(), data.get(), n); break;
+        case GDT_UInt16: from_doubles<dods_uint16>(values.doubles(), data.get(), n); break;
+        case GDT_UInt32: from_doubles<dods_uint32>(values.doubles(), data.get(), n); break;
+        default: from_doubles<dods_int32>(values.doubles(), data.get(), n); break;
+        }
+
+        buffer.data = data.take();
+        return buffer;
+    }
+
+    if (gdal_type(type) == band_type
+        || (band_type == GDT_Int32 && (type == dods_float32_c || type == dods_float64_c))) {
+        FONgPoolBuffer data(fbtp->get_native_data());
+        buffer.extrema = m_scale_data(data.get(), type);
+
+        if (type == dods_float32_c)
+            convert_to_int32<dods_float32>(data.get(), n);
+        else if (type == dods_float64_c)
+            convert_to_int32<dods_float64>(data.get(), n);
+
+        buffer.data = data.take();
+        return buffer;
+    }
+
+    // The bands have different types; they are all Int32
+    FONgPoolBuffer values(fbtp->get_data());
+    buffer.extrema = m_scale_data(values.doubles());
+
+    FONgPoolBuffer data(FONgBufferPool::get(n * sizeof(dods_int32)));
+    from_doubles<dods_int32>(values.doubles(), data.get(), n);
+
+    buffer.data = data.take();
+    return buffer;
+}
+
+/** @brief Copy a dataset to the JPEG2000 response
+ *
+ * @param source The dataset that holds the bands
+ * @return The JPEG2000 dataset; the caller must close it.
+ */
+GDALDataset *FONgTransform::m_create_jpeg2000(GDALDataset *source)
+{
+    GDALDriver *Driver = GetGDALDriverManager()->GetDriverByName("JP2OpenJPEG");
+    if (Driver == NULL)
+        throw Error("Could not get driver for JP2OpenJPEG: " + string(CPLGetLastErrorMsg()));
+
+    // The JPEG2000 drivers only support CreateCopy()
+    char **Metadata = Driver->GetMetadata();
+    if (!CSLFetchBoolean(Metadata, GDAL_DCAP_CREATECOPY, FALSE))
+        BESDEBUG("fong", "Driver JP2OpenJPEG does not support dataset creation via 'CreateCopy()'." << endl);
+    //throw Error("Driver JP2OpenJPEG does not support dataset creation via 'CreateCopy()'.");
+
+    char **options = m_jpeg2000_options();
+
+    BESDEBUG("fong3", "Before JPEG2000 CreateCopy, number of bands: " << source->GetRasterCount() << endl);
+
+    GDALDataset *jpeg_dst = Driver->CreateCopy(d_localfile.c_str(), source, FALSE/*strict*/,
+            options, NULL/*progress*/, NULL/*progress data*/);
+    CSLDestroy(options);
+
+    if (!jpeg_dst)
+        throw Error("Could not create the JPEG200 dataset: " + string(CPLGetLastErrorMsg()));
+
+    return jpeg_dst;
+}
+
+/** @brief Build a JPEG2000 response whose bands don't fit in memory
+ *
+ * The bands are written, a window at a time (see
+ * m_write_band_in_windows()), to a tiled, uncompressed GeoTiff of the
+ * band type next to the response. The JPEG2000 is copied from that; the
+ * encoder reads it a tile at a time through GDAL's block cache. The
+ * GeoTiff is removed afterwards.
+ *
+ * With FONg.Pipeline, the GeoTiff is filled by m_write_bands_pipelined(),
+ * so reading the variables overlaps writing the GeoTiff. The encoding
+ * itself starts once all of the data have been read; CreateCopy() pulls
+ * its input and can't be fed while it runs.
+ *
+ * @param band_type The type of the bands
+ */
+void FONgTransform::m_write_jpeg2000_in_windows(GDALDataType band_type)
+{
+    string source_file = d_localfile + ".src.tif";
+
+    BESDEBUG("fong3", "Building the JPEG2000 from " << source_file << endl);
+
+    GDALDriver *Driver = GetGDALDriverManager()->GetDriverByName("GTiff");
+    if (Driver == NULL)
+        throw Error("Could not get the GTiff driver from/for GDAL: " + string(CPLGetLastErrorMsg()));
+
+    char **options = CSLSetNameValue(NULL, "TILED", "YES");
+    options = CSLSetNameValue(options, "BIGTIFF", "IF_SAFER");
+    d_dest = Driver->Create(source_file.c_str(), width(), height(), num_bands(), band_type, options);
+    CSLDestroy(options);
+    if (!d_dest)
+        throw Error("Could not create the source of the JPEG2000 response: " + string(CPLGetLastErrorMsg()));
+
     GDALDataset *jpeg_dst = 0;
     try {
-        Driver = GetGDALDriverManager()->GetDriverByName("JP2OpenJPEG");
-        if (Driver == NULL)
-            throw Error("Could not get driver for JP2OpenJPEG: " + string(CPLGetLastErrorMsg()));
+        d_dest->SetGeoTransform(geo_transform());
+        m_set_projection(d_dest);
 
-        // The JPEG2000 drivers only support CreateCopy()
-        char **Metadata = Driver->GetMetadata();
-        if (!CSLFetchBoolean(Metadata, GDAL_DCAP_CREATECOPY, FALSE))
-            BESDEBUG("fong", "Driver JP2OpenJPEG does not support dataset creation via 'CreateCopy()'." << endl);
-        //throw Error("Driver JP2OpenJPEG does not support dataset creation via 'CreateCopy()'.");
+        if (d_pipeline) {
+            m_write_bands_pipelined(d_dest);
+        }
+        else {
+            for (int i = 0; i < num_bands(); ++i) {
+                GDALRasterBand *band = d_dest->GetRasterBand(i+1);
+                if (!band)
+                    throw Error("Could not get the " + long_to_string(i+1) + "th band: " + string(CPLGetLastErrorMsg()));
+                m_write_band_in_windows(var(i), band);
+            }
+        }
+        d_dest->FlushCache();
 
-        char **options = NULL;
-        options = CSLSetNameValue(options, "CODEC", "JP2");
-        options = CSLSetNameValue(options, "GMLJP2", "YES");
-        options = CSLSetNameValue(options, "GeoJP2", "NO");
-        options = CSLSetNameValue(options, "QUALITY", "100"); // 25 is the default;
-        options = CSLSetNameValue(options, "REVERSIBLE", "YES"); // lossy compression
+        jpeg_dst = m_create_jpeg2000(d_dest);
+    }
+    catch (...) {
+        GDALClose(jpeg_dst);
+        GDALClose(d_dest);
+        (void) VSIUnlink(source_file.c_str());
+        throw;
+    }
+
+    GDALClose(jpeg_dst);
+    GDALClose(d_dest);
+    (void) VSIUnlink(source_file.c_str());
+    (void) VSIUnlink((d_localfile + ".aux.xml").c_str());
+}
+
+/** @brief Transforms the variables of the DataDDS to a JPEG2000 file.
+ *
+ * Scan the DDS of the dataset and find the Grids that have been projected.
+ * Try to render their content as a JPEG2000. The result is a N-band JPEG2000
+ * file.
+ *
+ * @note This method is a copy of the transform_to_geotiff() method and most
+ * of the code here could be factored out. However, the real utility of this
+ * method will be in its ability to write GML for a GMLJP2 response... 12/14/12
+ *
+ * @note Since the available GMLJP2 drivers for GDAL only support making
+ * files using the CreateCopy() mathod, we make a MEM dataset, load it with data
+ * and then use that to make GMLJP2 file.
+ *
+ * @note The MEM dataset's bands wrap the buffers the variables are read
+ * into (see m_jpeg2000_band_data()), so there is one copy of each band in
+ * memory. Every band must be read before CreateCopy() starts encoding, so
+ * FONg.Pipeline is not used here; it is used to fill the GeoTiff that
+ * larger responses are built from (see m_write_jpeg2000_in_windows()).
+ */
+void FONgTransform::transform_to_jpeg2000()
+{
+    // Scan the entire DDS looking for variables that have been 'projected' and
+    // build the delegate objects for them.
+    find_vars(d_dds, *this);
+
+    for (int i = 0; i < num_bands(); ++i)
+        if (!effectively_two_D(var(i)))
+            throw Error("GeoTiff responses can consist of two-dimensional variables only; use constraints to reduce the size of Grids as needed, or set fong_multiband to write the other dimensions as bands.");
+
+    m_set_output_size();
 
-        BESDEBUG("fong3", "Before JPEG2000 CreateCopy, number of bands: " << d_dest->GetRasterCount() << endl);
+    // NB: This is where the type of the bands is set. JPEG2000 only supports integer types.
+    GDALDataType band_type = m_band_type();
+    if (band_type != GDT_Byte && band_type != GDT_Int16 && band_type != GDT_UInt16
+        && band_type != GDT_Int32 && band_type != GDT_UInt32)
+        band_type = GDT_Int32;
+
+    BESDEBUG("fong3", "band type: " << GDALGetDataTypeName(band_type) << endl);
+
+    // The MEM dataset holds every band; when they don't fit in the memory
+    // budget, build the response from a GeoTiff written a window at a time.
+    unsigned long long bytes = static_cast<unsigned long long>(width()) * height() * num_bands() * (GDALGetDataTypeSize(band_type) / 8);
+    if (FONgRequestHandler::memory_budget > 0 && bytes > FONgRequestHandler::memory_budget) {
+        m_write_jpeg2000_in_windows(band_type);
+        return;
+    }
+
+    GDALDriver *Driver = GetGDALDriverManager()->GetDriverByName("MEM");
+    if( Driver == NULL )
+        throw Error("Could not get the MEM driver from/for GDAL: " + string(CPLGetLastErrorMsg()));
+
+    char **Metadata = Driver->GetMetadata();
+    if (!CSLFetchBoolean(Metadata, GDAL_DCAP_CREATE, FALSE))
+        throw Error("Driver JP2OpenJPEG does not support dataset creation.");
+
+    // No creation options for a memory dataset. The bands are added below;
+    // each one uses the buffer that holds the variable's values, so the
+    // values are not copied into the dataset.
+    d_dest = Driver->Create("in_memory_dataset", width(), height(), 0, GDT_Int32, 0 /*options*/);
+    if (!d_dest)
+        throw Error("Could not create in-memory dataset: " + string(CPLGetLastErrorMsg()));
+
+    d_dest->SetGeoTransform(geo_transform());
+
+    BESDEBUG("fong3", "Made new temp file and set georeferencing (" << num_bands() << " vars)." << endl);
+
+    // The MEM dataset does not own these; free them once it is closed.
+    vector<band_buffer> buffers;
+    try {
+        m_set_projection(d_dest);
+
+        // Read and convert the bands using FONg.BandThreads threads
+        vector<int> bands;
+        for (int i = 0; i < num_bands(); ++i)
+            bands.push_back(i);
+        double start = FONgRequestLog::now();
+        m_read_bands(bands, band_type, true /*jpeg2000*/, buffers);
+        d_convert_time += FONgRequestLog::now() - start;
 
-        jpeg_dst = Driver->CreateCopy(d_localfile.c_str(), d_dest, FALSE/*strict*/,
-                options, NULL/*progress*/, NULL/*progress data*/);
+        for (int i = 0; i < num_bands(); ++i) {
+            char pointer[64];
+            memset(pointer, 0, sizeof(pointer));
+            CPLPrintPointer(pointer, buffers[i].data, sizeof(pointer));
+
+            char **options = CSLSetNameValue(NULL, "DATAPOINTER", pointer);
+            CPLErr error = d_dest->AddBand(band_type, options);
+            CSLDestroy(options);
+
+            if (error != CE_None)
+                throw Error("Could not add band " + long_to_string(i+1) + ": " + string(CPLGetLastErrorMsg()));
+
+            m_set_statistics(d_dest->GetRasterBand(i+1), buffers[i].extrema);
+        }
+    }
+    catch (...) {
+        GDALClose(d_dest);
+        for (vector<band_buffer>::iterator i = buffers.begin(); i != buffers.end(); ++i)
+            i->free();
+        throw;
+    }
 
-        if (!jpeg_dst)
-            throw Error("Could not create the JPEG200 dataset: " + string(CPLGetLastErrorMsg()));
+    // Now get the OpenJPEG driver and use CreateCopy() on the d_dest "MEM" dataset
+    GDALDataset *jpeg_dst = 0;
+    try {
+        jpeg_dst = m_create_jpeg2000(d_dest);
     }
     catch (...) {
         GDALClose(d_dest);
         GDALClose (jpeg_dst);
+        for (vector<band_buffer>::iterator i = buffers.begin(); i != buffers.end(); ++i)
+            i->free();
         throw;
     }
 
     GDALClose(d_dest);
     GDALClose(jpeg_dst);
+    // Anything GDAL could not put in the JPEG2000 itself; not part of the response
+    (void) VSIUnlink((d_localfile + ".aux.xml").c_str());
+
+    for (vector<band_buffer>::iterator i = buffers.begin(); i != buffers.end(); ++i)
+        i->free();
+}
+
+/** @brief Find the statistics of a band
+ *
+ * The band is read as doubles in as many whole rows as fit in
+ * FONg.MemoryBudget (or pieces of one row when a row does not fit), so
+ * no more of it than that is in memory at once.
+ *
+ * @param fbtp The variable
+ * @return The band's extrema and statistics
+ */
+FONgExtrema FONgTransform::m_band_statistics(FONgBaseType *fbtp)
+{
+    unsigned long long pixels = FONgRequestHandler::memory_budget == 0 ? static_cast<unsigned long long>(width()) * height()
+        : max(1ULL, FONgRequestHandler::memory_budget / sizeof(double));
+
+    int window_rows = 1, window_cols = width();
+    if (m_downsampling() || pixels >= static_cast<unsigned long long>(width()))
+        window_rows = max(1ULL, min(static_cast<unsigned long long>(height()), pixels / width()));
+    else
+        window_cols = pixels;
+
+    FONgExtrema extrema = m_extrema();
+    for (int row = 0; row < height(); row += window_rows) {
+        int rows = min(window_rows, height() - row);
+        for (int col = 0; col < width(); col += window_cols) {
+            int cols = min(window_cols, width() - col);
+
+            FONgPoolBuffer data(m_band_window(fbtp, row, rows, col, cols));
+            extrema.add(data.doubles(), static_cast<unsigned long long>(cols) * rows);
+        }
+    }
+
+    return extrema;
+}
+
+// Write s as a JSON string
+static void json_string(ostream &strm, const string &s)
+{
+    strm << '"';
+    for (string::size_type i = 0; i < s.length(); ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\')
+            strm << '\\' << c;
+        else if (c < 0x20)
+            strm << "\\u00" << "0123456789abcdef"[c >> 4] << "0123456789abcdef"[c & 0xf];
+        else
+            strm << c;
+    }
+    strm << '"';
+}
+
+/** @brief Write the statistics of the variables' bands as JSON
+ *
+ * This builds the same bands as transform_to_geotiff(), using the same
+ * output size (see m_set_output_size()), but only finds the statistics of
+ * each one (see FONgExtrema); nothing is encoded by GDAL. The response is
+ * a JSON object with the size of the bands and, for each band, the name
+ * of its variable, the number and percentage of valid pixels and their
+ * minimum, maximum, mean and standard deviation. The last four are null
+ * when a band has no valid pixels.
+ *
+ * @param strm Write the JSON here
+ */
+void FONgTransform::transform_to_statistics(ostream &strm)
+{
+    find_vars(d_dds, *this);
+
+    for (int i = 0; i < num_bands(); ++i)
+        if (!effectively_two_D(var(i)))
+            throw Error("Statistics responses can consist of two-dimensional variables only; use constraints to reduce the size of Grids as needed, or set fong_multiband to use the other dimensions as bands.");
+
+    m_set_output_size();
+
+    // Find all of the statistics before writing anything, so an error
+    // does not leave a partial response.
+    double start = FONgRequestLog::now();
+    vector<FONgExtrema> stats;
+    for (int i = 0; i < num_bands(); ++i)
+        stats.push_back(m_band_statistics(var(i)));
+    d_convert_time += FONgRequestLog::now() - start;
+
+    streamsize precision = strm.precision(numeric_limits<double>::digits10 + 2);
+    strm << "{\n    \"width\": " << width() << ",\n    \"height\": " << height() << ",\n    \"bands\": [";
+
+    for (int i = 0; i < num_bands(); ++i) {
+        const FONgExtrema &extrema = stats[i];
+
+        strm << (i ? ",\n" : "\n") << "        { \"name\": ";
+        json_string(strm, var(i)->name());
+        strm << ", \"count\": " << extrema.count()
+             << ", \"valid_percent\": " << 100.0 * extrema.count() / (static_cast<double>(width()) * height());
+
+        if (extrema.count() > 0)
+            strm << ", \"minimum\": " << extrema.valid_min() << ", \"maximum\": " << extrema.valid_max()
+                 << ", \"mean\": " << extrema.mean() << ", \"stddev\": " << extrema.stddev() << " }";
+        else
+            strm << ", \"minimum\": null, \"maximum\": null, \"mean\": null, \"stddev\": null }";
+    }
+
+    strm << "\n    ]\n}\n" << flush;
+    strm.precision(precision);
 }
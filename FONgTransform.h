@@ -26,9 +26,16 @@
 #define FONgTransfrom_h_ 1
 
 //#include <cstdlib>
+#include <map>
+
+#include <gdal.h>
+
+#include "FONgBufferPool.h"
+#include "FONgExtrema.h"
 
 class FONgBaseType;
 class GDALDataset;
+class GDALRasterBand;
 class BESDataHandlerInterface;
 
 /** @brief Transformation object that converts an OPeNDAP DataDDS to a
@@ -43,6 +50,33 @@ class FONgTransform : public BESObj
 public:
     typedef enum { none, negative, positive } no_data_type_t;
 
+    // The values of a band, in a buffer from FONgBufferPool. The buffer
+    // holds doubles if 'doubles' is set; otherwise it holds values of the
+    // band's type. 'extrema' holds the band's statistics.
+    struct band_buffer {
+        char *data;
+        bool doubles;
+        FONgExtrema extrema;
+
+        band_buffer() : data(0), doubles(false) {}
+
+        void free()
+        {
+            FONgBufferPool::release(data);
+            data = 0;
+        }
+    };
+
+    // The extent of a latitude or longitude map. Bands that share a map
+    // (same fully qualified name and constraint) look it up instead of
+    // reading it again.
+    struct map_extent {
+        int length;
+        double first, last;
+
+        map_extent() : length(0), first(0.0), last(0.0) {}
+    };
+
 private:
     GDALDataset *d_dest;
 
@@ -66,15 +100,96 @@ private:
 
     int d_num_bands;
 
-    void m_scale_data(double *data);
+    // Read the variables in a separate thread while the bands are written
+    bool d_pipeline;
+
+    // Write GeoTiff bands as Float64 regardless of the variables' types
+    bool d_force_float64;
+
+    // Building the intermediate GeoTiff of a COG
+    bool d_cog;
+
+    // The GeoTiff being written is compressed, so its blocks should be
+    // written only once
+    bool d_compressed;
+
+    // Map extents found so far, keyed by the map's FQN and constraint
+    std::map<string, map_extent> d_map_extents;
+
+    // Seconds spent waiting for band values to be read and converted
+    double d_convert_time;
+
+    // Downsampling (see m_set_output_size()): the size of the variables
+    // and the resampling method, which is empty when the response is the
+    // size of the variables.
+    int d_source_width, d_source_height;
+    string d_resampling;
+
+    template <typename T> FONgExtrema m_scale_data(T *data);
+    FONgExtrema m_scale_data(char *data, libdap::Type type);
+    FONgExtrema m_extrema();
+    void m_set_statistics(GDALRasterBand *band, const FONgExtrema &extrema);
+    FONgExtrema m_band_statistics(FONgBaseType *fbtp);
+    GDALDataType m_band_type();
+    band_buffer m_jpeg2000_band_data(FONgBaseType *fbtp, GDALDataType band_type);
+    band_buffer m_geotiff_band_data(FONgBaseType *fbtp, GDALDataType band_type);
+    void m_read_bands(const vector<int> &bands, GDALDataType band_type, bool jpeg2000, vector<band_buffer> &buffers);
+    static void *m_read_band_worker(void *arg);
+    char **m_geotiff_options(GDALDataType band_type, bool force_tiled, bool compressed);
+    char **m_cog_options(GDALDataType band_type, bool overviews);
+    char **m_jpeg2000_options();
+    vector<int> m_overview_levels();
+    void m_write_cog(const string &source_file, const string &cog_file);
+    bool m_new_no_data(const FONgExtrema &extrema, double &new_no_data);
+    bool m_band_no_data(GDALRasterBand *band, const FONgExtrema &extrema, double &new_no_data);
+    void m_fix_no_data(GDALRasterBand *band, const FONgExtrema &extrema, int window_rows, int window_cols);
     bool effectively_two_D(FONgBaseType *fbtp);
 
+    bool m_downsampling() const { return !d_resampling.empty(); }
+    void m_set_output_size();
+    void m_downsample(FONgBaseType *fbtp, int row, int rows, double *dest);
+    double *m_band_rows(FONgBaseType *fbtp, int row, int rows);
+
+    bool m_read_in_windows(FONgBaseType *fbtp);
+    void m_window_size(GDALRasterBand *band, int &rows, int &cols);
+    double *m_band_window(FONgBaseType *fbtp, int row, int rows, int col, int cols);
+    void m_write_band_in_windows(FONgBaseType *fbtp, GDALRasterBand *band);
+    GDALDataset *m_create_jpeg2000(GDALDataset *source);
+    void m_write_jpeg2000_in_windows(GDALDataType band_type);
+
+    void m_set_projection(GDALDataset *dest);
+    void m_write_bands_pipelined(GDALDataset *dest);
+    static void *m_read_blocks(void *arg);
+
 public:
     FONgTransform(libdap::DDS *dds, libdap::ConstraintEvaluator &evaluator, const string &localfile);
+    FONgTransform(libdap::DDS *dds, libdap::ConstraintEvaluator &evaluator);
     virtual ~FONgTransform();
 
     virtual void transform_to_geotiff();
+    virtual void transform_to_cog();
     virtual void transform_to_jpeg2000();
+    virtual void transform_to_statistics(ostream &strm);
+
+    static unsigned long long estimated_size(libdap::DDS *dds);
+    static unsigned long long estimated_working_set(libdap::DDS *dds);
+    static void band_variables(libdap::DDS *dds, vector<libdap::BaseType*> &vars);
+    static void validate(libdap::DDS *dds);
+    static bool reads_incrementally(libdap::BaseType *btp);
+    static string geotiff_options_key(bool cog = false);
+    static string jpeg2000_options_key();
+    static string output_size_key();
+    static bool multiband();
+
+    bool pipeline() { return d_pipeline; }
+    void set_pipeline(bool state) { d_pipeline = state; }
+
+    std::map<string, map_extent> &map_extents() { return d_map_extents; }
+
+    // The part of a transform spent getting the band values; the rest is
+    // GDAL encoding the response.
+    double convert_time() { return d_convert_time; }
+    unsigned long long bytes_read();
 
     bool is_geo_transform_set() { return d_geo_transform_set; }
     void geo_transform_set(bool state) { d_geo_transform_set = state; }
@@ -0,0 +1,292 @@
+// FONgUtils.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#include <poll.h>
+#endif
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <climits>
+#include <vector>
+#include <algorithm>
+#include <iostream>
+
+#ifdef __GLIBCXX__
+#include <ext/stdio_filebuf.h>
+#endif
+
+#include <BESInternalError.h>
+#include <BESSyntaxUserError.h>
+#include <BESDebug.h>
+#include <BESContextManager.h>
+
+#include "FONgUtils.h"
+
+using namespace std;
+
+// Size of the buffer used when the output stream is not backed by a file
+// descriptor.
+#define FONG_SEND_BLOCK_SIZE (1024 * 1024)
+
+/** @brief Find the file descriptor behind an output stream
+ *
+ * This works for cout (which is what besstandalone uses) and for streams
+ * built on the GNU stdio_filebuf. For any other stream, including the
+ * BES' PPT stream, it returns -1.
+ *
+ * @param strm The stream
+ * @return The file descriptor or -1 if the stream is not backed by one.
+ */
+int FONgUtils::output_fd(ostream &strm)
+{
+    if (&strm == &cout)
+        return fileno(stdout);
+
+#ifdef __GLIBCXX__
+    __gnu_cxx::stdio_filebuf<char> *fb = dynamic_cast<__gnu_cxx::stdio_filebuf<char>*>(strm.rdbuf());
+    if (fb)
+        return fb->fd();
+#endif
+
+    return -1;
+}
+
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+/** Wait until out_fd can be written. Returns false if poll(2) fails. */
+static bool m_wait_for_output(int out_fd)
+{
+    struct pollfd pfd;
+    pfd.fd = out_fd;
+    pfd.events = POLLOUT;
+    pfd.revents = 0;
+
+    int n;
+    do {
+        n = poll(&pfd, 1, -1 /*no timeout*/);
+    } while (n == -1 && errno == EINTR);
+
+    return n == 1;
+}
+
+/** Copy the first size bytes of the file to out_fd using sendfile(2).
+ * Returns the number of bytes sent, which is less than size if
+ * sendfile() cannot be used with these descriptors (e.g., the output was
+ * opened with O_APPEND) or stopped early; the caller sends the rest. */
+static off_t m_sendfile(int fd, off_t size, int out_fd)
+{
+    off_t offset = 0;
+    while (offset < size) {
+        ssize_t n = sendfile(out_fd, fd, &offset, size - offset);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            // A non-blocking output that is full; wait until it can take
+            // more. If we can't, the caller writes the rest.
+            if (errno == EAGAIN) {
+                if (m_wait_for_output(out_fd))
+                    continue;
+                break;
+            }
+            if (offset == 0 && (errno == EINVAL || errno == ENOSYS))
+                break;
+            throw BESInternalError("Could not transmit the response: " + string(strerror(errno)), __FILE__, __LINE__);
+        }
+        if (n == 0)
+            break;
+    }
+
+    return offset;
+}
+#endif
+
+/** Copy the bytes [offset, offset + size) of the file to strm using
+ * large reads. */
+static void m_send_blocks(int fd, unsigned long long offset, unsigned long long size, ostream &strm)
+{
+#ifdef HAVE_POSIX_FADVISE
+    (void) posix_fadvise(fd, offset, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    if (lseek(fd, offset, SEEK_SET) == -1)
+        throw BESInternalError("Could not read the response file: " + string(strerror(errno)), __FILE__, __LINE__);
+
+    vector<char> block(FONG_SEND_BLOCK_SIZE);
+    while (size > 0) {
+        ssize_t n = read(fd, &block[0], min(static_cast<unsigned long long>(block.size()), size));
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            throw BESInternalError("Could not read the response file: " + string(strerror(errno)), __FILE__, __LINE__);
+        }
+        if (n == 0)
+            throw BESInternalError("The response file is shorter than expected.", __FILE__, __LINE__);
+
+        strm.write(&block[0], n);
+        if (!strm)
+            throw BESInternalError("Could not write the response to the output stream.", __FILE__, __LINE__);
+        size -= n;
+    }
+}
+
+/** @brief Write the contents of a file to an output stream
+ *
+ * If the stream is backed by a file descriptor, use sendfile() so the
+ * data are never copied into user space. Otherwise, or for whatever
+ * sendfile() did not send, read the file in large blocks and write them
+ * to the stream. The whole file is sent, regardless of the descriptor's
+ * current offset.
+ *
+ * @param fd An open file descriptor for the file to send
+ * @param strm The output stream
+ * @return The number of bytes sent
+ * @throws BESInternalError
+ */
+unsigned long long FONgUtils::send_file(int fd, ostream &strm)
+{
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        throw BESInternalError("Could not stat the response file: " + string(strerror(errno)), __FILE__, __LINE__);
+
+    return send_file(fd, strm, st.st_size);
+}
+
+/** @brief Write the first part of a file to an output stream
+ *
+ * Like send_file(int, ostream&) but only the first size bytes are sent.
+ * Used for cache entries, which end with their key.
+ *
+ * @param fd An open file descriptor for the file to send
+ * @param strm The output stream
+ * @param size The number of bytes to send
+ * @return The number of bytes sent
+ * @throws BESInternalError
+ */
+unsigned long long FONgUtils::send_file(int fd, ostream &strm, unsigned long long size)
+{
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    // Bytes sent using sendfile(); read() and write the rest
+    unsigned long long sent = 0;
+#if defined(HAVE_SYS_SENDFILE_H) && defined(HAVE_SENDFILE)
+    int out_fd = output_fd(strm);
+    if (out_fd != -1) {
+        // Anything written to the stream (e.g., the HTTP header) must be
+        // written before the file's bytes go out underneath it.
+        strm.flush();
+        if (&strm == &cout)
+            fflush(stdout);
+
+        sent = m_sendfile(fd, size, out_fd);
+    }
+#endif
+
+    if (sent < size)
+        m_send_blocks(fd, sent, size - sent, strm);
+
+    struct timeval end;
+    gettimeofday(&end, NULL);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+
+    BESDEBUG("fong", "Sent " << size << " bytes (" << sent << " using sendfile(), " << size - sent << " using read())"
+             << " in " << secs << "s (" << (secs > 0 ? size / secs : 0) << " bytes/sec)" << endl);
+
+    return size;
+}
+
+/** @brief Read a boolean per-request option from the BES context
+ *
+ * Lets a request override one of the module's boolean keys, e.g. with
+ * the bescmd element <setContext name="fong_force_float64">yes</setContext>.
+ *
+ * @param name The name of the context
+ * @param default_value Value to use if the context is not set
+ * @return True if the context is 'true' or 'yes', false if it is set to
+ * anything else, the default_value if it is not set.
+ */
+bool FONgUtils::get_bool_context(const string &name, bool default_value)
+{
+    bool found = false;
+    string value = BESContextManager::TheManager()->get_context(name, found);
+    if (!found || value.empty())
+        return default_value;
+
+    for (string::size_type i = 0; i < value.length(); ++i)
+        value[i] = tolower(value[i]);
+
+    return value == "true" || value == "yes";
+}
+
+/** @brief Read an integer per-request option from the BES context
+ *
+ * @param name The name of the context
+ * @param default_value Value to use if the context is not set
+ * @return The value of the context or default_value if it is not set
+ * @exception BESSyntaxUserError if the context is not an integer or does
+ * not fit in an int
+ */
+int FONgUtils::get_int_context(const string &name, int default_value)
+{
+    bool found = false;
+    string value = BESContextManager::TheManager()->get_context(name, found);
+    if (!found || value.empty())
+        return default_value;
+
+    char *end = 0;
+    errno = 0;
+    long i = strtol(value.c_str(), &end, 10);
+    if (*end != '\0')
+        throw BESSyntaxUserError("The context " + name + " must be an integer, not '" + value + "'.", __FILE__, __LINE__);
+    if (errno == ERANGE || i < INT_MIN || i > INT_MAX)
+        throw BESSyntaxUserError("The context " + name + " is too large: '" + value + "'.", __FILE__, __LINE__);
+
+    return static_cast<int>(i);
+}
+
+/** @brief Read a per-request option from the BES context
+ *
+ * @param name The name of the context
+ * @param default_value Value to use if the context is not set
+ * @return The value of the context or default_value if it is not set
+ */
+string FONgUtils::get_string_context(const string &name, const string &default_value)
+{
+    bool found = false;
+    string value = BESContextManager::TheManager()->get_context(name, found);
+
+    return (found && !value.empty()) ? value : default_value;
+}
@@ -0,0 +1,47 @@
+// FONgUtils.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef FONgUtils_h_
+#define FONgUtils_h_ 1
+
+#include <string>
+#include <ostream>
+
+using std::string;
+using std::ostream;
+
+/** @brief Utilities shared by the GeoTiff and JPEG2000 transmitters
+ */
+class FONgUtils {
+public:
+    static int output_fd(ostream &strm);
+    static unsigned long long send_file(int fd, ostream &strm);
+    static unsigned long long send_file(int fd, ostream &strm, unsigned long long size);
+
+    static bool get_bool_context(const string &name, bool default_value);
+    static int get_int_context(const string &name, int default_value);
+    static string get_string_context(const string &name, const string &default_value);
+};
+
+#endif // FONgUtils_h_
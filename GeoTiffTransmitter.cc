@@ -25,6 +25,7 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <cstdio>
 #include <cstdlib>
@@ -34,6 +35,9 @@
 
 #include <iostream>
 #include <fstream>
+#include <sstream>
+
+#include <cpl_vsi.h>
 
 #include <DataDDS.h>
 #include <BaseType.h>
@@ -43,6 +47,11 @@ using namespace libdap;
 
 #include "GeoTiffTransmitter.h"
 #include "FONgTransform.h"
+#include "FONgUtils.h"
+#include "FONgResponseCache.h"
+#include "FONgRequestHandler.h"
+#include "FONgRequestLog.h"
+#include "FONgAdmission.h"
 
 #include <BESInternalError.h>
 #include <BESDapError.h>
@@ -72,15 +81,19 @@ string GeoTiffTransmitter::default_gcs;
  * FONg.Tempdir. If this variable is not found or is not set then it
  * defaults to the macro definition FONG_TEMP_DIR.
  *
- * @note The mapping from a 'returnAs' of "geotiff" to this code
+ * @note The mapping from a 'returnAs' of "geotiff" (and "cog") to this code
  * is made in the FONgModule class.
  *
+ * @param cog If true, the transmitter returns Cloud Optimized GeoTiffs
  * @see FONgModule
  */
-GeoTiffTransmitter::GeoTiffTransmitter() :  BESBasicTransmitter()
+GeoTiffTransmitter::GeoTiffTransmitter(bool cog) :  BESBasicTransmitter()
 {
     // DATA_SERVICE == "dods"
-    add_method(DATA_SERVICE, GeoTiffTransmitter::send_data_as_geotiff);
+    if (cog)
+        add_method(DATA_SERVICE, GeoTiffTransmitter::send_data_as_cog);
+    else
+        add_method(DATA_SERVICE, GeoTiffTransmitter::send_data_as_geotiff);
 
     if (GeoTiffTransmitter::temp_dir.empty()) {
         // Where is the temp directory for creating these files
@@ -123,6 +136,32 @@ GeoTiffTransmitter::GeoTiffTransmitter() :  BESBasicTransmitter()
  * streaming the netcdf file
  */
 void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHandlerInterface &dhi)
+{
+    GeoTiffTransmitter::send_data(obj, dhi, false);
+}
+
+/** @brief The static method registered to transmit OPeNDAP data objects as
+ * a Cloud Optimized GeoTiff.
+ *
+ * @param obj The BESResponseObject containing the OPeNDAP DataDDS object
+ * @param dhi BESDataHandlerInterface containing information about the
+ * request and response
+ * @see send_data_as_geotiff()
+ * @see FONgTransform::transform_to_cog()
+ */
+void GeoTiffTransmitter::send_data_as_cog(BESResponseObject *obj, BESDataHandlerInterface &dhi)
+{
+    GeoTiffTransmitter::send_data(obj, dhi, true);
+}
+
+/** @brief Transmit the data as a GeoTiff or COG
+ *
+ * @param obj The BESResponseObject containing the OPeNDAP DataDDS object
+ * @param dhi BESDataHandlerInterface containing information about the
+ * request and response
+ * @param cog If true, build a Cloud Optimized GeoTiff
+ */
+void GeoTiffTransmitter::send_data(BESResponseObject *obj, BESDataHandlerInterface &dhi, bool cog)
 {
     BESDataDDSResponse *bdds = dynamic_cast<BESDataDDSResponse *>(obj);
     if (!bdds)
@@ -136,6 +175,22 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
     if (!strm)
         throw BESInternalError("Output stream is not set, cannot return as", __FILE__, __LINE__);
 
+    // Logs the time and bytes of each phase when this function returns
+    FONgRequestLog log(cog ? "cog" : "geotiff");
+    log.set_dataset(dds->get_dataset_name());
+
+    // If this response has been built before, return the cached copy and
+    // skip reading and transforming the data.
+    FONgResponseCache *cache = FONgResponseCache::get_instance();
+    string cache_key = cache ? FONgResponseCache::get_key(dhi, cog ? "cog" : "geotiff", GeoTiffTransmitter::options_key(cog)) : "";
+    bool cached = !cache_key.empty() && GeoTiffTransmitter::return_cached_stream(cache, cache_key, strm, log);
+    log.phase("cache");
+    if (cached) {
+        log.set_status("cached");
+        BESDEBUG("fong2", "GeoTiffTransmitter::send_data - done transmitting cached geotiff" << endl);
+        return;
+    }
+
     BESDEBUG("fong2", "GeoTiffTransmitter::send_data - parsing the constraint" << endl);
 
     // ticket 1248 jhrg 2/23/09
@@ -150,12 +205,23 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
         throw BESInternalError("Failed to parse the constraint expression: Unknown exception caught", __FILE__, __LINE__);
     }
 
-    // now we need to read the data
-    BESDEBUG("fong2", "GeoTiffTransmitter::send_data - reading data into DataDDS" << endl);
+    // Reject requests that cannot be converted before reading any data.
+    // Function results are checked once the functions have run.
+    if (!bdds->get_ce().function_clauses()) {
+        try {
+            FONgTransform::validate(dds);
+        }
+        catch (Error &e) {
+            throw BESDapError(e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
+        }
+    }
 
-    try {
-        // Handle *functional* constraint expressions specially
-        if (bdds->get_ce().function_clauses()) {
+    log.phase("parse_ce");
+
+    // Server functions replace the DDS with their results. Run them before
+    // the memory needed is estimated, so it is estimated for the results.
+    if (bdds->get_ce().function_clauses()) {
+        try {
             BESDEBUG("fong2", "processing a functional constraint clause(s)." << endl);
             DDS *tmp_dds = bdds->get_ce().eval_function_clauses(*dds);
             delete dds;
@@ -172,15 +238,41 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
             // transmission, and that in fact is what happens in our friend
             // promote_function_output_structures()
             promote_function_output_structures(dds);
-
+            FONgTransform::validate(dds);
+        }
+        catch (Error &e) {
+            throw BESDapError("Failed to read data: " + e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
+        }
+        catch (BESError &e) {
+            throw;
+        }
+        catch (...) {
+            throw BESInternalError("Failed to read data: Unknown exception caught", __FILE__, __LINE__);
         }
-        else {
-            // Iterate through the variables in the DataDDS and read
-            // in the data if the variable has the send flag set.
-            for (DDS::Vars_iter i = dds->var_begin(); i != dds->var_end(); i++) {
-                if ((*i)->send_p()) {
+
+        log.phase("read");
+    }
+
+    // Wait until the conversions running on this host leave enough memory
+    // for this one (see FONg.AdmissionBudget); it is given back when
+    // send_data() returns.
+    FONgAdmission admission(GeoTiffTransmitter::temp_dir, FONgTransform::estimated_working_set(dds));
+    log.phase("admission");
+
+    // now we need to read the data
+    BESDEBUG("fong2", "GeoTiffTransmitter::send_data - reading data into DataDDS" << endl);
+
+    try {
+        if (!bdds->get_ce().function_clauses()) {
+            // Read the variables that will become bands. FONgTransform
+            // reads their maps and coordinates, and the variables it
+            // reads incrementally (see reads_incrementally()), itself;
+            // other projected variables are not used.
+            vector<BaseType*> vars;
+            FONgTransform::band_variables(dds, vars);
+            for (vector<BaseType*>::iterator i = vars.begin(); i != vars.end(); ++i) {
+                if (!FONgTransform::reads_incrementally(*i))
                     (*i)->intern_data(bdds->get_ce(), *dds);
-                }
             }
         }
     }
@@ -194,9 +286,23 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
         throw BESInternalError("Failed to read data: Unknown exception caught", __FILE__, __LINE__);
     }
 
+    log.phase("read");
+
+    // Small responses are built in GDAL's in-memory filesystem and written
+    // directly to the output stream; larger ones go through a temporary
+    // file so that they don't exhaust the process' memory.
+    if (FONgRequestHandler::in_memory_max_size > 0
+        && FONgTransform::estimated_size(dds) <= FONgRequestHandler::in_memory_max_size) {
+        GeoTiffTransmitter::send_memory_file(dds, bdds->get_ce(), strm, cache_key, cog, log);
+        log.set_status("ok");
+        BESDEBUG("fong2", "GeoTiffTransmitter::send_data - done transmitting to geotiff" << endl);
+        return;
+    }
+
     // Huh? Put the template for the temp file name in a char array. Use vector<char>
-    // to avoid using new/delete.
-    string temp_file_name = GeoTiffTransmitter::temp_dir + '/' + "geotiffXXXXXX";
+    // to avoid using new/delete. Responses that will be cached are built in the
+    // cache directory so they can be renamed into place.
+    string temp_file_name = cache_key.empty() ? GeoTiffTransmitter::temp_dir + '/' + "geotiffXXXXXX" : cache->get_temp_template();
     vector<char> temp_file(temp_file_name.length() + 1);
     string::size_type len = temp_file_name.copy(&temp_file[0], temp_file_name.length());
     temp_file[len] = '\0';
@@ -219,11 +325,18 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
         FONgTransform ft(dds, bdds->get_ce(), &temp_file[0]);
 
         // transform() opens the temporary file, dumps data to it and closes it.
-        ft.transform_to_geotiff();
+        if (cog)
+            ft.transform_to_cog();
+        else
+            ft.transform_to_geotiff();
+
+        log.transform_phase(ft.convert_time());
+        log.set_bytes_read(ft.bytes_read());
 
         BESDEBUG("fong2", "GeoTiffTransmitter::send_data - transmitting temp file " << &temp_file[0] << endl );
 
-        GeoTiffTransmitter::return_temp_stream(&temp_file[0], strm);
+        GeoTiffTransmitter::return_temp_stream(&temp_file[0], strm, log);
+        log.phase("send");
     }
     catch (Error &e) {
         close(fd);
@@ -242,7 +355,14 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
     }
 
     close(fd);
-    (void) unlink(&temp_file[0]);
+    if (!cache_key.empty()) {
+        cache->put(&temp_file[0], cache_key);
+        log.phase("cache_put");
+    }
+    else
+        (void) unlink(&temp_file[0]);
+
+    log.set_status("ok");
 
     BESDEBUG("fong2", "GeoTiffTransmitter::send_data - done transmitting to geotiff" << endl);
 }
@@ -250,27 +370,49 @@ void GeoTiffTransmitter::send_data_as_geotiff(BESResponseObject *obj, BESDataHan
 /** @brief stream the temporary file back to the requester
  *
  * Streams the temporary file specified by filename to the specified
- * C++ ostream
+ * C++ ostream. The file is sent with sendfile() when the stream is
+ * backed by a file descriptor.
  *
  * @param filename The name of the file to stream back to the requester
  * @param strm C++ ostream to write the contents of the file to
+ * @param log Record the bytes encoded and sent here
  * @throws BESInternalError if problem opening the file
  */
-void GeoTiffTransmitter::return_temp_stream(const string &filename, ostream &strm)
+void GeoTiffTransmitter::return_temp_stream(const string &filename, ostream &strm, FONgRequestLog &log)
 {
-    ifstream os;
-    os.open(filename.c_str(), ios::binary | ios::in);
-    if (!os)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
         throw BESInternalError("Cannot connect to data source", __FILE__, __LINE__);
 
-    char block[4096];
-    os.read(block, sizeof block);
-    int nbytes = os.gcount();
-    if (nbytes == 0) {
-        os.close();
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
         throw BESInternalError("Internal server error, got zero count on stream buffer.", __FILE__, __LINE__);
     }
 
+    log.set_bytes_encoded(st.st_size);
+
+    GeoTiffTransmitter::send_http_header(filename, strm);
+
+    try {
+        log.add_bytes_sent(FONgUtils::send_file(fd, strm));
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+
+/** @brief Write the HTTP response header, if needed
+ *
+ * @param filename Name used for the Content-Disposition header
+ * @param strm C++ ostream to write the header to
+ */
+void GeoTiffTransmitter::send_http_header(const string &filename, ostream &strm)
+{
     // I think this is never used - we never run Hyrax where the BES is accessed
     // directly by HTTP.
     bool found = false;
@@ -282,15 +424,116 @@ void GeoTiffTransmitter::return_temp_stream(const string &filename, ostream &str
         strm << "Content-Disposition: filename=" << filename << ".tif;\n\n";
         strm << flush;
     }
+}
 
-    strm.write(block, nbytes);
+/** @brief Build the GeoTiff in memory and write it to the stream
+ *
+ * The GeoTiff is made in GDAL's /vsimem/ filesystem and the resulting
+ * buffer is written to the output stream without being copied. This
+ * avoids the round trip through FONg.Tempdir for small and medium
+ * sized responses.
+ *
+ * @param dds The DDS with the data already read
+ * @param ce The constraint evaluator for the request
+ * @param strm C++ ostream to write the GeoTiff to
+ * @param cache_key If not empty, also add the GeoTiff to the response
+ * cache using this key
+ * @param cog If true, build a Cloud Optimized GeoTiff
+ * @param log Record the phases and bytes here
+ * @throws BESDapError, BESInternalError
+ */
+void GeoTiffTransmitter::send_memory_file(DDS *dds, ConstraintEvaluator &ce, ostream &strm, const string &cache_key, bool cog,
+    FONgRequestLog &log)
+{
+    // The /vsimem/ filesystem is private to this process
+    static unsigned long counter = 0;
+    ostringstream oss;
+    oss << "/vsimem/geotiff" << counter++ << ".tif";
+    string mem_file = oss.str();
 
-    while (os) {
-        os.read(block, sizeof block);
-        nbytes = os.gcount();
-        strm.write(block, nbytes);
+    BESDEBUG("fong2", "GeoTiffTransmitter::send_data - transforming into memory file " << mem_file << endl);
+
+    try {
+        FONgTransform ft(dds, ce, mem_file);
+
+        if (cog)
+            ft.transform_to_cog();
+        else
+            ft.transform_to_geotiff();
+
+        log.transform_phase(ft.convert_time());
+        log.set_bytes_read(ft.bytes_read());
+
+        vsi_l_offset length = 0;
+        GByte *buffer = VSIGetMemFileBuffer(mem_file.c_str(), &length, FALSE /*unlink and seize*/);
+        if (!buffer || length == 0)
+            throw BESInternalError("Internal server error, got an empty in-memory GeoTiff.", __FILE__, __LINE__);
+
+        BESDEBUG("fong2", "GeoTiffTransmitter::send_data - transmitting memory file " << mem_file << " (" << length << " bytes)" << endl);
+
+        log.set_bytes_encoded(length);
+
+        GeoTiffTransmitter::send_http_header(mem_file, strm);
+        strm.write(reinterpret_cast<char*>(buffer), length);
+        log.add_bytes_sent(length);
+        log.phase("send");
+
+        if (!cache_key.empty()) {
+            FONgResponseCache::get_instance()->put_buffer(reinterpret_cast<char*>(buffer), length, cache_key);
+            log.phase("cache_put");
+        }
+    }
+    catch (Error &e) {
+        (void) VSIUnlink(mem_file.c_str());
+        throw BESDapError("Failed to transform data to GeoTiff: " + e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
+    }
+    catch (BESError &e) {
+        (void) VSIUnlink(mem_file.c_str());
+        throw;
+    }
+    catch (...) {
+        (void) VSIUnlink(mem_file.c_str());
+        throw BESInternalError("Fileout GeoTiff, was not able to transform to geotiff, unknown error", __FILE__, __LINE__);
     }
 
-    os.close();
+    (void) VSIUnlink(mem_file.c_str());
 }
 
+/** @brief Options that change the GeoTiff built for a request
+ *
+ * This is part of the response cache key.
+ */
+string GeoTiffTransmitter::options_key(bool cog)
+{
+    return string("version=") + MODULE_VERSION + "," + FONgTransform::geotiff_options_key(cog);
+}
+
+/** @brief Return a cached response, if there is one
+ *
+ * @param cache The response cache
+ * @param cache_key The key for this request
+ * @param strm C++ ostream to write the cached GeoTiff to
+ * @param log Record the bytes sent here
+ * @return True if the response was found in the cache and sent
+ */
+bool GeoTiffTransmitter::return_cached_stream(FONgResponseCache *cache, const string &cache_key, ostream &strm,
+    FONgRequestLog &log)
+{
+    unsigned long long size = 0;
+    int fd = cache->get_read_fd(cache_key, size);
+    if (fd == -1)
+        return false;
+
+    try {
+        GeoTiffTransmitter::send_http_header("geotiff", strm);
+        log.add_bytes_sent(FONgUtils::send_file(fd, strm, size));
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+
+    return true;
+}
@@ -27,30 +27,46 @@
 
 #include <BESBasicTransmitter.h>
 
+namespace libdap {
+    class DDS;
+    class ConstraintEvaluator;
+}
+
 class BESContainer;
+class FONgResponseCache;
+class FONgRequestLog;
 
 /** @brief BESTransmitter class named "geotiff" that transmits an OPeNDAP
  * data object as a geotiff file
  *
  * The GeoTiffTransmitter transforms an OPeNDAP DataDDS object into a
  * geotiff file and streams the new (temporary) geotiff file back to the
- * client.
+ * client. The same class, registered as "cog", returns Cloud Optimized
+ * GeoTiffs.
  *
  * @see BESBasicTransmitter
  */
 class GeoTiffTransmitter: public BESBasicTransmitter {
 private:
-    static void return_temp_stream(const string &filename, ostream &strm);
+    static void return_temp_stream(const string &filename, ostream &strm, FONgRequestLog &log);
+    static void send_http_header(const string &filename, ostream &strm);
+    static void send_memory_file(libdap::DDS *dds, libdap::ConstraintEvaluator &ce, ostream &strm,
+        const string &cache_key, bool cog, FONgRequestLog &log);
+    static bool return_cached_stream(FONgResponseCache *cache, const string &cache_key, ostream &strm,
+        FONgRequestLog &log);
+    static string options_key(bool cog);
+    static void send_data(BESResponseObject *obj, BESDataHandlerInterface &dhi, bool cog);
     static string temp_dir;
 
 
 public:
-    GeoTiffTransmitter();
+    GeoTiffTransmitter(bool cog = false);
     virtual ~GeoTiffTransmitter()
     {
     }
 
     static void send_data_as_geotiff(BESResponseObject *obj, BESDataHandlerInterface &dhi);
+    static void send_data_as_cog(BESResponseObject *obj, BESDataHandlerInterface &dhi);
 
     static string default_gcs;
 };
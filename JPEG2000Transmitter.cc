@@ -25,6 +25,7 @@
 #include "config.h"
 
 #include <unistd.h>
+#include <fcntl.h>
 
 #include <cstdio>
 #include <cstdlib>
@@ -43,6 +44,10 @@ using namespace libdap;
 
 #include "JPEG2000Transmitter.h"
 #include "FONgTransform.h"
+#include "FONgUtils.h"
+#include "FONgResponseCache.h"
+#include "FONgRequestLog.h"
+#include "FONgAdmission.h"
 
 #include <BESInternalError.h>
 #include <BESDapError.h>
@@ -137,6 +142,22 @@ void JPEG2000Transmitter::send_data_as_jp2(BESResponseObject *obj, BESDataHandle
     if (!strm)
     	throw BESInternalError("Output stream is not set, cannot return as", __FILE__, __LINE__);
 
+    // Logs the time and bytes of each phase when this function returns
+    FONgRequestLog log("jpeg2000");
+    log.set_dataset(dds->get_dataset_name());
+
+    // If this response has been built before, return the cached copy and
+    // skip reading and transforming the data.
+    FONgResponseCache *cache = FONgResponseCache::get_instance();
+    string cache_key = cache ? FONgResponseCache::get_key(dhi, "jpeg2000", JPEG2000Transmitter::options_key()) : "";
+    bool cached = !cache_key.empty() && JPEG2000Transmitter::return_cached_stream(cache, cache_key, strm, log);
+    log.phase("cache");
+    if (cached) {
+        log.set_status("cached");
+        BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - done transmitting cached jp2" << endl);
+        return;
+    }
+
     BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - parsing the constraint" << endl);
 
     // ticket 1248 jhrg 2/23/09
@@ -151,34 +172,23 @@ void JPEG2000Transmitter::send_data_as_jp2(BESResponseObject *obj, BESDataHandle
         throw BESInternalError("Failed to parse the constraint expression: Unknown exception caught", __FILE__, __LINE__);
     }
 
-    // now we need to read the data
-    BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - reading data into DataDDS" << endl);
-
-    // Huh? Put the template for the temp file name in a char array. Use vector<char>
-    // to avoid using new/delete.
-    string temp_file_name = JPEG2000Transmitter::temp_dir + '/' + "jp2XXXXXX";
-    vector<char> temp_file(temp_file_name.length() + 1);
-    string::size_type len = temp_file_name.copy(&temp_file[0], temp_file_name.length());
-    temp_file[len] = '\0';
-
-    // cover the case where older versions of mkstemp() create the file using
-    // a mode of 666.
-    mode_t original_mode = umask(077);
-
-    // Make and open (an atomic operation) the temporary file. Then reset the umask
-    int fd = mkstemp(&temp_file[0]);
-    umask(original_mode);
-
-    if (fd == -1)
-        throw BESInternalError("Failed to open the temporary file: " + temp_file_name, __FILE__, __LINE__);
-
-    // transform the OPeNDAP DataDDS to the geotiff file
-    BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - transforming into temporary file " << &temp_file[0] << endl);
+    // Reject requests that cannot be converted before reading any data.
+    // Function results are checked once the functions have run.
+    if (!bdds->get_ce().function_clauses()) {
+        try {
+            FONgTransform::validate(dds);
+        }
+        catch (Error &e) {
+            throw BESDapError(e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
+        }
+    }
 
-    try {
+    log.phase("parse_ce");
 
-        // Handle *functional* constraint expressions specially
-        if (bdds->get_ce().function_clauses()) {
+    // Server functions replace the DDS with their results. Run them before
+    // the memory needed is estimated, so it is estimated for the results.
+    if (bdds->get_ce().function_clauses()) {
+        try {
             BESDEBUG("fong2", "processing a functional constraint clause(s)." << endl);
             DDS *tmp_dds = bdds->get_ce().eval_function_clauses(*dds);
             delete dds;
@@ -195,15 +205,41 @@ void JPEG2000Transmitter::send_data_as_jp2(BESResponseObject *obj, BESDataHandle
             // transmission, and that in fact is what happens in our friend
             // promote_function_output_structures()
             promote_function_output_structures(dds);
-
+            FONgTransform::validate(dds);
+        }
+        catch (Error &e) {
+            throw BESDapError("Failed to read data: " + e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
         }
-        else {
-            // Iterate through the variables in the DataDDS and read
-            // in the data if the variable has the send flag set.
-            for (DDS::Vars_iter i = dds->var_begin(); i != dds->var_end(); i++) {
-                if ((*i)->send_p()) {
+        catch (BESError &e) {
+            throw;
+        }
+        catch (...) {
+            throw BESInternalError("Failed to read data: Unknown exception caught", __FILE__, __LINE__);
+        }
+
+        log.phase("read");
+    }
+
+    // Wait until the conversions running on this host leave enough memory
+    // for this one (see FONg.AdmissionBudget); it is given back when
+    // send_data() returns.
+    FONgAdmission admission(JPEG2000Transmitter::temp_dir, FONgTransform::estimated_working_set(dds));
+    log.phase("admission");
+
+    // now we need to read the data
+    BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - reading data into DataDDS" << endl);
+
+    try {
+        if (!bdds->get_ce().function_clauses()) {
+            // Read the variables that will become bands. FONgTransform
+            // reads their maps and coordinates, and the variables it
+            // reads incrementally (see reads_incrementally()), itself;
+            // other projected variables are not used.
+            vector<BaseType*> vars;
+            FONgTransform::band_variables(dds, vars);
+            for (vector<BaseType*>::iterator i = vars.begin(); i != vars.end(); ++i) {
+                if (!FONgTransform::reads_incrementally(*i))
                     (*i)->intern_data(bdds->get_ce(), *dds);
-                }
             }
         }
 
@@ -218,15 +254,43 @@ void JPEG2000Transmitter::send_data_as_jp2(BESResponseObject *obj, BESDataHandle
         throw BESInternalError("Failed to read data: Unknown exception caught", __FILE__, __LINE__);
     }
 
+    log.phase("read");
+
+    // Huh? Put the template for the temp file name in a char array. Use vector<char>
+    // to avoid using new/delete. Responses that will be cached are built in the
+    // cache directory so they can be renamed into place.
+    string temp_file_name = cache_key.empty() ? JPEG2000Transmitter::temp_dir + '/' + "jp2XXXXXX" : cache->get_temp_template();
+    vector<char> temp_file(temp_file_name.length() + 1);
+    string::size_type len = temp_file_name.copy(&temp_file[0], temp_file_name.length());
+    temp_file[len] = '\0';
+
+    // cover the case where older versions of mkstemp() create the file using
+    // a mode of 666.
+    mode_t original_mode = umask(077);
+
+    // Make and open (an atomic operation) the temporary file. Then reset the umask
+    int fd = mkstemp(&temp_file[0]);
+    umask(original_mode);
+
+    if (fd == -1)
+        throw BESInternalError("Failed to open the temporary file: " + temp_file_name, __FILE__, __LINE__);
+
+    // transform the OPeNDAP DataDDS to the geotiff file
+    BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - transforming into temporary file " << &temp_file[0] << endl);
+
     try {
         FONgTransform ft(dds, bdds->get_ce(), &temp_file[0]);
 
         // transform() opens the temporary file, dumps data to it and closes it.
         ft.transform_to_jpeg2000();
 
+        log.transform_phase(ft.convert_time());
+        log.set_bytes_read(ft.bytes_read());
+
         BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - transmitting temp file " << &temp_file[0] << endl );
 
-        JPEG2000Transmitter::return_temp_stream(&temp_file[0], strm);
+        JPEG2000Transmitter::return_temp_stream(&temp_file[0], strm, log);
+        log.phase("send");
     }
     catch (Error &e) {
         close(fd);
@@ -245,7 +309,14 @@ void JPEG2000Transmitter::send_data_as_jp2(BESResponseObject *obj, BESDataHandle
     }
 
     close(fd);
-    (void) unlink(&temp_file[0]);
+    if (!cache_key.empty()) {
+        cache->put(&temp_file[0], cache_key);
+        log.phase("cache_put");
+    }
+    else
+        (void) unlink(&temp_file[0]);
+
+    log.set_status("ok");
 
     BESDEBUG("JPEG20002", "JPEG2000Transmitter::send_data - done transmitting to jp2" << endl);
 }
@@ -253,27 +324,49 @@ void JPEG2000Transmitter::send_data_as_jp2(BESResponseObject *obj, BESDataHandle
 /** @brief stream the temporary file back to the requester
  *
  * Streams the temporary file specified by filename to the specified
- * C++ ostream
+ * C++ ostream. The file is sent with sendfile() when the stream is
+ * backed by a file descriptor.
  *
  * @param filename The name of the file to stream back to the requester
  * @param strm C++ ostream to write the contents of the file to
+ * @param log Record the bytes encoded and sent here
  * @throws BESInternalError if problem opening the file
  */
-void JPEG2000Transmitter::return_temp_stream(const string &filename, ostream &strm)
+void JPEG2000Transmitter::return_temp_stream(const string &filename, ostream &strm, FONgRequestLog &log)
 {
-    ifstream os;
-    os.open(filename.c_str(), ios::binary | ios::in);
-    if (!os)
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
         throw BESInternalError("Cannot connect to data source", __FILE__, __LINE__);
 
-    char block[4096];
-    os.read(block, sizeof block);
-    int nbytes = os.gcount();
-    if (nbytes == 0) {
-        os.close();
+    struct stat st;
+    if (fstat(fd, &st) == -1 || st.st_size == 0) {
+        close(fd);
         throw BESInternalError("Internal server error, got zero count on stream buffer.", __FILE__, __LINE__);
     }
 
+    log.set_bytes_encoded(st.st_size);
+
+    JPEG2000Transmitter::send_http_header(filename, strm);
+
+    try {
+        log.add_bytes_sent(FONgUtils::send_file(fd, strm));
+    }
+    catch (...) {
+        close(fd);
+        throw;
+    }
+
+    close(fd);
+}
+
+
+/** @brief Write the HTTP response header, if needed
+ *
+ * @param filename Name used for the Content-Disposition header
+ * @param strm C++ ostream to write the header to
+ */
+void JPEG2000Transmitter::send_http_header(const string &filename, ostream &strm)
+{
     bool found = false;
     string context = "transmit_protocol";
     string protocol = BESContextManager::TheManager()->get_context(context, found);
@@ -284,14 +377,43 @@ void JPEG2000Transmitter::return_temp_stream(const string &filename, ostream &st
         strm << "Content-Disposition: filename=" << filename << ".jp2;\n\n";
         strm << flush;
     }
-    strm.write(block, nbytes);
+}
 
-    while (os) {
-        os.read(block, sizeof block);
-        nbytes = os.gcount();
-        strm.write(block, nbytes);
+/** @brief Options that change the JPEG2000 built for a request
+ *
+ * This is part of the response cache key.
+ */
+string JPEG2000Transmitter::options_key()
+{
+    return string("version=") + MODULE_VERSION + "," + FONgTransform::jpeg2000_options_key();
+}
+
+/** @brief Return a cached response, if there is one
+ *
+ * @param cache The response cache
+ * @param cache_key The key for this request
+ * @param strm C++ ostream to write the cached JPEG2000 to
+ * @param log Record the bytes sent here
+ * @return True if the response was found in the cache and sent
+ */
+bool JPEG2000Transmitter::return_cached_stream(FONgResponseCache *cache, const string &cache_key, ostream &strm,
+    FONgRequestLog &log)
+{
+    unsigned long long size = 0;
+    int fd = cache->get_read_fd(cache_key, size);
+    if (fd == -1)
+        return false;
+
+    try {
+        JPEG2000Transmitter::send_http_header("jpeg2000", strm);
+        log.add_bytes_sent(FONgUtils::send_file(fd, strm, size));
+    }
+    catch (...) {
+        close(fd);
+        throw;
     }
 
-    os.close();
-}
+    close(fd);
 
+    return true;
+}
@@ -28,6 +28,8 @@
 #include <BESBasicTransmitter.h>
 
 class BESContainer;
+class FONgResponseCache;
+class FONgRequestLog;
 
 /** @brief BESTransmitter class named "geotiff" that transmits an OPeNDAP
  * data object as a geotiff file
@@ -40,7 +42,11 @@ class BESContainer;
  */
 class JPEG2000Transmitter: public BESBasicTransmitter {
 private:
-    static void return_temp_stream(const string &filename, ostream &strm);
+    static void return_temp_stream(const string &filename, ostream &strm, FONgRequestLog &log);
+    static void send_http_header(const string &filename, ostream &strm);
+    static bool return_cached_stream(FONgResponseCache *cache, const string &cache_key, ostream &strm,
+        FONgRequestLog &log);
+    static string options_key();
     static string temp_dir;
 
 
@@ -0,0 +1,168 @@
+// StatisticsTransmitter.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#include "config.h"
+
+#include <iostream>
+#include <sstream>
+
+#include <DataDDS.h>
+#include <escaping.h>
+
+using namespace libdap;
+
+#include "StatisticsTransmitter.h"
+#include "FONgTransform.h"
+#include "FONgRequestLog.h"
+
+#include <BESInternalError.h>
+#include <BESDapError.h>
+#include <BESContextManager.h>
+#include <BESDataDDSResponse.h>
+#include <BESDapNames.h>
+#include <BESDataNames.h>
+#include <BESDebug.h>
+#include <DapFunctionUtils.h>
+
+/** @brief Construct the StatisticsTransmitter
+ *
+ * @note The mapping from a 'returnAs' of "statistics" to this code is
+ * made in the FONgModule class.
+ *
+ * @see FONgModule
+ */
+StatisticsTransmitter::StatisticsTransmitter() : BESBasicTransmitter()
+{
+    // DATA_SERVICE == "dods"
+    add_method(DATA_SERVICE, StatisticsTransmitter::send_data_as_statistics);
+}
+
+/** @brief The static method registered to transmit the statistics of
+ * OPeNDAP data objects
+ *
+ * The constraint is evaluated as it is for a GeoTiff response, but the
+ * variables are not read here; FONgTransform reads each band a window at
+ * a time (see FONg.MemoryBudget) while it finds the band's statistics. The
+ * response is built in memory before anything is written, so errors are
+ * returned as errors and not as a partial document.
+ *
+ * @param obj The BESResponseObject containing the OPeNDAP DataDDS object
+ * @param dhi BESDataHandlerInterface containing information about the
+ * request and response
+ * @throws BESInternalError if the response is not an OPeNDAP DataDDS or if
+ * there are any problems reading the data
+ */
+void StatisticsTransmitter::send_data_as_statistics(BESResponseObject *obj, BESDataHandlerInterface &dhi)
+{
+    BESDataDDSResponse *bdds = dynamic_cast<BESDataDDSResponse *>(obj);
+    if (!bdds)
+        throw BESInternalError("cast error", __FILE__, __LINE__);
+
+    DDS *dds = bdds->get_dds();
+    if (!dds)
+        throw BESInternalError("No DataDDS has been created for transmit", __FILE__, __LINE__);
+
+    ostream &strm = dhi.get_output_stream();
+    if (!strm)
+        throw BESInternalError("Output stream is not set, cannot return as", __FILE__, __LINE__);
+
+    // Logs the time and bytes of each phase when this function returns
+    FONgRequestLog log("statistics");
+    log.set_dataset(dds->get_dataset_name());
+
+    BESDEBUG("fong2", "StatisticsTransmitter::send_data_as_statistics - parsing the constraint" << endl);
+
+    string ce = www2id(dhi.data[POST_CONSTRAINT], "%", "%20%26");
+    try {
+        bdds->get_ce().parse_constraint(ce, *dds);
+    }
+    catch (Error &e) {
+        throw BESDapError("Failed to parse the constraint expression: " + e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
+    }
+    catch (...) {
+        throw BESInternalError("Failed to parse the constraint expression: Unknown exception caught", __FILE__, __LINE__);
+    }
+
+    log.phase("parse_ce");
+
+    ostringstream json;
+    try {
+        // Function results are read when the functions run
+        if (bdds->get_ce().function_clauses()) {
+            DDS *tmp_dds = bdds->get_ce().eval_function_clauses(*dds);
+            delete dds;
+            dds = tmp_dds;
+            bdds->set_dds(dds);
+
+            promote_function_output_structures(dds);
+            log.phase("read");
+        }
+
+        FONgTransform::validate(dds);
+        log.phase("validate");
+
+        FONgTransform ft(dds, bdds->get_ce());
+        ft.transform_to_statistics(json);
+
+        log.transform_phase(ft.convert_time());
+        log.set_bytes_read(ft.bytes_read());
+    }
+    catch (Error &e) {
+        throw BESDapError("Failed to compute statistics: " + e.get_error_message(), false, e.get_error_code(), __FILE__, __LINE__);
+    }
+    catch (BESError &e) {
+        throw;
+    }
+    catch (...) {
+        throw BESInternalError("Fileout GDAL, was not able to compute statistics, unknown error", __FILE__, __LINE__);
+    }
+
+    string response = json.str();
+    log.set_bytes_encoded(response.length());
+
+    StatisticsTransmitter::send_http_header(strm);
+    strm << response << flush;
+    log.add_bytes_sent(response.length());
+    log.phase("send");
+
+    log.set_status("ok");
+
+    BESDEBUG("fong2", "StatisticsTransmitter::send_data_as_statistics - done transmitting statistics" << endl);
+}
+
+/** @brief Write the HTTP response header, if needed
+ *
+ * @param strm C++ ostream to write the header to
+ */
+void StatisticsTransmitter::send_http_header(ostream &strm)
+{
+    bool found = false;
+    string protocol = BESContextManager::TheManager()->get_context("transmit_protocol", found);
+    if (protocol == "HTTP") {
+        strm << "HTTP/1.0 200 OK\n";
+        strm << "Content-type: application/json\n";
+        strm << "Content-Description: " << "BES dataset statistics" << "\n\n";
+        strm << flush;
+    }
+}
@@ -0,0 +1,55 @@
+// StatisticsTransmitter.h
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+#ifndef A_StatisticsTransmitter_h
+#define A_StatisticsTransmitter_h 1
+
+#include <BESBasicTransmitter.h>
+
+/** @brief BESTransmitter class named "statistics" that transmits the
+ * statistics of the bands a GeoTiff would have, as JSON
+ *
+ * The StatisticsTransmitter finds the same bands as the GeoTiffTransmitter
+ * and returns the number of valid pixels, the minimum, maximum, mean and
+ * standard deviation of each one. No file is made and GDAL encodes
+ * nothing, so this is much cheaper than building a GeoTiff just to read
+ * its statistics.
+ *
+ * @see FONgTransform::transform_to_statistics()
+ * @see BESBasicTransmitter
+ */
+class StatisticsTransmitter: public BESBasicTransmitter {
+private:
+    static void send_http_header(ostream &strm);
+
+public:
+    StatisticsTransmitter();
+    virtual ~StatisticsTransmitter()
+    {
+    }
+
+    static void send_data_as_statistics(BESResponseObject *obj, BESDataHandlerInterface &dhi);
+};
+
+#endif // A_StatisticsTransmitter_h
@@ -0,0 +1,387 @@
+// fong_bench.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+// End to end benchmark of FONgTransform. Builds a DDS of synthetic Grids
+// in memory, then times transform_to_geotiff(), transform_to_cog() and
+// transform_to_jpeg2000() on it. Each phase prints one line of
+// name=value pairs: wall time, input MB/s, peak RSS and the size of the
+// response, so results can be collected and compared across releases.
+//
+// Build with 'make fong_bench'.
+// Usage: fong_bench [-w width] [-h height] [-b bands] [-t type]
+//                   [-m missing_fraction] [-p random|rows] [-r repeats]
+//                   [-f geotiff,cog,jpeg2000] [-d dir] [-P]
+//
+// Peak RSS is the process' high water mark. Where Linux allows it, the
+// mark is reset before each phase so each line shows that phase's peak.
+
+#include "config.h"
+
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <gdal.h>
+#include <gdal_priv.h>
+
+#include <BaseTypeFactory.h>
+#include <DDS.h>
+#include <Grid.h>
+#include <Array.h>
+#include <AttrTable.h>
+#include <ConstraintEvaluator.h>
+#include <Error.h>
+
+#include <BESError.h>
+
+#include "FONgRequestHandler.h"
+#include "FONgTransform.h"
+#include "FONgBufferPool.h"
+
+#ifndef MODULE_VERSION
+#define MODULE_VERSION "unknown"
+#endif
+
+using namespace std;
+using namespace libdap;
+
+// The bench's parameters
+struct bench_options {
+    int width;
+    int height;
+    int bands;
+    string type;
+    double missing;
+    string pattern;
+    int repeats;
+    string formats;
+    string dir;
+    bool pipeline;
+
+    bench_options() :
+        width(2048), height(1024), bands(1), type("float32"), missing(0.1), pattern("random"), repeats(3),
+        formats("geotiff,cog,jpeg2000"), dir("/tmp"), pipeline(false)
+    {
+    }
+};
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1.0e6;
+}
+
+// Reset the process' peak RSS (Linux 4.0 and later); false if not possible
+static bool reset_peak_rss()
+{
+    ofstream clear_refs("/proc/self/clear_refs");
+    if (!clear_refs)
+        return false;
+    clear_refs << "5" << endl;
+    return clear_refs.good();
+}
+
+// Peak RSS in kB, from /proc if possible
+static long peak_rss_kb()
+{
+    ifstream status("/proc/self/status");
+    string line;
+    while (getline(status, line)) {
+        if (line.compare(0, 6, "VmHWM:") == 0)
+            return atol(line.c_str() + 6);
+    }
+
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+/** Make the values of one band: a gradient, so the compressors have
+ * something realistic to do, with a fraction of the values set to
+ * no_data. The 'random' pattern scatters them; 'rows' puts them in a
+ * block at the top of the band. */
+template <typename T>
+static void set_values(Array *a, const bench_options &o, int band, T no_data)
+{
+    int n = o.width * o.height;
+    vector<T> values(n);
+    for (int y = 0; y < o.height; ++y)
+        for (int x = 0; x < o.width; ++x)
+            values[y * o.width + x] = static_cast<T>((band * 7 + x / 8 + y / 8) % 250);
+
+    if (o.pattern == "rows") {
+        int rows = static_cast<int>(o.missing * o.height);
+        for (int i = 0; i < rows * o.width; ++i)
+            values[i] = no_data;
+    }
+    else {
+        srand(42 + band);
+        for (int i = 0; i < n; ++i)
+            if (rand() < o.missing * RAND_MAX)
+                values[i] = no_data;
+    }
+
+    a->set_value(values, n);
+    a->set_read_p(true);
+}
+
+// A lat or lon map of n evenly spaced values from first to last
+static Array *make_map(BaseTypeFactory &factory, const string &name, const string &units, int n, double first, double last)
+{
+    Array *map = factory.NewArray(name, factory.NewFloat64(name));
+    map->append_dim(n, name);
+
+    vector<dods_float64> values(n);
+    for (int i = 0; i < n; ++i)
+        values[i] = first + (n > 1 ? i * (last - first) / (n - 1) : 0);
+    map->set_value(values, n);
+    map->set_read_p(true);
+
+    map->get_attr_table().append_attr("units", "String", units);
+
+    return map;
+}
+
+// One synthetic band: a Grid with lat and lon maps and a _FillValue
+static Grid *make_grid(BaseTypeFactory &factory, const bench_options &o, int band)
+{
+    ostringstream oss;
+    oss << "band" << band;
+    string name = oss.str();
+    Grid *grid = factory.NewGrid(name);
+
+    Array *a = 0;
+    string fill;
+    if (o.type == "byte") {
+        a = factory.NewArray(name, factory.NewByte(name));
+        fill = "255";
+    }
+    else if (o.type == "int16") {
+        a = factory.NewArray(name, factory.NewInt16(name));
+        fill = "-32768";
+    }
+    else if (o.type == "uint16") {
+        a = factory.NewArray(name, factory.NewUInt16(name));
+        fill = "65535";
+    }
+    else if (o.type == "int32") {
+        a = factory.NewArray(name, factory.NewInt32(name));
+        fill = "-999999";
+    }
+    else if (o.type == "uint32") {
+        a = factory.NewArray(name, factory.NewUInt32(name));
+        fill = "4294967295";
+    }
+    else if (o.type == "float32") {
+        a = factory.NewArray(name, factory.NewFloat32(name));
+        fill = "-9999";
+    }
+    else if (o.type == "float64") {
+        a = factory.NewArray(name, factory.NewFloat64(name));
+        fill = "-9999";
+    }
+    else {
+        delete grid;
+        throw Error("Unknown type: " + o.type);
+    }
+
+    a->append_dim(o.height, "lat");
+    a->append_dim(o.width, "lon");
+
+    if (o.missing > 0)
+        a->get_attr_table().append_attr("_FillValue", a->var()->type_name(), fill);
+
+    if (o.type == "byte")
+        set_values<dods_byte>(a, o, band, 255);
+    else if (o.type == "int16")
+        set_values<dods_int16>(a, o, band, -32768);
+    else if (o.type == "uint16")
+        set_values<dods_uint16>(a, o, band, 65535);
+    else if (o.type == "int32")
+        set_values<dods_int32>(a, o, band, -999999);
+    else if (o.type == "uint32")
+        set_values<dods_uint32>(a, o, band, 4294967295U);
+    else if (o.type == "float32")
+        set_values<dods_float32>(a, o, band, -9999);
+    else
+        set_values<dods_float64>(a, o, band, -9999);
+
+    grid->add_var_nocopy(a, libdap::array);
+    grid->add_var_nocopy(make_map(factory, "lat", "degrees_north", o.height, 90, -90), maps);
+    grid->add_var_nocopy(make_map(factory, "lon", "degrees_east", o.width, -180, 180), maps);
+
+    grid->set_send_p(true);
+    grid->set_read_p(true);
+
+    return grid;
+}
+
+// Bytes of band data the transforms read
+static unsigned long long input_bytes(const bench_options &o)
+{
+    unsigned long long size = 8;
+    if (o.type == "byte")
+        size = 1;
+    else if (o.type == "int16" || o.type == "uint16")
+        size = 2;
+    else if (o.type != "float64")
+        size = 4;
+
+    return size * o.width * o.height * o.bands;
+}
+
+/** Run one phase o.repeats times and print its line. The response is
+ * removed after each run. */
+static void run(const string &phase, DDS &dds, const bench_options &o)
+{
+    string file = o.dir + "/fong_bench_" + phase;
+    bool reset = reset_peak_rss();
+    unsigned long long hits = FONgBufferPool::hits(), misses = FONgBufferPool::misses();
+
+    double wall = 0;
+    long long output = 0;
+    for (int r = 0; r < o.repeats; ++r) {
+        ConstraintEvaluator ce;
+        FONgTransform t(&dds, ce, file);
+
+        double start = now();
+        if (phase == "geotiff")
+            t.transform_to_geotiff();
+        else if (phase == "cog")
+            t.transform_to_cog();
+        else
+            t.transform_to_jpeg2000();
+        wall += now() - start;
+
+        struct stat sb;
+        output = (stat(file.c_str(), &sb) == 0) ? sb.st_size : -1;
+        unlink(file.c_str());
+    }
+
+    wall /= o.repeats;
+    double mb = input_bytes(o) / (1024.0 * 1024.0);
+
+    printf("version=%s phase=%s type=%s width=%d height=%d bands=%d missing=%g pattern=%s pipeline=%s repeats=%d "
+        "wall_s=%.4f MBps=%.1f peak_rss_kB=%ld peak_rss_reset=%s output_bytes=%lld pool_hits=%llu pool_misses=%llu\n",
+        MODULE_VERSION, phase.c_str(), o.type.c_str(), o.width, o.height, o.bands, o.missing, o.pattern.c_str(),
+        o.pipeline ? "yes" : "no", o.repeats, wall, mb / wall, peak_rss_kb(), reset ? "yes" : "no", output,
+        FONgBufferPool::hits() - hits, FONgBufferPool::misses() - misses);
+    fflush(stdout);
+}
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-w width] [-h height] [-b bands] [-t type] [-m missing_fraction]\n"
+        "          [-p random|rows] [-r repeats] [-f geotiff,cog,jpeg2000] [-d dir] [-P]\n"
+        "  type is one of byte, int16, uint16, int32, uint32, float32, float64\n"
+        "  -P reads and writes the GeoTiff bands in a pipeline (FONg.Pipeline)\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+    bench_options o;
+
+    int c;
+    while ((c = getopt(argc, argv, "w:h:b:t:m:p:r:f:d:P")) != -1) {
+        switch (c) {
+        case 'w': o.width = atoi(optarg); break;
+        case 'h': o.height = atoi(optarg); break;
+        case 'b': o.bands = atoi(optarg); break;
+        case 't': o.type = optarg; break;
+        case 'm': o.missing = strtod(optarg, 0); break;
+        case 'p': o.pattern = optarg; break;
+        case 'r': o.repeats = atoi(optarg); break;
+        case 'f': o.formats = optarg; break;
+        case 'd': o.dir = optarg; break;
+        case 'P': o.pipeline = true; break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (o.width < 1 || o.height < 1 || o.bands < 1 || o.repeats < 1 || o.missing < 0 || o.missing > 1
+        || (o.pattern != "random" && o.pattern != "rows")) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    // The defaults from fong.conf; the BES keys are not read here
+    FONgRequestHandler::in_memory_max_size = 64ULL * 1024 * 1024;
+    FONgRequestHandler::memory_budget = 256ULL * 1024 * 1024;
+    FONgRequestHandler::pipeline = o.pipeline;
+    FONgRequestHandler::pipeline_block_size = 16ULL * 1024 * 1024;
+    FONgRequestHandler::overview_levels = "AUTO";
+    FONgRequestHandler::overview_resampling = "AVERAGE";
+    FONgRequestHandler::jp2_quality = "100";
+    FONgRequestHandler::jp2_reversible = true;
+    FONgRequestHandler::band_threads = 4;
+    FONgRequestHandler::buffer_pool_size = 256ULL * 1024 * 1024;
+    FONgBufferPool::initialize(FONgRequestHandler::buffer_pool_size, false);
+
+    GDALAllRegister();
+    CPLSetErrorHandler(CPLQuietErrorHandler);
+
+    try {
+        BaseTypeFactory factory;
+        DDS dds(&factory, "fong_bench");
+        for (int b = 0; b < o.bands; ++b)
+            dds.add_var_nocopy(make_grid(factory, o, b));
+
+        stringstream formats(o.formats);
+        string phase;
+        while (getline(formats, phase, ',')) {
+            if (phase != "geotiff" && phase != "cog" && phase != "jpeg2000") {
+                usage(argv[0]);
+                return 1;
+            }
+#if !JP2
+            if (phase == "jpeg2000") {
+                fprintf(stderr, "%s: built without JPEG2000 support; skipping that phase\n", argv[0]);
+                continue;
+            }
+#endif
+            run(phase, dds, o);
+        }
+    }
+    catch (Error &e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.get_error_message().c_str());
+        return 1;
+    }
+    catch (BESError &e) {
+        fprintf(stderr, "%s: %s\n", argv[0], e.get_message().c_str());
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,139 @@
+// fong_scale_bench.cc
+
+// This file is part of BES GDAL File Out Module
+
+// Copyright (c) 2012 OPeNDAP, Inc.
+// Author: James Gallagher <jgallagher@opendap.org>
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+//
+// You can contact University Corporation for Atmospheric Research at
+// 3080 Center Green Drive, Boulder, CO 80301
+
+// Microbenchmark for the no data remapping done by
+// FONgTransform::m_scale_data(). Compares the std::set histogram the
+// module used to build with the single pass FONgExtrema kernel, on a
+// synthetic band where a fraction of the pixels hold a no data value.
+//
+// Build with 'make fong_scale_bench'.
+// Usage: fong_scale_bench [pixels [missing_fraction [repeats]]]
+
+#include <sys/time.h>
+
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <set>
+#include <vector>
+#include <string>
+
+#include "FONgExtrema.h"
+
+using namespace std;
+
+static double now()
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return tv.tv_sec + tv.tv_usec / 1.0e6;
+}
+
+// The algorithm m_scale_data() used before FONgExtrema, negative no data
+template <typename T>
+static void set_scale(T *data, unsigned long n, double no_data)
+{
+    set<T> hist;
+    for (unsigned long i = 0; i < n; ++i)
+        hist.insert(data[i]);
+
+    if (hist.size() < 2)
+        return;
+
+    typename set<T>::iterator i = hist.begin();
+    double smallest = *(++i);
+    if (fabs(smallest + no_data) > 1) {
+        smallest -= 1.0;
+        for (unsigned long i = 0; i < n; ++i) {
+            if (data[i] <= no_data)
+                data[i] = static_cast<T>(smallest);
+        }
+    }
+}
+
+// The same using FONgExtrema
+template <typename T>
+static void extrema_scale(T *data, unsigned long n, double no_data)
+{
+    FONgExtrema extrema(no_data);
+    extrema.add(data, n);
+
+    if (!extrema.has_second() || extrema.at_or_below_no_data() == 0)
+        return;
+
+    double smallest = extrema.second_min();
+    if (fabs(smallest + no_data) > 1)
+        FONgExtrema::replace(data, n, true, no_data, static_cast<T>(smallest - 1.0));
+}
+
+template <typename T>
+static void run(const string &type, unsigned long n, double missing, int repeats, T no_data)
+{
+    vector<T> band(n);
+    srand(42);
+    for (unsigned long i = 0; i < n; ++i)
+        band[i] = (rand() < missing * RAND_MAX) ? no_data : static_cast<T>(rand() % 100000 / 10.0);
+
+    double set_time = 0, extrema_time = 0;
+    bool same = true;
+    for (int r = 0; r < repeats; ++r) {
+        vector<T> a(band), b(band);
+
+        double start = now();
+        set_scale(&a[0], n, no_data);
+        set_time += now() - start;
+
+        start = now();
+        extrema_scale(&b[0], n, no_data);
+        extrema_time += now() - start;
+
+        same = same && a == b;
+    }
+
+    set_time /= repeats;
+    extrema_time /= repeats;
+    double mb = n * sizeof(T) / (1024.0 * 1024.0);
+
+    printf("type=%s pixels=%lu set_s=%.4f set_MBps=%.1f extrema_s=%.4f extrema_MBps=%.1f speedup=%.1f same=%s\n",
+        type.c_str(), n, set_time, mb / set_time, extrema_time, mb / extrema_time, set_time / extrema_time,
+        same ? "yes" : "NO");
+}
+
+int main(int argc, char *argv[])
+{
+    unsigned long n = argc > 1 ? strtoul(argv[1], 0, 10) : 4 * 1024 * 1024;
+    double missing = argc > 2 ? strtod(argv[2], 0) : 0.1;
+    int repeats = argc > 3 ? atoi(argv[3]) : 3;
+
+    if (n == 0 || repeats <= 0) {
+        fprintf(stderr, "Usage: %s [pixels [missing_fraction [repeats]]]\n", argv[0]);
+        return 1;
+    }
+
+    run<double>("float64", n, missing, repeats, -1.0e34);
+    run<float>("float32", n, missing, repeats, -1.0e34f);
+    run<short>("int16", n, missing, repeats, -32768);
+
+    return 0;
+}
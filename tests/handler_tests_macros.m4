@@ -230,3 +230,27 @@ m4_define([AT_BESCMD_BINARY_FILE_RESPONSE_TEST],
     [_AT_BESCMD_BINARY_FILE_RESPONSE_TEST([$abs_srcdir/$1], [$abs_srcdir/$1.$2], [$3])]
 )
 
+
+dnl The same as AT_BESCMD_BINARY_FILE_RESPONSE_TEST, but run with only the
+dnl module's GDAL drivers registered (FONg.GDALRegisterAll=false).
+
+m4_define([_AT_BESCMD_LEAN_BINARY_FILE_RESPONSE_TEST], [dnl
+
+    AT_SETUP([BESCMD $1 (FONg.GDALRegisterAll=false)])
+    AT_KEYWORDS([file])
+
+    input=$1
+    baseline=$2
+
+    AT_CHECK([grep -v '^FONg.GDALRegisterAll=' $abs_builddir/bes.conf > bes_lean.conf])
+    AT_CHECK([echo "FONg.GDALRegisterAll=false" >> bes_lean.conf])
+    AT_CHECK([besstandalone -c bes_lean.conf -i $input], [], [stdout])
+    AT_CHECK([cmp $baseline stdout])
+    AT_XFAIL_IF([test "$3" = "xfail"])
+
+    AT_CLEANUP
+])
+
+m4_define([AT_BESCMD_LEAN_BINARY_FILE_RESPONSE_TEST],
+    [_AT_BESCMD_LEAN_BINARY_FILE_RESPONSE_TEST([$abs_srcdir/$1], [$abs_srcdir/$1.$2], [$3])]
+)